@@ -0,0 +1,200 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_ARENA_POOL_H
+#define QUOTE_SERVER_ARENA_POOL_H
+
+#include <google/protobuf/arena.h>
+
+#include <atomic>
+#include <new>
+
+using google::protobuf::Arena;
+using google::protobuf::ArenaOptions;
+
+class arena_pool;
+
+/// 由arena_pool管理的Arena。Arena使用紧跟在对象后面的初始内存块，复位后不再向堆申请内存。
+/// 对象和初始内存块一次分配，见create()。
+class pooled_arena{
+    friend class arena_pool;
+public:
+    Arena* arena(){
+        return &arena_;
+    }
+
+private:
+    static pooled_arena* create(arena_pool* owner, size_t block_size){
+        void* mem = ::operator new(sizeof(pooled_arena) + block_size);
+        return new (mem) pooled_arena(owner, block_size);
+    }
+
+    static void destroy(pooled_arena* p){
+        p->~pooled_arena();
+        ::operator delete(p);
+    }
+
+    pooled_arena(arena_pool* owner, size_t block_size)
+            : block_size_(block_size)
+            , arena_(options(this + 1, block_size))
+            , owner_(owner)
+            , next_(nullptr)
+            , cached_bytes_(0){
+    }
+
+    static ArenaOptions options(void* block, size_t block_size){
+        ArenaOptions opt;
+        opt.initial_block = static_cast<char*>(block);
+        opt.initial_block_size = block_size;
+        return opt;
+    }
+
+    size_t block_size_;
+    Arena arena_;
+    arena_pool* owner_;
+    pooled_arena* next_;
+    size_t cached_bytes_;   // 在池中时计入的字节数
+};
+
+/// 线程私有的Arena池，用来避免每个消息都new/delete一个Arena。
+/// \li 每个线程通过local()得到自己的池，acquire()只在本线程调用，不需要同步。
+/// \li release()可以在任意线程调用，Arena被无锁地放回所属线程的池中，该线程的本地链表用完时一次性取回。
+/// \li 初始内存块的大小随实际用量自适应：某个Arena的用量超出初始内存块时，归还时将其扩大为能容纳该用量的2的幂，
+///     之后新建的Arena也使用该大小，最大为max_block_size。稳态下不再有堆内存分配。
+/// \li Arena的内存块属于最后一次复位它的线程，所以只在acquire()时，在调用线程上复位。
+/// \li 池中缓存的Arena按字节数限制（包括复位前仍然持有的额外内存块），超出max_cached_bytes时归还的Arena直接释放，
+///     空闲时每个线程最多占用这么多内存。
+/// \li 线程退出后，池在最后一个Arena归还时释放。
+class arena_pool{
+public:
+    /// 当前线程的池。
+    static arena_pool& local(){
+        static thread_local holder h;
+        return *h.pool;
+    }
+
+    /// 从当前线程的池中取出一个空的Arena，池为空时新建一个。
+    pooled_arena* acquire(){
+        if( local_ == nullptr ){
+            local_ = remote_.exchange(nullptr, std::memory_order_acquire);
+        }
+        refs_.fetch_add(1, std::memory_order_relaxed);
+        if( local_ == nullptr ){
+            return pooled_arena::create(this, block_size_.load(std::memory_order_relaxed));
+        }
+        pooled_arena* p = local_;
+        local_ = p->next_;
+        cached_bytes_.fetch_sub(p->cached_bytes_, std::memory_order_relaxed);
+        p->arena_.Reset();
+        return p;
+    }
+
+    /// 归还Arena。可以在任意线程调用。
+    /// Arena在下次被acquire()时才复位，其中的对象到那时才析构。
+    static void release(pooled_arena* p){
+        arena_pool* pool = p->owner_;
+        pool->recycle(p);
+        pool->unref();
+    }
+
+    /// 新建Arena时使用的初始内存块大小。
+    size_t block_size() const{
+        return block_size_.load(std::memory_order_relaxed);
+    }
+
+    /// 池中缓存的Arena占用的字节数。
+    size_t cached_bytes() const{
+        return cached_bytes_.load(std::memory_order_relaxed);
+    }
+
+private:
+    enum { min_block_size = 256 };
+
+    /// 线程退出时释放对池的引用。
+    struct holder{
+        holder(): pool(new arena_pool()) {}
+        ~holder(){ pool->unref(); }
+        arena_pool* pool;
+    };
+
+    /// \param max_cached_bytes 池中缓存的Arena最多占用的字节数，超出的部分在release()时释放。
+    /// \param max_block_size 初始内存块的最大字节数。更大的消息仍可分配，但会使用额外的堆内存块。
+    arena_pool(size_t max_cached_bytes = 8 * 1024 * 1024, size_t max_block_size = 1024 * 1024)
+            : max_cached_bytes_(max_cached_bytes)
+            , max_block_size_(max_block_size > min_block_size ? max_block_size : size_t(min_block_size))
+            , block_size_(min_block_size)
+            , local_(nullptr)
+            , remote_(nullptr)
+            , cached_bytes_(0)
+            , refs_(1){
+    }
+
+    ~arena_pool(){
+        destroy(local_);
+        destroy(remote_.exchange(nullptr));
+    }
+
+    arena_pool(const arena_pool&) = delete;
+    arena_pool& operator=(const arena_pool&) = delete;
+
+    void recycle(pooled_arena* p){
+        size_t allocated = static_cast<size_t>(p->arena_.SpaceAllocated());
+        if( allocated > p->block_size_ && p->block_size_ < max_block_size_ ){
+            size_t size = p->block_size_;
+            while( size < allocated && size < max_block_size_ ){
+                size *= 2;
+            }
+            size = size < max_block_size_ ? size : max_block_size_;
+            pooled_arena::destroy(p);
+            p = pooled_arena::create(this, size);
+
+            size_t current = block_size_.load(std::memory_order_relaxed);
+            while( current < size && !block_size_.compare_exchange_weak(current, size) ){
+            }
+        }
+
+        // 没有复位的Arena仍然持有超出初始内存块的部分，一并计入
+        size_t allocated_now = static_cast<size_t>(p->arena_.SpaceAllocated());
+        size_t bytes = sizeof(pooled_arena) + (allocated_now > p->block_size_ ? allocated_now : p->block_size_);
+        if( cached_bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes > max_cached_bytes_ ){
+            cached_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+            pooled_arena::destroy(p);
+            return;
+        }
+        p->cached_bytes_ = bytes;
+
+        // 只有所属线程会取走整条链表，这里只入栈，没有ABA问题
+        pooled_arena* head = remote_.load(std::memory_order_relaxed);
+        do{
+            p->next_ = head;
+        } while( !remote_.compare_exchange_weak(head, p,
+                                                std::memory_order_release, std::memory_order_relaxed) );
+    }
+
+    void unref(){
+        if( refs_.fetch_sub(1, std::memory_order_acq_rel) == 1 ){
+            delete this;
+        }
+    }
+
+    static void destroy(pooled_arena* p){
+        while( p != nullptr ){
+            pooled_arena* next = p->next_;
+            pooled_arena::destroy(p);
+            p = next;
+        }
+    }
+
+private:
+    const size_t max_cached_bytes_;
+    const size_t max_block_size_;
+    std::atomic<size_t> block_size_;
+
+    pooled_arena* local_;                  // 只在所属线程访问
+    std::atomic<pooled_arena*> remote_;    // 其他线程归还的Arena
+    std::atomic<size_t> cached_bytes_;     // local_和remote_中Arena的总字节数
+    std::atomic<long> refs_;               // 所属线程持有1个引用，每个借出的Arena持有1个引用
+};
+
+#endif //QUOTE_SERVER_ARENA_POOL_H
@@ -0,0 +1,41 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_CALL_HANDLER_H
+#define QUOTE_SERVER_CALL_HANDLER_H
+
+#include <grpc++/grpc++.h>
+
+/// 生成的调用类（参见codegen/async_call_plugin）回调的HANDLER的默认实现，什么也不做。
+/// HANDLER继承call_handler，只实现需要的函数。回调在编译期确定，不是虚函数，可以内联到生成的类中。
+/// 只对部分调用类实现某个函数时（如只处理服务端调用的on_start()），须用using call_handler::on_start引入默认实现，
+/// 否则派生类的同名函数会隐藏这里的默认实现。
+/// CALL为生成的调用类，MSG为读取到的数据类型。
+struct call_handler{
+    /// 客户端双向流调用发起前，可以通过call.get_writer()设置发送队列。
+    template<typename CALL>
+    void on_prepare(CALL&) {}
+
+    /// 调用开始：客户端调用建立，或者服务端接受了调用。
+    template<typename CALL>
+    void on_start(CALL&) {}
+
+    /// 读取到数据。msg只在回调期间有效，需要保留时调用call.hold()。
+    template<typename CALL, typename MSG>
+    void on_read(CALL&, const MSG&) {}
+
+    /// 数据已经写出，参见writer_callback::on_write()。
+    template<typename CALL>
+    void on_write(CALL&, int) {}
+
+    /// 客户端调用结束，之后调用被释放。
+    template<typename CALL>
+    void on_finish(CALL&, const grpc::Status&) {}
+
+    /// 服务端调用结束，之后调用被释放。
+    template<typename CALL>
+    void on_done(CALL&) {}
+};
+
+#endif //QUOTE_SERVER_CALL_HANDLER_H
@@ -6,14 +6,19 @@
 #define PROVIDER_CLIENT_IMPL_H
 
 #include "tag_base.h"
+#include "tag_registry.h"
+#include "cq_stats.h"
 
 #include <string>
 #include <thread>
-#include <set>
+#include <vector>
 #include <grpc++/grpc++.h>
+#include <grpc++/alarm.h>
 #include <grpc/support/log.h>
 #include <grpc/support/time.h>
 #include <atomic>
+#include <mutex>
+#include <random>
 
 using grpc::Channel;
 using grpc::ChannelCredentials;
@@ -47,47 +52,166 @@ public:
                           CompletionQueue* cq,
                           int minutes,
                           channel_state_callback* cb)
-    :channel_(channel), cq_(cq), minutes_(minutes){
+    :channel_(channel), cq_(cq), minutes_(minutes), watch_seconds_(0), stopped_(false){
         state_ = channel_->GetState(false);
-        system_clock::time_point deadline = system_clock::now() + chrono::minutes(minutes_);
-        channel_->NotifyOnStateChange(state_,  deadline, cq_, this );
         callback_ = cb;
     };
 
+    /// 开始观察。须在注册（参见client_impl::add_tag）之后调用。
+    void start(){
+        channel_->NotifyOnStateChange(state_, deadline(), cq_, tag() );
+    }
+
+    /// 持续观察：每次状态变化后自动重新注册，超时时间改为seconds秒。
+    /// 超时时间较短，可以在stop()之后较快地结束观察，完成队列才能关闭。参见ReconnectMode::IN_PLACE
+    void keep_watching(int seconds){
+        watch_seconds_.store(seconds);
+    }
+
+    /// 停止观察，之后不再重新注册。可以在任意线程中调用。
+    /// 返回后不会再有新的观察注册到完成队列上，调用者随后可以关闭完成队列。
+    void stop(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+    }
+
     /// 继承自tag_base, 用于处理channel的状态变化。
     virtual void process() {
         auto current_state = channel_->GetState(false);
         gpr_log(GPR_DEBUG, "channel state changed from %d to %d", state_, current_state);
         callback_->on_channel_state_changed(state_, current_state);
         state_ = current_state;
+        if( watch_seconds_.load() > 0 ){
+            restart();
+        }
     };
 
     /// 继承自tag_base, 用于处理超时，会自动重新注册一次观察。
     virtual void on_error() {
         // time out
         gpr_log(GPR_DEBUG, "channel_state_monitor time out, re-monite it");
-        system_clock::time_point deadline = system_clock::now() + minutes(minutes_);
-        channel_->NotifyOnStateChange(state_,  deadline, cq_, this );
+        restart();
     };
 
 private:
+    /// 未停止时重新注册观察。检查stopped_和注册在同一个锁内，与stop()互斥：
+    /// 否则stop()和关闭完成队列可能发生在检查之后、注册之前，观察会注册到已经关闭的完成队列上。
+    void restart(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        if( !stopped_ ){
+            start();
+        }
+    }
+
+    system_clock::time_point deadline() const{
+        int seconds = watch_seconds_.load();
+        if( seconds > 0 ){
+            return system_clock::now() + chrono::seconds(seconds);
+        }
+        return system_clock::now() + chrono::minutes(minutes_);
+    }
+
     std::shared_ptr<Channel> channel_;
     CompletionQueue* cq_;
     int minutes_;
+    std::atomic<int> watch_seconds_;
+    std::mutex mutex_;      // 保护stopped_，使检查和重新注册不会与stop()交错
+    bool stopped_;
     grpc_connectivity_state state_;
 
     channel_state_callback* callback_;
 };
 
 
+/// 重连定时器的回调接口。
+class reconnect_callback{
+public:
+    /// \param fired 等于true表示定时器到期；否则，定时器被取消。
+    virtual void on_reconnect_timer(bool fired) = 0;
+};
+
+/// 重连用的定时器，使用grpc::Alarm，在完成队列上回调。同一时刻只能有一个未到期的定时。
+class reconnect_timer : public tag_base{
+public:
+    reconnect_timer(CompletionQueue* cq, reconnect_callback* cb): cq_(cq), callback_(cb) {}
+
+    /// 设置定时。须在注册（参见client_impl::add_tag）之后调用。
+    void set(milliseconds delay){
+        alarm_.Set(cq_, system_clock::now() + delay, tag());
+    }
+
+    /// 取消定时，之后回调on_reconnect_timer(false)。
+    void cancel(){
+        alarm_.Cancel();
+    }
+
+    /// 继承自tag_base。定时器到期。
+    virtual void process() {
+        callback_->on_reconnect_timer(true);
+    }
+
+    /// 继承自tag_base。定时器被取消。
+    virtual void on_error() {
+        callback_->on_reconnect_timer(false);
+    }
+
+private:
+    grpc::Alarm alarm_;
+    CompletionQueue* cq_;
+    reconnect_callback* callback_;
+};
+
+/// 连接断开后的处理方式。
+/// \li RESTART：关闭完成队列，等待10秒后重新创建channel、stub和完成队列，然后调用on_run()。
+/// \li IN_PLACE：保留channel、stub、完成队列和工作线程，按指数退避（带随机抖动）触发重连，
+///     连接恢复后调用on_reconnect()，只重建断开的调用。
+enum class ReconnectMode { RESTART, IN_PLACE };
+
+/// ReconnectMode::IN_PLACE的退避参数。
+struct reconnect_backoff{
+    reconnect_backoff(): initial_ms(10), max_ms(5000), multiplier(2.0), jitter(0.2) {}
+
+    int initial_ms;       // 第一次重试的等待时间
+    int max_ms;           // 等待时间的上限
+    double multiplier;    // 每次重试后等待时间的倍数
+    double jitter;        // 随机抖动的比例，等待时间在[1-jitter, 1+jitter]倍之间
+};
+
+/// 重连的统计。
+struct reconnect_stats{
+    uint64_t count;                 // 断开后重新连接的次数
+    histogram_snapshot duration_us; // 从断开到恢复READY的时间（微秒）
+};
+
 /// 对gRPC客户端的抽象基类。采用异步模式来响应客户端。
 /// \tparam SERVICE 服务的类型。
 template<typename SERVICE>
-class client_impl : public channel_state_callback{
+class client_impl : public channel_state_callback, public reconnect_callback{
 public:
     typedef client_impl<SERVICE> this_type;
 
-    client_impl(){
+    client_impl()
+            : cq_count_(1), threads_per_cq_(1), next_cq_(0)
+            , mode_(ReconnectMode::RESTART), connected_(false), ever_connected_(false)
+            , timer_pending_(false), next_delay_ms_(0), reconnect_count_(0)
+            , rng_(std::random_device()()){
+    }
+
+    /// 设置连接断开后的处理方式，须在run()之前调用。默认为ReconnectMode::RESTART。
+    /// \param mode 处理方式。
+    /// \param backoff ReconnectMode::IN_PLACE的退避参数，同时设置为gRPC底层的重连退避参数。
+    void set_reconnect(ReconnectMode mode, reconnect_backoff backoff = reconnect_backoff()){
+        mode_ = mode;
+        backoff_ = backoff;
+    }
+
+    /// 重连的统计，可以在任意线程中调用。
+    reconnect_stats get_reconnect_stats(){
+        std::lock_guard<std::mutex> lock(reconnect_mutex_);
+        reconnect_stats stats;
+        stats.count = reconnect_count_;
+        stats.duration_us.add(reconnect_hist_);
+        return stats;
     }
 
     /// 获得创建channel用的ChannelCredentials。默认使用grpc::InsecureChannelCredentials。
@@ -98,34 +222,69 @@ public:
     }
 
     /// 注册tag_base, 客户端只处理注册过的tag_base，参考srv()函数。
+    /// 注册后才能用tag_base::tag()发起异步操作。可以在任意线程中调用。
     /// \param tags 需要注册的tag_base的集合。
     void add_tag(std::vector<tag_base*> tags){
-        tags_.insert(tags.begin(), tags.end());
+        for( auto tag : tags ){
+            tags_.add(tag);
+        }
     };
 
-    /// 注销tag_base, 注销后，再处理这些tag_base，参考srv()函数。
+    /// 注销tag_base, 注销后，不再处理这些tag_base，参考srv()函数。
     /// \param tags 需要注册的tag_base的集合。
     void remove_tag(std::vector<tag_base*> tags){
-        std::for_each(tags.begin(), tags.end(), [this](tag_base* tag){
-            this->tags_.erase(tag);
-        });
+        for( auto tag : tags ){
+            tags_.remove(tag);
+        }
     }
 
     /// 启动客户端
     /// \param address 客户端的地址(ip and port)
     void run(string address){
+        run(address, 1, 1);
+    }
+
+    /// 启动客户端，使用多个完成队列和多个工作线程。
+    /// 每个RPC调用在创建时通过cq()分配到其中一个完成队列，之后它的所有事件都在该队列上处理。
+    /// 同一个tag同时只有一个未完成的操作，因此每个tag的事件总是按顺序处理；
+    /// 但当threads_per_cq > 1时，同一调用的不同tag（如reader和writer）可能在不同线程上并发回调。
+    /// \param address 客户端的地址(ip and port)
+    /// \param cq_count 完成队列的个数，至少为1。
+    /// \param threads_per_cq 每个完成队列的工作线程数，至少为1。
+    void run(string address, size_t cq_count, size_t threads_per_cq){
         server_addr = address;
+        cq_count_ = std::max<size_t>(cq_count, 1);
+        threads_per_cq_ = std::max<size_t>(threads_per_cq, 1);
 
         runnig.store(true, std::memory_order_relaxed);
         thread = std::thread(&this_type::srv, this);
     }
 
     /// 客户端启动的回调函数。子类可以在这里建立RPC调用。
+    /// ReconnectMode::IN_PLACE时，在第一次连接成功时于工作线程中回调。
     virtual void on_run() {};
 
+    /// ReconnectMode::IN_PLACE时，连接断开的回调函数。进行中的调用随后会以ok等于false结束。
+    virtual void on_disconnect() {};
+
+    /// ReconnectMode::IN_PLACE时，连接恢复的回调函数。默认调用on_run()重建调用。
+    virtual void on_reconnect() {
+        on_run();
+    };
+
     /// 退出客户端。
     void exit(){
         runnig.store(false, std::memory_order_relaxed);
+        if( mode_ == ReconnectMode::IN_PLACE ){
+            std::lock_guard<std::mutex> lock(reconnect_mutex_);
+            if( channel_state_monitor_ ){
+                // stop()返回后观察者不会再重新注册，之后才能关闭完成队列；
+                // 重连定时器在reconnect_mutex_内检查runnig，同样不会再设置
+                channel_state_monitor_->stop();
+                reconnect_timer_->cancel();
+                shutdown_cqs();
+            }
+        }
         if( thread.joinable() ){
             thread.join();
         }
@@ -139,9 +298,21 @@ public:
         return stub_.get();
     }
 
-    /// 获得客户端的完成队列。
+    /// 为新建的RPC调用分配一个完成队列。多个完成队列之间轮流分配。
     CompletionQueue* cq(){
-        return cq_.get();
+        size_t index = next_cq_.fetch_add(1, std::memory_order_relaxed);
+        return cqs_[index % cqs_.size()].get();
+    }
+
+    /// 获得指定序号的完成队列。
+    /// \param index 完成队列的序号，范围是[0, cq_count())
+    CompletionQueue* cq(size_t index){
+        return cqs_[index].get();
+    }
+
+    /// 完成队列的个数。
+    size_t cq_count() const{
+        return cq_count_;
     }
 protected:
     /// 客户端的工作线程。支持channel状态监控和服务器重连。
@@ -149,7 +320,7 @@ protected:
 
         while( true ){
             if( !runnig.load(std::memory_order_relaxed) ){
-                cq_->Shutdown();
+                shutdown_cqs();
                 on_exit();
                 return;
             }
@@ -157,11 +328,23 @@ protected:
             credential = get_credental();
             grpc::ChannelArguments channel_args;
             channel_args.SetCompressionAlgorithm(GRPC_COMPRESS_GZIP);
+            if( mode_ == ReconnectMode::IN_PLACE ){
+                channel_args.SetInt(GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS, backoff_.initial_ms);
+                channel_args.SetInt(GRPC_ARG_MIN_RECONNECT_BACKOFF_MS, backoff_.initial_ms);
+                channel_args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS, backoff_.max_ms);
+            }
             channel = grpc::CreateCustomChannel(server_addr, credential, channel_args);
             //channel = grpc::CreateChannel(server_addr, credential);
             stub_ = SERVICE::NewStub(channel);
-            cq_ = std::unique_ptr<CompletionQueue>(new CompletionQueue());
+            cqs_.clear();
+            for( size_t i = 0; i < cq_count_; ++i ){
+                cqs_.emplace_back(new CompletionQueue());
+            }
 
+            if( mode_ == ReconnectMode::IN_PLACE ){
+                srv_in_place();
+                return;
+            }
 
             system_clock::time_point deadline =
                     system_clock::now() + std::chrono::seconds(5);
@@ -171,34 +354,23 @@ protected:
             }
 
             channel_state_monitor_ = std::unique_ptr<channel_state_monitor>(
-                    new channel_state_monitor(channel, cq_.get(), 60*24, this));
+                    new channel_state_monitor(channel, cqs_[0].get(), 60*24, this));
             add_tag({channel_state_monitor_.get()});
+            channel_state_monitor_->start();
             gpr_log(GPR_DEBUG, "channel_state_listener_ is %p", channel_state_monitor_.get());
 
 
             on_run();
 
-            void* got_tag;
-            bool ok = false;
-            while(cq_->Next(&got_tag, &ok))
-            {
-                tag_base* call = static_cast<tag_base*>(got_tag);
-
-                //gpr_log(GPR_DEBUG, "tag is %p, ok == %d", tag, ok);
-                if( tags_.find(static_cast<tag_base*>(got_tag)) == tags_.end() ){
-                    gpr_log(GPR_DEBUG, "invalid tag: %p", got_tag);
-                    continue;
-                }
-
-                if( ok ){
-//                    gpr_log(GPR_DEBUG, "tag process: %p", got_tag);
-                    call->process();
-                } else {
-//                    gpr_log(GPR_DEBUG, "tag error: %p", got_tag);
-//                    gpr_log(GPR_DEBUG, "channele stats: %d", channel->GetState(false));
-                    call->on_error();
+            std::vector<std::thread> workers;
+            for( auto& cq : cqs_ ){
+                for( size_t i = 0; i < threads_per_cq_; ++i ){
+                    workers.emplace_back(&this_type::cq_loop, this, cq.get());
                 }
             }
+            for( auto& worker : workers ){
+                worker.join();
+            }
             std::cout << "Completion queue is shutting down. Restart it" << std::endl;
             remove_tag({channel_state_monitor_.get()});
 
@@ -208,13 +380,136 @@ protected:
 
     }
 
+    /// ReconnectMode::IN_PLACE的工作线程，不等待连接成功，连接断开后不关闭完成队列，直到exit()。
+    void srv_in_place(){
+        {
+            std::lock_guard<std::mutex> lock(reconnect_mutex_);
+            if( !runnig.load(std::memory_order_relaxed) ){
+                on_exit();
+                return;
+            }
+            channel_state_monitor_ = std::unique_ptr<channel_state_monitor>(
+                    new channel_state_monitor(channel, cqs_[0].get(), 60*24, this));
+            channel_state_monitor_->keep_watching(5);
+            reconnect_timer_ = std::unique_ptr<reconnect_timer>(new reconnect_timer(cqs_[0].get(), this));
+            add_tag({channel_state_monitor_.get(), reconnect_timer_.get()});
+
+            connected_ = false;
+            ever_connected_ = false;
+            down_since_ = steady_clock::now();
+            next_delay_ms_ = backoff_.initial_ms;
+            channel_state_monitor_->start();
+            channel->GetState(true);
+            schedule_reconnect();
+        }
+
+        std::vector<std::thread> workers;
+        for( auto& cq : cqs_ ){
+            for( size_t i = 0; i < threads_per_cq_; ++i ){
+                workers.emplace_back(&this_type::cq_loop, this, cq.get());
+            }
+        }
+        for( auto& worker : workers ){
+            worker.join();
+        }
+        remove_tag({channel_state_monitor_.get(), reconnect_timer_.get()});
+        on_exit();
+    }
+
+    /// 设置下一次重连的定时，调用者须持有reconnect_mutex_。
+    void schedule_reconnect(){
+        if( timer_pending_ || !runnig.load(std::memory_order_relaxed) ){
+            return;
+        }
+        std::uniform_real_distribution<double> jitter(1.0 - backoff_.jitter, 1.0 + backoff_.jitter);
+        int64_t delay = static_cast<int64_t>(next_delay_ms_ * jitter(rng_));
+        next_delay_ms_ = std::min<int>(static_cast<int>(next_delay_ms_ * backoff_.multiplier), backoff_.max_ms);
+        timer_pending_ = true;
+        reconnect_timer_->set(milliseconds(std::max<int64_t>(delay, 1)));
+    }
+
+    /// 继承自reconnect_callback。定时器到期时，如果仍未连接，触发一次连接，并按退避设置下一次定时。
+    virtual void on_reconnect_timer(bool fired){
+        std::lock_guard<std::mutex> lock(reconnect_mutex_);
+        timer_pending_ = false;
+        if( fired && !connected_ ){
+            channel->GetState(true);
+            schedule_reconnect();
+        }
+    }
+
+    /// ReconnectMode::IN_PLACE的channel状态变化处理。
+    void on_state_in_place(grpc_connectivity_state old_state, grpc_connectivity_state new_state){
+        bool first = false, reconnected = false, disconnected = false;
+        {
+            std::lock_guard<std::mutex> lock(reconnect_mutex_);
+            if( !runnig.load(std::memory_order_relaxed) ){
+                return;
+            }
+            if( new_state == GRPC_CHANNEL_READY ){
+                if( !connected_ ){
+                    connected_ = true;
+                    first = !ever_connected_;
+                    reconnected = ever_connected_;
+                    ever_connected_ = true;
+                    if( reconnected ){
+                        int64_t us = duration_cast<microseconds>(steady_clock::now() - down_since_).count();
+                        reconnect_hist_.record(static_cast<uint64_t>(us));
+                        ++reconnect_count_;
+                        gpr_log(GPR_INFO, "reconnected after %lld us", static_cast<long long>(us));
+                    }
+                    next_delay_ms_ = backoff_.initial_ms;
+                    if( timer_pending_ ){
+                        reconnect_timer_->cancel();
+                    }
+                }
+            } else {
+                if( connected_ ){
+                    connected_ = false;
+                    disconnected = true;
+                    down_since_ = steady_clock::now();
+                }
+                if( new_state == GRPC_CHANNEL_IDLE || new_state == GRPC_CHANNEL_TRANSIENT_FAILURE ){
+                    schedule_reconnect();
+                }
+            }
+        }
+
+        if( disconnected ){
+            on_disconnect();
+        }
+        if( first ){
+            on_run();
+        }
+        if( reconnected ){
+            on_reconnect();
+        }
+    }
+
+    /// 工作线程的主循环，处理完成队列cq上的事件，直到cq被关闭。
+    /// \param cq 完成队列
+    void cq_loop(CompletionQueue* cq){
+        dispatch_cq(cq, tags_);
+    }
+
+    /// 关闭所有的完成队列。
+    void shutdown_cqs(){
+        for( auto& cq : cqs_ ){
+            cq->Shutdown();
+        }
+    }
+
     /// channel状态变化回调函数。
     /// \param old_state 原始状态
     /// \param new_state 最新状态
     virtual void on_channel_state_changed(grpc_connectivity_state old_state,
                                           grpc_connectivity_state new_state){
+        if( mode_ == ReconnectMode::IN_PLACE ){
+            on_state_in_place(old_state, new_state);
+            return;
+        }
         if( new_state != GRPC_CHANNEL_READY){
-            cq_->Shutdown();
+            shutdown_cqs();
         }
 
     }
@@ -223,14 +518,30 @@ protected:
     std::shared_ptr<Channel> channel;
     std::shared_ptr<ChannelCredentials> credential;
 
-    std::unique_ptr<CompletionQueue> cq_;
+    std::vector<std::unique_ptr<CompletionQueue>> cqs_;
+    size_t cq_count_;
+    size_t threads_per_cq_;
+    std::atomic<size_t> next_cq_;
     std::unique_ptr<typename SERVICE::Stub> stub_;
 
     std::atomic<bool> runnig;
     std::thread thread;
 
-    std::set<tag_base*> tags_;
+    tag_registry tags_;
     std::unique_ptr<channel_state_monitor> channel_state_monitor_;
 
+    // ReconnectMode::IN_PLACE
+    ReconnectMode mode_;
+    reconnect_backoff backoff_;
+    std::mutex reconnect_mutex_;
+    std::unique_ptr<reconnect_timer> reconnect_timer_;
+    bool connected_;
+    bool ever_connected_;
+    bool timer_pending_;
+    int next_delay_ms_;
+    steady_clock::time_point down_since_;
+    uint64_t reconnect_count_;
+    log_histogram reconnect_hist_;
+    std::minstd_rand rng_;
 };
 #endif //PROVIDER_CLIENT_IMPL_H
@@ -11,6 +11,8 @@
 #include "rpc_writer.h"
 
 #include <grpc++/grpc++.h>
+#include <grpc++/generic/generic_stub.h>
+#include <grpc++/impl/codegen/proto_utils.h>
 using namespace grpc;
 
 enum class ClientRPCStatus { CREATE, READ, WRITE, WORKING, FINISH, DESTORY, ERR };
@@ -119,6 +121,16 @@ public:
         return writer_->write(w);
     };
 
+    /// 发送队列满时最多等待timeout_ms毫秒，参见writer::write(const W&, int)。
+    int write(const W& w, int timeout_ms){
+        return writer_->write(w, timeout_ms);
+    };
+
+    /// 写出数据到指定优先级的lane，参见writer::set_lanes()。
+    int write_lane(const W& w, size_t lane){
+        return writer_->write_lane(w, lane);
+    };
+
 protected:
     ClientContext context;
     ClientRPCStatus status;
@@ -129,4 +141,47 @@ protected:
     std::unique_ptr<reader_t> reader_;
     std::unique_ptr<writer_t> writer_;
 };
+
+/// 使用grpc::GenericStub的双向流RPC，读写的都是序列化后的grpc::ByteBuffer。
+/// 同一个消息只需序列化一次（见serialize()），得到的ByteBuffer可以写给多个调用，不再复制消息，也不再重复序列化。
+/// 具体实现步骤如下：
+/// \li 子类调用prepare_call()，然后注册this、reader_和writer_（参见client_impl::add_tag），最后调用start_call()。
+/// \li 在process()方法，调用reader_->read()或(和）writer_->start()触发读写操作。
+class client_generic_bi_stream_rpc
+        : public client_bi_stream_rpc<grpc::ByteBuffer, grpc::ByteBuffer>{
+public:
+    typedef client_bi_stream_rpc<grpc::ByteBuffer, grpc::ByteBuffer> super;
+
+    /// 将消息序列化为ByteBuffer。buffer中原有的数据被替换，所以同一个buffer可以重复使用。
+    /// \return 序列化是否成功。
+    template<typename MSG>
+    static bool serialize(const MSG& msg, grpc::ByteBuffer* buffer){
+        buffer->Clear();
+        bool own_buffer;
+        return grpc::SerializationTraits<MSG>::Serialize(msg, buffer, &own_buffer).ok();
+    }
+
+    /// 从ByteBuffer中解析消息，解析后buffer被清空。
+    /// \return 解析是否成功。
+    template<typename MSG>
+    static bool parse(grpc::ByteBuffer* buffer, MSG* msg){
+        return grpc::SerializationTraits<MSG>::Deserialize(buffer, msg).ok();
+    }
+
+protected:
+    /// 准备调用，并创建reader_和writer_，此时还没有发起调用。
+    /// \param stub 通用的stub。
+    /// \param method 方法的全名，如"/helloworld.Greeter/SayHello"。
+    /// \param cq 调用使用的完成队列，参见client_impl::cq()。
+    void prepare_call(grpc::GenericStub* stub, const grpc::string& method, CompletionQueue* cq){
+        stream = stub->PrepareCall(&context, method, cq);
+        reader_ = std::unique_ptr<reader_t>(new reader_t(this, *stream));
+        writer_ = std::unique_ptr<writer_t>(new writer_t(this, *stream));
+    }
+
+    /// 发起调用，完成时回调process()。须在注册this之后调用。
+    void start_call(){
+        stream->StartCall(tag());
+    }
+};
 #endif //QUOTE_SERVER_CLIENT_RPC_H
@@ -0,0 +1,118 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_CONFLATION_INDEX_H
+#define QUOTE_SERVER_CONFLATION_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/// 合并消息用的索引：key（如证券代码）到合并结果中位置的开放寻址哈希表（线性探测）。
+/// \li 只保存key的指针，不复制字符串。key须在clear()之前一直有效，通常指向正在合并的消息。
+/// \li clear()只增加世代号，是常数时间，所以同一个索引可以在每次合并时重复使用，不再分配内存。
+/// 非线程安全。
+class conflation_index{
+public:
+    conflation_index(size_t capacity = 1024): size_(0), generation_(1){
+        size_t n = 16;
+        while( n < capacity * 2 ){
+            n <<= 1;
+        }
+        slots_.resize(n);
+    }
+
+    /// 查找key，不存在时以value插入。
+    /// \param key 键，插入后只保存指针。
+    /// \param value 不存在时插入的值。
+    /// \param inserted 返回是否插入。
+    /// \return key对应的值。
+    uint32_t find_or_insert(const std::string& key, uint32_t value, bool* inserted){
+        if( (size_ + 1) * 2 > slots_.size() ){
+            grow();
+        }
+        size_t hash = std::hash<std::string>()(key);
+        size_t mask = slots_.size() - 1;
+        for( size_t i = hash & mask; ; i = (i + 1) & mask ){
+            slot& s = slots_[i];
+            if( s.generation != generation_ ){
+                s.generation = generation_;
+                s.hash = hash;
+                s.key = &key;
+                s.value = value;
+                ++size_;
+                *inserted = true;
+                return value;
+            }
+            if( s.hash == hash && *s.key == key ){
+                *inserted = false;
+                return s.value;
+            }
+        }
+    }
+
+    /// 让相等的已有key改为保存参数的指针，用于原来的字符串即将失效时（如合并进其他消息后）。
+    /// \param key 键，须与索引中某个key相等，原来的字符串此时须仍然有效。
+    void rebind(const std::string& key){
+        size_t hash = std::hash<std::string>()(key);
+        size_t mask = slots_.size() - 1;
+        for( size_t i = hash & mask; slots_[i].generation == generation_; i = (i + 1) & mask ){
+            slot& s = slots_[i];
+            if( s.hash == hash && *s.key == key ){
+                s.key = &key;
+                return;
+            }
+        }
+    }
+
+    /// 清空索引。
+    void clear(){
+        size_ = 0;
+        if( ++generation_ == 0 ){
+            // 世代号回绕，重置所有槽位
+            for( auto& s : slots_ ){
+                s.generation = 0;
+            }
+            generation_ = 1;
+        }
+    }
+
+    size_t size() const{
+        return size_;
+    }
+
+private:
+    struct slot{
+        slot(): generation(0), hash(0), key(nullptr), value(0) {}
+        uint32_t generation;    // 不等于generation_的槽位是空的
+        size_t hash;
+        const std::string* key;
+        uint32_t value;
+    };
+
+    /// 容量加倍，重新插入当前世代的槽位。
+    void grow(){
+        std::vector<slot> old(slots_.size() * 2);
+        old.swap(slots_);
+        size_t mask = slots_.size() - 1;
+        for( auto& s : old ){
+            if( s.generation != generation_ ){
+                continue;
+            }
+            size_t i = s.hash & mask;
+            while( slots_[i].generation == generation_ ){
+                i = (i + 1) & mask;
+            }
+            slots_[i] = s;
+        }
+    }
+
+    std::vector<slot> slots_;
+    size_t size_;
+    uint32_t generation_;
+};
+
+#endif //QUOTE_SERVER_CONFLATION_INDEX_H
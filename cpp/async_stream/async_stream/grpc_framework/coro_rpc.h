@@ -0,0 +1,287 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_CORO_RPC_H
+#define QUOTE_SERVER_CORO_RPC_H
+
+/// C++20协程接口。编译器不支持C++20协程时（如VS2015），此文件为空。
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include "tag_base.h"
+
+#include <grpc++/grpc++.h>
+#include <grpc/support/log.h>
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <utility>
+
+/// 协程帧的内存池。按64字节分级，每个线程缓存释放的内存块，分配和释放都不加锁。
+/// 协程可能在另一个工作线程上结束，内存块归入释放它的线程的缓存，不需要还给原来的线程。
+/// 超过max_size的帧直接使用::operator new。
+class coro_frame_pool{
+public:
+    static void* allocate(size_t size){
+        size_t cls = size_class(size);
+        if( cls >= class_count ){
+            return ::operator new(size);
+        }
+        free_list& list = local().lists[cls];
+        if( list.head != nullptr ){
+            block* b = list.head;
+            list.head = b->next;
+            --list.count;
+            return b;
+        }
+        return ::operator new((cls + 1) * granularity);
+    }
+
+    static void deallocate(void* p, size_t size){
+        size_t cls = size_class(size);
+        if( cls >= class_count ){
+            ::operator delete(p);
+            return;
+        }
+        free_list& list = local().lists[cls];
+        if( list.count >= max_cached ){
+            ::operator delete(p);
+            return;
+        }
+        block* b = static_cast<block*>(p);
+        b->next = list.head;
+        list.head = b;
+        ++list.count;
+    }
+
+private:
+    enum { granularity = 64, max_size = 4096, class_count = max_size / granularity, max_cached = 256 };
+
+    struct block{
+        block* next;
+    };
+
+    struct free_list{
+        block* head = nullptr;
+        size_t count = 0;
+    };
+
+    struct cache{
+        free_list lists[class_count];
+        ~cache(){
+            for( auto& list : lists ){
+                while( list.head != nullptr ){
+                    block* next = list.head->next;
+                    ::operator delete(list.head);
+                    list.head = next;
+                }
+            }
+        }
+    };
+
+    static size_t size_class(size_t size){
+        return size == 0 ? 0 : (size - 1) / granularity;
+    }
+
+    static cache& local(){
+        static thread_local cache c;
+        return c;
+    }
+};
+
+/// 不需要等待结果的协程（fire-and-forget）。协程创建后立即执行，直到第一个co_await；
+/// 之后由完成队列的工作线程恢复执行，结束时自动释放协程帧。
+/// 协程帧从coro_frame_pool分配。
+/// \code
+/// coro_task push_quote(transcode_client* client){
+///     coro_call<ClientAsyncReader<MultiQuote>, transcode_client> call(client);
+///     EmptyMessage request;
+///     co_await call.start([&](ClientContext* ctx, CompletionQueue* cq){
+///         return client->stub()->PrepareAsyncPushQuote(ctx, request, cq);
+///     });
+///     MultiQuote quotes;
+///     while( co_await call.read(&quotes) ){
+///         client->on_push_quote_read(&quotes);
+///     }
+///     Status status;
+///     co_await call.finish(&status);
+/// }
+/// \endcode
+struct coro_task{
+    struct promise_type{
+        coro_task get_return_object(){
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept{
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept{
+            return {};
+        }
+
+        void return_void(){}
+
+        void unhandled_exception(){
+            gpr_log(GPR_ERROR, "unhandled exception in coroutine");
+            std::terminate();
+        }
+
+        static void* operator new(size_t size){
+            return coro_frame_pool::allocate(size);
+        }
+
+        static void operator delete(void* p, size_t size){
+            coro_frame_pool::deallocate(p, size);
+        }
+    };
+};
+
+/// 恢复协程的event's tag。完成队列上的事件到达时，以事件的ok值恢复等待中的协程。
+/// 同一个coro_tag同时只能有一个未完成的操作。
+class coro_tag : public tag_base{
+public:
+    coro_tag(): ok_(false) {}
+
+    /// 发起异步操作的awaitable，co_await的结果为事件的ok值。
+    /// \tparam START 发起操作的函数，参数为event's tag。发起操作之后不能再访问协程帧中的对象（包括调用的成员），
+    /// 因为协程可能已经在另一个线程上恢复。
+    template<typename START>
+    struct awaiter{
+        coro_tag& owner;
+        START start;
+
+        bool await_ready() const noexcept{
+            return false;
+        }
+
+        /// 操作一发起，协程就可能在另一个工作线程上恢复、甚至结束并销毁协程帧（本awaiter在帧中）。
+        /// 所以先把发起函数和tag取到栈上，发起操作是最后一步，之后不再访问本对象和owner。
+        void await_suspend(std::coroutine_handle<> handle){
+            START issue = std::move(start);
+            void* tag = owner.tag();
+            owner.waiter_ = handle;
+            issue(tag);
+        }
+
+        bool await_resume() const noexcept{
+            return owner.ok_;
+        }
+    };
+
+    template<typename START>
+    awaiter<START> await(START start){
+        return awaiter<START>{*this, std::move(start)};
+    }
+
+    /// 继承自tag_base。恢复协程，协程可能在此期间结束并销毁本对象，之后不能再访问成员。
+    virtual void process() override{
+        ok_ = true;
+        std::exchange(waiter_, nullptr).resume();
+    }
+
+    /// 继承自tag_base。
+    virtual void on_error() override{
+        ok_ = false;
+        std::exchange(waiter_, nullptr).resume();
+    }
+
+private:
+    std::coroutine_handle<> waiter_;
+    bool ok_;
+};
+
+/// 一次流式RPC调用的协程封装。读、写、其他操作（开始、结束等）各有一个coro_tag，
+/// 它们在构造时注册、析构时注销，每次操作不再注册。读和写可以在两个协程中同时进行，
+/// 例如一个协程循环co_await read()，另一个循环co_await write()。
+/// 只有实际用到的成员函数才会实例化，所以STREAM可以是任意一种异步流：
+/// ClientAsyncReader<R>、ClientAsyncWriter<W>、ClientAsyncReaderWriter<W,R>、GenericClientAsyncReaderWriter等。
+/// \tparam STREAM gRPC的异步流类型。
+/// \tparam CLIENT 提供add_tag()/remove_tag()和cq()的客户端，通常为client_impl的子类。
+template<typename STREAM, typename CLIENT>
+class coro_call{
+public:
+    explicit coro_call(CLIENT* client)
+            : client_(client)
+            , cq_(client->cq()){
+        client_->add_tag({&call_tag_, &read_tag_, &write_tag_});
+    }
+
+    ~coro_call(){
+        client_->remove_tag({&call_tag_, &read_tag_, &write_tag_});
+    }
+
+    coro_call(const coro_call&) = delete;
+    coro_call& operator=(const coro_call&) = delete;
+
+    /// 发起调用。先准备好流再调用StartCall()，保证事件到达（可能在另一个工作线程）之前stream_已经赋值。
+    /// \param prepare 调用stub的PrepareAsync方法（或GenericStub::PrepareCall），
+    /// 参数为(ClientContext*, CompletionQueue*)，返回std::unique_ptr<STREAM>。
+    /// \return awaitable，结果表示调用是否成功开始。
+    template<typename PREPARE>
+    auto start(PREPARE prepare){
+        return call_tag_.await([this, prepare](void* tag) mutable{
+            stream_ = prepare(&context_, cq_);
+            stream_->StartCall(tag);
+        });
+    }
+
+    /// 读取一个消息。msg须在co_await结束前有效。
+    /// \return awaitable，结果为false表示流已经结束或出错。
+    template<typename R>
+    auto read(R* msg){
+        return read_tag_.await([this, msg](void* tag){
+            stream_->Read(msg, tag);
+        });
+    }
+
+    /// 写出一个消息。msg须在co_await结束前有效。
+    /// \return awaitable，结果为false表示流已经断开。
+    template<typename W>
+    auto write(const W& msg){
+        const W* p = &msg;
+        return write_tag_.await([this, p](void* tag){
+            stream_->Write(*p, tag);
+        });
+    }
+
+    /// 通知服务器不再写出消息。
+    auto writes_done(){
+        return write_tag_.await([this](void* tag){
+            stream_->WritesDone(tag);
+        });
+    }
+
+    /// 结束调用，得到服务器返回的状态。须在读写都已完成后调用。
+    auto finish(grpc::Status* status){
+        return call_tag_.await([this, status](void* tag){
+            stream_->Finish(status, tag);
+        });
+    }
+
+    /// 取消调用，未完成的操作会以ok等于false恢复。
+    void cancel(){
+        context_.TryCancel();
+    }
+
+    grpc::ClientContext& context(){
+        return context_;
+    }
+
+private:
+    CLIENT* client_;
+    grpc::CompletionQueue* cq_;
+    grpc::ClientContext context_;
+    std::unique_ptr<STREAM> stream_;
+
+    coro_tag call_tag_;
+    coro_tag read_tag_;
+    coro_tag write_tag_;
+};
+
+#endif // __cpp_impl_coroutine
+
+#endif //QUOTE_SERVER_CORO_RPC_H
@@ -0,0 +1,411 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_CQ_STATS_H
+#define QUOTE_SERVER_CQ_STATS_H
+
+#include "tag_base.h"
+#include "tag_registry.h"
+
+#include <grpc++/grpc++.h>
+#include <grpc/support/log.h>
+#include <grpc/support/time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#ifdef __GNUC__
+#include <cxxabi.h>
+#include <cstdlib>
+#endif
+
+/// 对数-线性分桶的直方图（HDR风格）。每个2的幂区间再均分为sub_count个桶，相对误差不超过1/sub_count。
+/// 只有一个线程写（record()），其他线程可以同时读（merge_to()）。
+class log_histogram{
+public:
+    enum { sub_bits = 4, sub_count = 1 << sub_bits, bucket_count = (64 - sub_bits + 1) * sub_count };
+
+    log_histogram(){
+        for( auto& c : counts_ ){
+            c.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /// 记录一个值。只能在一个线程中调用，不需要原子的读-改-写。
+    void record(uint64_t value){
+        std::atomic<uint64_t>& c = counts_[index(value)];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    /// 累加到counts中，counts的长度为bucket_count。
+    void merge_to(std::vector<uint64_t>& counts) const{
+        for( size_t i = 0; i < bucket_count; ++i ){
+            counts[i] += counts_[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    /// 值所在的桶。
+    static size_t index(uint64_t value){
+        if( value < sub_count ){
+            return static_cast<size_t>(value);
+        }
+        unsigned msb = 63;
+        while( (value >> msb) == 0 ){
+            --msb;
+        }
+        unsigned shift = msb - sub_bits;
+        return (msb - sub_bits + 1) * sub_count + static_cast<size_t>((value >> shift) & (sub_count - 1));
+    }
+
+    /// 桶中的最大值。
+    static uint64_t upper_bound(size_t index){
+        if( index < sub_count ){
+            return index;
+        }
+        unsigned shift = static_cast<unsigned>(index / sub_count) - 1;
+        uint64_t sub = index % sub_count;
+        return ((sub_count + sub + 1) << shift) - 1;
+    }
+
+private:
+    std::atomic<uint64_t> counts_[bucket_count];
+};
+
+/// 直方图的快照，可以合并、查询分位数。
+class histogram_snapshot{
+public:
+    histogram_snapshot(): counts_(log_histogram::bucket_count, 0), total_(0) {}
+
+    void add(const log_histogram& h){
+        h.merge_to(counts_);
+        update_total();
+    }
+
+    void add(const histogram_snapshot& other){
+        for( size_t i = 0; i < counts_.size(); ++i ){
+            counts_[i] += other.counts_[i];
+        }
+        update_total();
+    }
+
+    /// 记录的值的个数。
+    uint64_t count() const{
+        return total_;
+    }
+
+    /// 分位数（nearest-rank：第ceil(q*n)个值）。
+    /// \param q 范围是[0, 1]，如0.99。
+    /// \return 不小于q分位数的值（桶的上界）；没有数据时返回0。
+    uint64_t percentile(double q) const{
+        if( total_ == 0 ){
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(total_)));
+        rank = std::min(std::max<uint64_t>(rank, 1), total_);
+        uint64_t seen = 0;
+        for( size_t i = 0; i < counts_.size(); ++i ){
+            seen += counts_[i];
+            if( seen >= rank ){
+                return log_histogram::upper_bound(i);
+            }
+        }
+        return max();
+    }
+
+    /// 最大值所在的桶的上界。
+    uint64_t max() const{
+        for( size_t i = counts_.size(); i > 0; --i ){
+            if( counts_[i - 1] != 0 ){
+                return log_histogram::upper_bound(i - 1);
+            }
+        }
+        return 0;
+    }
+
+    /// 格式为"n=... p50=... p99=... p999=... max=..."。
+    std::string summary() const{
+        return "n=" + std::to_string(count())
+               + " p50=" + std::to_string(percentile(0.5))
+               + " p99=" + std::to_string(percentile(0.99))
+               + " p999=" + std::to_string(percentile(0.999))
+               + " max=" + std::to_string(max());
+    }
+
+private:
+    void update_total(){
+        total_ = 0;
+        for( auto c : counts_ ){
+            total_ += c;
+        }
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_;
+};
+
+/// 完成队列事件处理的统计。以tag的实际类型（如某个RPC调用类、reader<R,...>、writer<W,...>）区分，包括：
+/// \li process：process()或on_error()的耗时（纳秒）。
+/// \li wait：从发起异步操作（调用tag_base::tag()）到工作线程开始处理该事件的时间（纳秒），
+///     包括操作本身的耗时和事件在队列中等待的时间。写操作、alarm的wait变大，通常表示工作线程处理不过来。
+/// \li batch：工作线程每次被唤醒后，连续处理的事件个数，参见dispatch_cq()。
+/// 每个线程写自己的缓冲区，不加锁；snapshot()可以在任意线程中调用，合并所有线程（包括已经退出的线程）的数据。
+/// 默认关闭，定义CQ_STATS为1时开启统计（参见tag_base.h）。
+class cq_stats{
+public:
+    /// 某个tag类型的统计快照。
+    struct tag_snapshot{
+        std::string name;
+        histogram_snapshot process;
+        histogram_snapshot wait;
+    };
+
+    /// 所有线程的统计快照。
+    struct snapshot_t{
+        std::vector<tag_snapshot> tags;
+        histogram_snapshot batch;
+
+        /// 每个tag类型一行，便于写入日志。
+        std::string to_string() const{
+            std::string text = "batch: " + batch.summary() + "\n";
+            for( auto& t : tags ){
+                text += t.name + "\n  process(ns): " + t.process.summary()
+                        + "\n  wait(ns):    " + t.wait.summary() + "\n";
+            }
+            return text;
+        }
+    };
+
+    /// 当前线程的统计缓冲区。
+    class thread_buffer{
+        friend class cq_stats;
+    public:
+        thread_buffer(): size_(0), last_(nullptr) {}
+
+        ~thread_buffer(){
+            for( size_t i = 0; i < size_.load(std::memory_order_relaxed); ++i ){
+                delete entries_[i];
+            }
+        }
+
+        /// 记录一个事件。
+        void record(const std::type_info& type, uint64_t process_ns, uint64_t wait_ns){
+            entry* e = find(type);
+            if( e == nullptr ){
+                return;
+            }
+            e->process.record(process_ns);
+            e->wait.record(wait_ns);
+        }
+
+        /// 记录一批事件的个数。
+        void record_batch(uint64_t events){
+            batch_.record(events);
+        }
+
+    private:
+        enum { max_types = 256 };
+
+        struct entry{
+            explicit entry(const std::type_info* t): type(t) {}
+            const std::type_info* type;
+            log_histogram process;
+            log_histogram wait;
+        };
+
+        entry* find(const std::type_info& type){
+            if( last_ != nullptr && *last_->type == type ){
+                return last_;
+            }
+            size_t size = size_.load(std::memory_order_relaxed);
+            for( size_t i = 0; i < size; ++i ){
+                if( *entries_[i]->type == type ){
+                    last_ = entries_[i];
+                    return last_;
+                }
+            }
+            if( size == max_types ){
+                return nullptr;
+            }
+            entries_[size] = new entry(&type);
+            size_.store(size + 1, std::memory_order_release);
+            last_ = entries_[size];
+            return last_;
+        }
+
+        entry* entries_[max_types];
+        std::atomic<size_t> size_;     // entries_中已发布的个数
+        entry* last_;                  // 上次命中的类型，同一线程上连续的事件通常属于同一类型
+        log_histogram batch_;
+    };
+
+    /// 当前线程的缓冲区，第一次调用时创建，线程退出时合并到全局数据中。
+    static thread_buffer& local(){
+        static thread_local holder h;
+        return *h.buffer;
+    }
+
+    /// 合并所有线程的统计数据。可以在任意线程中调用。
+    static snapshot_t snapshot(){
+        cq_stats& s = instance();
+        std::lock_guard<std::mutex> lock(s.mutex_);
+
+        snapshot_t result;
+        std::map<const std::type_info*, tag_snapshot> merged = s.retired_;
+        result.batch.add(s.retired_batch_);
+        for( auto buffer : s.live_ ){
+            collect(*buffer, merged, result.batch);
+        }
+        for( auto& kv : merged ){
+            result.tags.push_back(kv.second);
+        }
+        return result;
+    }
+
+    /// 当前时间（纳秒），使用steady_clock。
+    static int64_t now_ns(){
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    struct holder{
+        holder(): buffer(new thread_buffer()){
+            cq_stats& s = instance();
+            std::lock_guard<std::mutex> lock(s.mutex_);
+            s.live_.push_back(buffer);
+        }
+
+        ~holder(){
+            cq_stats& s = instance();
+            {
+                std::lock_guard<std::mutex> lock(s.mutex_);
+                s.live_.remove(buffer);
+                collect(*buffer, s.retired_, s.retired_batch_);
+            }
+            delete buffer;
+        }
+
+        thread_buffer* buffer;
+    };
+
+    static cq_stats& instance(){
+        static cq_stats s;
+        return s;
+    }
+
+    static void collect(const thread_buffer& buffer,
+                        std::map<const std::type_info*, tag_snapshot>& merged,
+                        histogram_snapshot& batch){
+        batch.add(buffer.batch_);
+        size_t size = buffer.size_.load(std::memory_order_acquire);
+        for( size_t i = 0; i < size; ++i ){
+            const thread_buffer::entry* e = buffer.entries_[i];
+            tag_snapshot& t = merged[type_key(*e->type)];
+            if( t.name.empty() ){
+                t.name = type_name(*e->type);
+            }
+            t.process.add(e->process);
+            t.wait.add(e->wait);
+        }
+    }
+
+    /// 同一类型在不同的模块中可能有不同的type_info对象，以第一次遇到的对象为准。
+    static const std::type_info* type_key(const std::type_info& type){
+        cq_stats& s = instance();
+        for( auto t : s.types_ ){
+            if( *t == type ){
+                return t;
+            }
+        }
+        s.types_.push_back(&type);
+        return &type;
+    }
+
+    static std::string type_name(const std::type_info& type){
+#ifdef __GNUC__
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+        if( status == 0 && demangled != nullptr ){
+            std::string name(demangled);
+            std::free(demangled);
+            return name;
+        }
+#endif
+        return type.name();
+    }
+
+    std::mutex mutex_;
+    std::list<thread_buffer*> live_;
+    std::map<const std::type_info*, tag_snapshot> retired_;   // 已经退出的线程的数据
+    histogram_snapshot retired_batch_;
+    std::vector<const std::type_info*> types_;
+};
+
+/// 工作线程的主循环，处理完成队列cq上的事件，直到cq被关闭。只处理在tags中注册过的tag。
+/// 每次阻塞等到一个事件后，继续以零超时取出已经完成的事件，一起记为一批，然后再阻塞等待。
+/// 参见client_impl::cq_loop和server_impl::srv
+/// \tparam CQ CompletionQueue或ServerCompletionQueue
+template<typename CQ>
+void dispatch_cq(CQ* cq, const tag_registry& tags){
+    void* got_tag;
+    bool ok = false;
+#if CQ_STATS
+    cq_stats::thread_buffer& stats = cq_stats::local();
+    uint64_t batch = 0;
+    while( true ){
+        gpr_timespec deadline = batch == 0 ? gpr_inf_future(GPR_CLOCK_MONOTONIC) : gpr_time_0(GPR_CLOCK_MONOTONIC);
+        grpc::CompletionQueue::NextStatus status = cq->AsyncNext(&got_tag, &ok, deadline);
+        if( status == grpc::CompletionQueue::SHUTDOWN ){
+            break;
+        }
+        if( status == grpc::CompletionQueue::TIMEOUT ){
+            stats.record_batch(batch);
+            batch = 0;
+            continue;
+        }
+        ++batch;
+#else
+    while( cq->Next(&got_tag, &ok) ){
+#endif
+        tag_base* call = tags.find(got_tag);
+        if( call == nullptr ){
+            gpr_log(GPR_DEBUG, "invalid tag: %p", got_tag);
+            continue;
+        }
+
+#if CQ_STATS
+        // process()可能释放call，先取出需要的信息
+        int64_t start = cq_stats::now_ns();
+        int64_t issued = call->issued_ns();
+        const std::type_info& type = typeid(*call);
+#endif
+        if( ok ){
+            call->process();
+        } else {
+            call->on_error();
+        }
+#if CQ_STATS
+        int64_t end = cq_stats::now_ns();
+        stats.record(type, static_cast<uint64_t>(end - start),
+                     static_cast<uint64_t>(issued > 0 && start > issued ? start - issued : 0));
+#endif
+    }
+#if CQ_STATS
+    if( batch > 0 ){
+        stats.record_batch(batch);
+    }
+#endif
+}
+
+#endif //QUOTE_SERVER_CQ_STATS_H
@@ -0,0 +1,591 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_FANOUT_DISPATCHER_H
+#define QUOTE_SERVER_FANOUT_DISPATCHER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// 订阅者的环形队列满时的处理方式。
+enum class DispatchPolicy {
+    BLOCK,          // 发布者等待订阅者，最多等待block_timeout（参见fanout_dispatcher::set_block_timeout()），超时后丢弃最早的消息
+    DROP_OLDEST,    // 丢弃最早的未处理消息
+    CONFLATE        // 后续消息合并成一个，订阅者处理完队列中的消息后收到合并的结果
+};
+
+/// 有界的环形队列，一个生产者一个消费者。生产者在队列满时也可以取出最早的消息（丢弃），
+/// 所以出队用CAS，每个槽位带序号（参见Dmitry Vyukov的bounded MPMC queue）。
+/// \tparam T 消息类型，须可以默认构造和复制。
+template<typename T>
+class spsc_ring{
+public:
+    /// \param capacity 容量，向上取整为2的幂。
+    spsc_ring(size_t capacity): tail_(0), head_(0){
+        size_t n = 2;
+        while( n < capacity ){
+            n <<= 1;
+        }
+        mask_ = n - 1;
+        slots_.reset(new slot[n]);
+        for( size_t i = 0; i < n; ++i ){
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /// 入队，只能在生产者线程中调用。
+    /// \return 队列满时返回false。
+    bool push(const T& msg){
+        slot& s = slots_[tail_ & mask_];
+        if( s.seq.load(std::memory_order_acquire) != tail_ ){
+            return false;
+        }
+        s.value = msg;
+        s.seq.store(tail_ + 1, std::memory_order_release);
+        ++tail_;
+        return true;
+    }
+
+    /// 出队，消费者和生产者都可以调用。
+    /// \return 队列空时返回false。
+    bool pop(T& msg){
+        size_t pos = head_.load(std::memory_order_relaxed);
+        while( true ){
+            slot& s = slots_[pos & mask_];
+            size_t seq = s.seq.load(std::memory_order_acquire);
+            intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if( dif == 0 ){
+                if( head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed) ){
+                    msg = std::move(s.value);
+                    s.value = T();
+                    s.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if( dif < 0 ){
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// 队列是否为空，只表示调用时的状态。
+    bool empty() const{
+        size_t pos = head_.load(std::memory_order_acquire);
+        return slots_[pos & mask_].seq.load(std::memory_order_acquire) != pos + 1;
+    }
+
+private:
+    struct slot{
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<slot[]> slots_;
+    size_t mask_;
+    size_t tail_;                   // 只由生产者访问
+    std::atomic<size_t> head_;
+};
+
+/// 一对多的消息分发。发布者只把消息写入一个共享的广播环形缓冲区，每个订阅者有自己的读位置和处理线程，
+/// 发布者不执行订阅者的回调，所以慢的订阅者只影响自己（按各自的DispatchPolicy处理），不会拖慢发布者和其他订阅者。
+/// \li 发布的开销与订阅者的个数无关：写一个槽位，有订阅者在等待时notify_all一次。订阅者等待时不轮询。
+/// \li DROP_OLDEST：订阅者落后超过capacity个消息时，跳到最新的capacity个，跳过的计入dropped。
+/// \li BLOCK：发布者在覆盖订阅者未读的消息之前等待它，最多等待block_timeout，之后照常覆盖（计入dropped），不会无限阻塞完成队列的线程。
+/// \li CONFLATE：订阅者另有自己的环形队列，满了以后发布者把后续消息原地合并到一个槽位中，
+///     所以发布的开销与CONFLATE订阅者的个数成正比。
+/// \li 广播缓冲区的槽位在所有订阅者读过之后分批清空，消息最多多保留ring_capacity / 4个。
+/// \li 订阅者列表是写时复制的，发布者只取一次快照。publish()须在同一时刻只被一个线程调用（单生产者）；
+///     subscribe()和unsubscribe()可以在任意线程中调用。
+/// \tparam T 消息类型，须可以默认构造和复制，且复制的代价小，如std::shared_ptr<const MSG>。
+template<typename T>
+class fanout_dispatcher{
+public:
+    typedef std::function<void (const T&)> callback_t;
+    /// CONFLATE时合并两个消息，返回合并的结果；newer中的内容优先。
+    typedef std::function<T (const T& older, const T& newer)> conflate_t;
+    typedef uint64_t subscription_t;
+
+    /// 订阅者的统计。
+    struct subscriber_stats{
+        uint64_t delivered;     // 回调的次数
+        uint64_t dropped;       // DROP_OLDEST丢弃、BLOCK等待超时后被覆盖的消息个数
+        uint64_t conflated;     // CONFLATE合并掉的消息个数
+    };
+
+    /// \param ring_capacity 广播缓冲区的容量，向上取整为2的幂。DROP_OLDEST和BLOCK订阅者的capacity不超过它。
+    fanout_dispatcher(size_t ring_capacity = 4096)
+            : next_id_(1), subscribers_(std::make_shared<list_t>())
+            , published_(0), block_timeout_ms_(100)
+            , waiters_(0), publisher_waiting_(false)
+            , gate_(0), gate_version_(0), stalled_at_(~uint64_t(0)), reclaimed_(0){
+        size_t n = 2;
+        while( n < ring_capacity ){
+            n <<= 1;
+        }
+        mask_ = n - 1;
+        ring_.reset(new slot[n]);
+    }
+
+    ~fanout_dispatcher(){
+        std::shared_ptr<list_t> subscribers;
+        {
+            lock_t lock(mutex_);
+            subscribers = std::atomic_exchange(&subscribers_, std::make_shared<list_t>());
+        }
+        for( auto& s : subscribers->all ){
+            s->stop();
+        }
+    }
+
+    fanout_dispatcher(const fanout_dispatcher&) = delete;
+    fanout_dispatcher& operator=(const fanout_dispatcher&) = delete;
+
+    /// 设置BLOCK订阅者跟不上时发布者最多等待的毫秒数，默认为100。
+    void set_block_timeout(int ms){
+        block_timeout_ms_.store(ms, std::memory_order_relaxed);
+    }
+
+    /// 增加订阅者。订阅者从订阅之后发布的消息开始接收。
+    /// \param callback 回调函数，在订阅者自己的线程中调用。
+    /// \param policy 跟不上时的处理方式。
+    /// \param capacity 订阅者最多积压的消息个数。DROP_OLDEST和BLOCK不超过广播缓冲区的容量；CONFLATE是自己的队列的容量。
+    /// \param conflate CONFLATE时合并消息的函数，为空时只保留最新的消息。
+    /// \return 订阅的标识，用于unsubscribe()。
+    subscription_t subscribe(callback_t callback, DispatchPolicy policy = DispatchPolicy::DROP_OLDEST,
+                             size_t capacity = 1024, conflate_t conflate = nullptr){
+        lock_t lock(mutex_);
+        if( policy != DispatchPolicy::CONFLATE ){
+            capacity = std::max<size_t>(std::min<size_t>(capacity, mask_ + 1), 1);
+        }
+        auto s = std::make_shared<subscriber>(this, next_id_++, callback, policy, capacity, conflate);
+        auto subscribers = std::make_shared<list_t>(*std::atomic_load(&subscribers_));
+        subscribers->version = next_id_++;
+        subscribers->add(s);
+        std::atomic_store(&subscribers_, subscribers);
+        return s->id;
+    }
+
+    /// 取消订阅。等待订阅者处理完当前的回调后返回，未处理的消息被丢弃。不能在回调中调用。
+    void unsubscribe(subscription_t id){
+        std::shared_ptr<subscriber> removed;
+        {
+            lock_t lock(mutex_);
+            auto subscribers = std::make_shared<list_t>();
+            subscribers->version = next_id_++;
+            for( auto& s : std::atomic_load(&subscribers_)->all ){
+                if( s->id == id ){
+                    removed = s;
+                } else {
+                    subscribers->add(s);
+                }
+            }
+            std::atomic_store(&subscribers_, subscribers);
+        }
+        if( removed ){
+            removed->stop();
+        }
+    }
+
+    /// 向所有订阅者发布消息。
+    void publish(const T& msg){
+        std::shared_ptr<list_t> subscribers = std::atomic_load(&subscribers_);
+        uint64_t seq = published_.load(std::memory_order_relaxed);
+        if( !subscribers->blocking.empty() ){
+            wait_blocking(*subscribers, seq);
+        }
+
+        slot& s = ring_[seq & mask_];
+        s.lock_write();
+        s.value = msg;
+        s.seq.store(seq, std::memory_order_relaxed);
+        s.unlock();
+        published_.store(seq + 1, std::memory_order_release);
+
+        for( auto& c : subscribers->conflating ){
+            c->offer(msg);
+        }
+        if( ((seq + 1) & ((mask_ >> 2) | 0x3F)) == 0 ){
+            reclaim(*subscribers, seq + 1);
+        }
+        wake_all();
+    }
+
+    /// 获得订阅者的统计。
+    /// \return 订阅者不存在时返回false。
+    bool get_stats(subscription_t id, subscriber_stats* stats) const{
+        for( auto& s : std::atomic_load(&subscribers_)->all ){
+            if( s->id == id ){
+                stats->delivered = s->delivered.load(std::memory_order_relaxed);
+                stats->dropped = s->dropped.load(std::memory_order_relaxed);
+                stats->conflated = s->conflated.load(std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    typedef std::unique_lock<std::mutex> lock_t;
+
+    /// 广播缓冲区的槽位。state是读写锁：大于0是正在复制消息的订阅者个数，-1表示发布者正在写。
+    /// 只有订阅者落后到槽位被覆盖时才会和发布者冲突，此时订阅者放弃读取，发布者只等待正在进行的复制。
+    struct slot{
+        slot(): seq(empty_seq), state(0) {}
+
+        void lock_write(){
+            int expected = 0;
+            while( !state.compare_exchange_weak(expected, -1, std::memory_order_acquire, std::memory_order_relaxed) ){
+                expected = 0;
+                std::this_thread::yield();
+            }
+        }
+
+        bool try_lock_write(){
+            int expected = 0;
+            return state.compare_exchange_strong(expected, -1, std::memory_order_acquire, std::memory_order_relaxed);
+        }
+
+        bool try_lock_read(){
+            int current = state.load(std::memory_order_relaxed);
+            while( current >= 0 ){
+                if( state.compare_exchange_weak(current, current + 1, std::memory_order_acquire, std::memory_order_relaxed) ){
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void unlock(){
+            state.store(0, std::memory_order_release);
+        }
+
+        void unlock_read(){
+            state.fetch_sub(1, std::memory_order_release);
+        }
+
+        std::atomic<uint64_t> seq;  // 槽位中消息的序号，清空后为empty_seq
+        std::atomic<int> state;
+        T value;
+    };
+
+    static const uint64_t empty_seq = ~uint64_t(0);
+
+    class subscriber{
+    public:
+        subscriber(fanout_dispatcher* owner, subscription_t id, callback_t callback, DispatchPolicy policy,
+                   size_t capacity, conflate_t conflate)
+                : id(id), policy(policy), capacity(capacity), delivered(0), dropped(0), conflated(0)
+                , cursor(owner->published_.load(std::memory_order_acquire))
+                , owner_(owner), callback_(callback), conflate_(conflate)
+                , ring_(policy == DispatchPolicy::CONFLATE ? capacity : 2)
+                , has_pending_(false), conflating_(false), stopped_(false){
+            thread_ = std::thread(&subscriber::run, this);
+        }
+
+        ~subscriber(){
+            stop();
+        }
+
+        /// CONFLATE：发布者入队，满了以后合并到pending_中。
+        void offer(const T& msg){
+            if( stopped_.load(std::memory_order_relaxed) ){
+                return;
+            }
+            // 已经开始合并时不能再入队，否则订阅者会先收到较新的消息
+            if( !conflating_.load(std::memory_order_acquire) && ring_.push(msg) ){
+                return;
+            }
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            if( has_pending_ ){
+                // 合并的结果赋值回原来的槽位，不另外分配
+                pending_ = conflate_ ? conflate_(pending_, msg) : msg;
+                conflated.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                pending_ = msg;
+                has_pending_ = true;
+            }
+            conflating_.store(true, std::memory_order_release);
+        }
+
+        /// 结束处理线程。
+        void stop(){
+            stopped_.store(true);
+            {
+                lock_t lock(owner_->wait_mutex_);
+                owner_->wait_cond_.notify_all();
+            }
+            {
+                // 发布者可能在等待这个BLOCK订阅者
+                lock_t lock(owner_->block_mutex_);
+                owner_->block_cond_.notify_all();
+            }
+            if( thread_.joinable() ){
+                thread_.join();
+            }
+        }
+
+        bool stopped() const{
+            return stopped_.load(std::memory_order_relaxed);
+        }
+
+        const subscription_t id;
+        const DispatchPolicy policy;
+        const size_t capacity;
+        std::atomic<uint64_t> delivered;
+        std::atomic<uint64_t> dropped;
+        std::atomic<uint64_t> conflated;
+        std::atomic<uint64_t> cursor;   // 下一个要读的广播序号，只由处理线程修改
+
+    private:
+        /// 处理线程：有消息时逐个处理，没有时在owner_的条件变量上等待。
+        void run(){
+            T msg;
+            while( !stopped_.load(std::memory_order_relaxed) ){
+                if( next(msg) ){
+                    callback_(msg);
+                    msg = T();
+                    delivered.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                lock_t lock(owner_->wait_mutex_);
+                owner_->waiters_.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                while( !stopped_.load(std::memory_order_relaxed) && !has_work() ){
+                    owner_->wait_cond_.wait(lock);
+                }
+                owner_->waiters_.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+
+        bool has_work() const{
+            if( policy == DispatchPolicy::CONFLATE ){
+                return !ring_.empty() || conflating_.load(std::memory_order_acquire);
+            }
+            return owner_->published_.load(std::memory_order_acquire) != cursor.load(std::memory_order_relaxed);
+        }
+
+        /// 取出下一个消息。
+        bool next(T& msg){
+            if( policy == DispatchPolicy::CONFLATE ){
+                if( ring_.pop(msg) ){
+                    return true;
+                }
+                if( !conflating_.load(std::memory_order_acquire) ){
+                    return false;
+                }
+                std::lock_guard<std::mutex> lock(pending_mutex_);
+                bool taken = has_pending_;
+                if( taken ){
+                    using std::swap;
+                    swap(msg, pending_);
+                    has_pending_ = false;
+                }
+                conflating_.store(false, std::memory_order_release);
+                return taken;
+            }
+
+            uint64_t pos = cursor.load(std::memory_order_relaxed);
+            while( true ){
+                uint64_t end = owner_->published_.load(std::memory_order_acquire);
+                if( pos == end ){
+                    return false;
+                }
+                // DROP_OLDEST最多积压capacity个；其他订阅者最多积压整个缓冲区，更早的已经被覆盖
+                uint64_t limit = policy == DispatchPolicy::DROP_OLDEST ? capacity : owner_->mask_ + 1;
+                if( end - pos > limit ){
+                    dropped.fetch_add(end - limit - pos, std::memory_order_relaxed);
+                    pos = end - limit;
+                }
+                bool ok = owner_->read(pos, msg);
+                ++pos;
+                cursor.store(pos, std::memory_order_release);
+                if( policy == DispatchPolicy::BLOCK ){
+                    owner_->notify_publisher();
+                }
+                if( ok ){
+                    return true;
+                }
+                // 读取时已经被覆盖
+                dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        fanout_dispatcher* owner_;
+        callback_t callback_;
+        conflate_t conflate_;
+
+        // CONFLATE
+        spsc_ring<T> ring_;
+        std::mutex pending_mutex_;
+        T pending_;                     // 合并的消息，由pending_mutex_保护
+        bool has_pending_;
+        std::atomic<bool> conflating_;  // pending_中有消息，或者订阅者正在取出
+
+        std::atomic<bool> stopped_;
+        std::thread thread_;
+    };
+
+    /// 订阅者列表的快照，按处理方式分组。
+    struct list_t{
+        void add(const std::shared_ptr<subscriber>& s){
+            all.push_back(s);
+            if( s->policy == DispatchPolicy::BLOCK ){
+                blocking.push_back(s.get());
+            } else if( s->policy == DispatchPolicy::CONFLATE ){
+                conflating.push_back(s.get());
+            }
+        }
+
+        uint64_t version = 0;       // 每次修改列表时改变，参见wait_blocking()
+        std::vector<std::shared_ptr<subscriber>> all;
+        std::vector<subscriber*> blocking;
+        std::vector<subscriber*> conflating;
+    };
+
+    /// 复制序号为seq的消息。
+    /// \return 槽位已经被覆盖或者清空时返回false。
+    bool read(uint64_t seq, T& msg){
+        slot& s = ring_[seq & mask_];
+        if( !s.try_lock_read() ){
+            return false;
+        }
+        bool ok = s.seq.load(std::memory_order_relaxed) == seq;
+        if( ok ){
+            msg = s.value;
+        }
+        s.unlock_read();
+        return ok;
+    }
+
+    /// 写入序号seq之前，等待所有BLOCK订阅者的积压少于capacity，最多等待block_timeout_ms_。
+    /// gate_缓存上次算出的最小的cursor + capacity，只有写到这里时才重新计算，平均开销是常数。
+    /// 等待超时后，在最慢的订阅者有进展之前不再等待，直接覆盖。
+    void wait_blocking(const list_t& subscribers, uint64_t seq){
+        if( gate_version_ == subscribers.version && seq < gate_ ){
+            return;
+        }
+        gate_version_ = subscribers.version;
+        auto deadline = std::chrono::steady_clock::now()
+                        + std::chrono::milliseconds(block_timeout_ms_.load(std::memory_order_relaxed));
+        while( true ){
+            gate_ = ~uint64_t(0);
+            uint64_t slowest = ~uint64_t(0);
+            for( auto s : subscribers.blocking ){
+                if( !s->stopped() ){
+                    uint64_t cursor = s->cursor.load(std::memory_order_acquire);
+                    slowest = std::min<uint64_t>(slowest, cursor);
+                    gate_ = std::min<uint64_t>(gate_, cursor + s->capacity);
+                }
+            }
+            if( seq < gate_ ){
+                stalled_at_ = ~uint64_t(0);
+                return;
+            }
+            if( slowest == stalled_at_ ){
+                gate_ = seq + 1;
+                return;
+            }
+            lock_t lock(block_mutex_);
+            publisher_waiting_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            bool timeout = false;
+            if( !blocking_ready(subscribers, seq) ){
+                timeout = block_cond_.wait_until(lock, deadline) == std::cv_status::timeout;
+            }
+            publisher_waiting_.store(false, std::memory_order_relaxed);
+            if( timeout ){
+                // 超时后照常覆盖，订阅者读取时发现并计入dropped
+                stalled_at_ = slowest;
+                gate_ = seq + 1;
+                return;
+            }
+        }
+    }
+
+    bool blocking_ready(const list_t& subscribers, uint64_t seq) const{
+        for( auto s : subscribers.blocking ){
+            if( !s->stopped() && seq >= s->cursor.load(std::memory_order_acquire) + s->capacity ){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// BLOCK订阅者读取后，唤醒等待中的发布者。
+    void notify_publisher(){
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if( publisher_waiting_.load(std::memory_order_relaxed) ){
+            lock_t lock(block_mutex_);
+            block_cond_.notify_all();
+        }
+    }
+
+    /// 唤醒等待中的订阅者。
+    void wake_all(){
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if( waiters_.load(std::memory_order_relaxed) > 0 ){
+            lock_t lock(wait_mutex_);
+            wait_cond_.notify_all();
+        }
+    }
+
+    /// 清空所有订阅者都已经读过的槽位，释放其中的消息。每发布ring_capacity / 4个消息调用一次。
+    void reclaim(const list_t& subscribers, uint64_t end){
+        uint64_t oldest = end;
+        for( auto& s : subscribers.all ){
+            if( s->policy != DispatchPolicy::CONFLATE && !s->stopped() ){
+                oldest = std::min<uint64_t>(oldest, s->cursor.load(std::memory_order_acquire));
+            }
+        }
+        if( end - reclaimed_ > mask_ + 1 ){
+            reclaimed_ = end - (mask_ + 1);
+        }
+        for( ; reclaimed_ < oldest; ++reclaimed_ ){
+            slot& s = ring_[reclaimed_ & mask_];
+            // 正在被落后的订阅者读取时留到被覆盖
+            if( s.seq.load(std::memory_order_relaxed) == reclaimed_ && s.try_lock_write() ){
+                s.value = T();
+                s.seq.store(empty_seq, std::memory_order_relaxed);
+                s.unlock();
+            }
+        }
+    }
+
+    std::mutex mutex_;              // 只用于subscribe()和unsubscribe()之间互斥
+    subscription_t next_id_;
+    std::shared_ptr<list_t> subscribers_;
+
+    std::unique_ptr<slot[]> ring_;
+    size_t mask_;
+    std::atomic<uint64_t> published_;   // 已经发布的消息个数，即下一个消息的序号
+    std::atomic<int> block_timeout_ms_;
+
+    // 订阅者等待新消息
+    std::mutex wait_mutex_;
+    std::condition_variable wait_cond_;
+    std::atomic<int> waiters_;
+
+    // 发布者等待BLOCK订阅者
+    std::mutex block_mutex_;
+    std::condition_variable block_cond_;
+    std::atomic<bool> publisher_waiting_;
+
+    // 只由发布者访问
+    uint64_t gate_;                 // 写入序号小于gate_的消息不需要等待BLOCK订阅者
+    uint64_t gate_version_;         // gate_是按这个版本的订阅者列表计算的
+    uint64_t stalled_at_;           // 上次等待超时时最慢的BLOCK订阅者的cursor
+    uint64_t reclaimed_;            // 小于reclaimed_的槽位已经清空
+};
+
+#endif //QUOTE_SERVER_FANOUT_DISPATCHER_H
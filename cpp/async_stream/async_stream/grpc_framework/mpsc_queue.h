@@ -0,0 +1,70 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_MPSC_QUEUE_H
+#define QUOTE_SERVER_MPSC_QUEUE_H
+
+#include <atomic>
+
+/// mpsc_queue的节点。入队的对象须继承自此类。
+struct mpsc_node{
+    mpsc_node(): next(nullptr) {}
+    std::atomic<mpsc_node*> next;
+};
+
+/// 无锁的多生产者/单消费者侵入式队列（Dmitry Vyukov的算法）。
+/// \li push()可以在多个线程中同时调用，只有一次原子交换，不会阻塞。
+/// \li pop()同一时刻只能有一个线程调用。
+/// \li 当某个生产者正在push()的中途，pop()可能暂时返回nullptr，该生产者完成push()后即可取出。
+/// 队列不拥有节点，节点的内存由调用者管理。
+class mpsc_queue{
+public:
+    mpsc_queue(): head_(&stub_), tail_(&stub_) {}
+
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+    /// 入队。可以在多个线程中同时调用。
+    void push(mpsc_node* node){
+        node->next.store(nullptr, std::memory_order_relaxed);
+        mpsc_node* prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_seq_cst);
+    }
+
+    /// 出队。同一时刻只能有一个线程调用。
+    /// \return 队首的节点；队列为空或者队尾的节点尚未链接完成时，返回nullptr。
+    mpsc_node* pop(){
+        mpsc_node* tail = tail_;
+        mpsc_node* next = tail->next.load(std::memory_order_acquire);
+        if( tail == &stub_ ){
+            if( next == nullptr ){
+                return nullptr;
+            }
+            tail_ = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if( next != nullptr ){
+            tail_ = next;
+            return tail;
+        }
+        if( tail != head_.load(std::memory_order_acquire) ){
+            return nullptr;
+        }
+        push(&stub_);
+        next = tail->next.load(std::memory_order_acquire);
+        if( next != nullptr ){
+            tail_ = next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+private:
+    std::atomic<mpsc_node*> head_;
+    mpsc_node* tail_;
+    mpsc_node stub_;
+};
+
+#endif //QUOTE_SERVER_MPSC_QUEUE_H
@@ -10,6 +10,7 @@
 #include <thread>
 #include <list>
 #include <algorithm>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 
@@ -18,25 +19,56 @@ using google::protobuf::ArenaOptions;
 
 
 
+/// 消息队列。push()复制消息到Arena中，工作线程批量取出后回调handle_msg()。
+/// \li 默认只要有消息就取出；set_batch()之后，攒够batch_size个消息或者最早的消息等待了batch_delay_ms才取出。
+/// \li set_fold()之后，积压超过一定个数时新消息通过fold_msg()合并进队尾的消息，不再单独入队。
+/// \li 缓存超过buffer_size时，通过merge_msg()把积压的消息合并到备用的Arena中，两个Arena交替使用。
+/// \li 子类的析构函数须先调用stop()，否则工作线程可能在子类析构后回调handle_msg()。
+/// \tparam MSG protobuf消息类型
 template<typename MSG>
 class msg_queue{
 public:
     msg_queue(size_t buffer_size = 1024*1024*64)
-            : max_arena_size_ (buffer_size), working_(true) {
+            : max_arena_size_ (buffer_size), working_(true), batch_size_(0), batch_delay_ms_(0)
+            , fold_backlog_(0), folding_(false) {
         ArenaOptions opt;
         arena_ = std::unique_ptr<Arena>(new Arena(opt));
         working_arena_ = std::unique_ptr<Arena>(new Arena(opt));
+        merge_arena_ = std::unique_ptr<Arena>(new Arena(opt));
 
         work_thrd_ = std::thread(&msg_queue::work_thrd_func, this);
     };
 
     virtual ~msg_queue(){
+        stop();
+    };
+
+    /// 处理完已经push的消息，然后结束工作线程。可以重复调用。
+    void stop(){
         push(static_cast<MSG*>(nullptr));
         working_ = false;
         if( work_thrd_.joinable() ){
             work_thrd_.join();
         }
-    };
+    }
+
+    /// 设置批量取出的条件，两个条件满足其一即取出。
+    /// \param batch_size 攒够的消息个数，0表示不限。
+    /// \param batch_delay_ms 最早的消息最多等待的毫秒数，0表示不限。
+    void set_batch(size_t batch_size, int batch_delay_ms){
+        lock_t lock(mtx_list_);
+        batch_size_ = batch_size;
+        batch_delay_ms_ = batch_delay_ms;
+        cond_.notify_one();
+    }
+
+    /// 设置合并的条件：队列中已经有backlog个消息时，新消息通过fold_msg()合并进队尾的消息。
+    /// 积压达到backlog个时也视为攒够了一批（参见set_batch()），工作线程空闲时会立即取出，所以只有跟不上时才会合并。
+    /// \param backlog 开始合并的积压个数，0表示不合并（默认）。
+    void set_fold(size_t backlog){
+        lock_t lock(mtx_list_);
+        fold_backlog_ = backlog;
+    }
 
     int push(const MSG* msg){
         if( !working_ ){
@@ -51,35 +83,54 @@ public:
             return 0;
         }
 
+        if( msg_list_.empty() ){
+            first_push_ = steady_clock_t::now();
+        }
+
         if( arena_->SpaceUsed() > max_arena_size_ ){
             return -2;
         }
 
+        // 积压较多时合并进队尾的消息，不复制整个消息
+        if( fold_backlog_ > 0 && msg_list_.size() >= fold_backlog_ && msg_list_.back() != nullptr ){
+            if( this->fold_msg(msg_list_.back(), *msg, !folding_) ){
+                folding_ = true;
+                if( batch_ready() ){
+                    cond_.notify_one();
+                }
+                return 0;
+            }
+        }
+
 		MSG* new_msg = Arena::CreateMessage<MSG>(arena_.get());
 		*new_msg = *msg;
         msg_list_.push_back(new_msg);
+        folding_ = false;
 
         // merge message
         if( arena_->SpaceUsed() > max_arena_size_ ){
             std::list<MSG*> merged_list;
-            std::unique_ptr<Arena> merged_arena( new Arena() );
 
-            this->merge_msg(msg_list_, merged_list, merged_arena.get());
+            this->merge_msg(msg_list_, merged_list, merge_arena_.get());
 
             if( merged_list.size() > 0){
                 //exam memory allocation
                 for(auto msg_ptr : merged_list){
-                    if( msg_ptr->GetArena() !=  merged_arena.get()){
+                    if( msg_ptr != nullptr && msg_ptr->GetArena() !=  merge_arena_.get()){
                         throw std::logic_error("object should be allocated by Arena");
                     }
                 }
 
                 msg_list_.swap(merged_list);
-                arena_.swap(merged_arena);
+                arena_.swap(merge_arena_);
             }
+            // 合并前的消息不再使用，复位后留作下次合并
+            merge_arena_->Reset();
         }
 
-        cond_.notify_one();
+        if( batch_ready() ){
+            cond_.notify_one();
+        }
         return 0;
     }
 
@@ -88,14 +139,29 @@ protected:
 	virtual void handle_msg(const std::list<MSG*>& msg_list) = 0;
 
     virtual void merge_msg(const std::list<MSG*>& src, std::list<MSG*>& dest, Arena* arena){};
+
+    /// 把msg合并进队尾的消息into，参见set_fold()。持有队列的锁时调用。
+    /// \param into 队尾的消息，在队列的Arena中。
+    /// \param msg 新消息，只在调用期间有效。
+    /// \param first into是否是第一次被合并。否则into自上次合并以来没有变化，子类可以沿用上次的状态（如索引）。
+    /// \return 是否已经合并。返回false时msg照常入队。
+    virtual bool fold_msg(MSG* into, const MSG& msg, bool first){ return false; }
 private:
     void work_thrd_func(){
         lock_t lock(mtx_list_);
         while(true){
             cond_.wait(lock,  [this](){return msg_list_.size()>0; });
+            // 等到攒够一批，或者最早的消息超时
+            if( batch_delay_ms_ > 0 ){
+                cond_.wait_until(lock, first_push_ + std::chrono::milliseconds(batch_delay_ms_),
+                                 [this](){ return batch_ready(); });
+            } else {
+                cond_.wait(lock, [this](){ return batch_ready(); });
+            }
 
             msg_list_.swap(working_msg_list_);
             arena_.swap(working_arena_);
+            folding_ = false;
 
             lock.unlock();
 
@@ -116,9 +182,19 @@ private:
         }
     };
 
+    /// 是否可以取出当前的消息。须持有mtx_list_。
+    /// 开始合并后消息个数不再增加，所以也视为攒够了一批。
+    bool batch_ready() const{
+        return msg_list_.back() == nullptr
+               || (batch_size_ == 0 && batch_delay_ms_ == 0)
+               || (batch_size_ > 0 && msg_list_.size() >= batch_size_)
+               || (fold_backlog_ > 0 && msg_list_.size() >= fold_backlog_);
+    }
+
 private:
     typedef std::mutex mutex_t;
     typedef std::unique_lock<mutex_t> lock_t;
+    typedef std::chrono::steady_clock steady_clock_t;
 
     std::thread work_thrd_;
 
@@ -130,9 +206,17 @@ private:
 
     std::list<MSG*> working_msg_list_;
     std::unique_ptr<Arena> working_arena_;
+    std::unique_ptr<Arena> merge_arena_;    // merge_msg()使用的Arena，与arena_交替使用
 
     size_t max_arena_size_; // max bytes of arena_
 
     bool working_;
+
+    size_t batch_size_;
+    int batch_delay_ms_;
+    steady_clock_t::time_point first_push_;    // msg_list_中最早的消息push的时间
+
+    size_t fold_backlog_;   // 开始合并的积压个数，参见set_fold()
+    bool folding_;          // 队尾的消息是否是上次fold_msg()合并的结果
 };
 #endif //PROVIDER_MESSAGE_QUEUE_H
@@ -5,9 +5,14 @@
 #ifndef QUOTE_SERVER_RPC_READER_H
 #define QUOTE_SERVER_RPC_READER_H
 
+#include "tag_base.h"
+#include "arena_pool.h"
+
 #include <google/protobuf/arena.h>
 #include <grpc/support/log.h>
 
+#include <atomic>
+
 #define RPC_READER_LOG 0
 
 
@@ -16,6 +21,85 @@ using google::protobuf::Arena;
 template<typename R, typename READER>
 class reader;
 
+/// 一次读操作使用的Arena及其引用计数，分配在该Arena中。
+struct read_slot{
+    std::atomic<long> refs;
+    pooled_arena* arena;
+    void* msg;
+
+    void ref(){
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// 最后一个引用释放时，Arena归还到所属线程的arena_pool。
+    void unref(){
+        if( refs.fetch_sub(1, std::memory_order_acq_rel) == 1 ){
+            arena_pool::release(arena);
+        }
+    }
+};
+
+/// 读取到的消息的引用计数句柄。持有句柄期间消息一直有效，可以交给其他线程处理，不需要复制。
+/// 最后一个句柄释放时，消息所在的Arena被回收。参见reader::hold()。
+/// \tparam R 消息的类型。
+template<typename R>
+class read_handle{
+    template<typename, typename>
+    friend class reader;
+public:
+    read_handle(): slot_(nullptr) {}
+
+    read_handle(const read_handle& other): slot_(other.slot_){
+        if( slot_ ){
+            slot_->ref();
+        }
+    }
+
+    read_handle(read_handle&& other): slot_(other.slot_){
+        other.slot_ = nullptr;
+    }
+
+    read_handle& operator=(read_handle other){
+        std::swap(slot_, other.slot_);
+        return *this;
+    }
+
+    ~read_handle(){
+        reset();
+    }
+
+    /// 释放引用。
+    void reset(){
+        if( slot_ ){
+            slot_->unref();
+            slot_ = nullptr;
+        }
+    }
+
+    const R* get() const{
+        return slot_ ? static_cast<const R*>(slot_->msg) : nullptr;
+    }
+
+    const R& operator*() const{
+        return *get();
+    }
+
+    const R* operator->() const{
+        return get();
+    }
+
+    explicit operator bool() const{
+        return slot_ != nullptr;
+    }
+
+private:
+    explicit read_handle(read_slot* slot): slot_(slot){
+        slot_->ref();
+    }
+
+    read_slot* slot_;
+};
+
 /// 异步读操作的回调接口。
 class reader_callback{
     template<typename R, typename READER>
@@ -30,6 +114,8 @@ protected:
 };
 
 /// 对gRPC异步读操作的封装。
+/// 每次读操作从当前线程的arena_pool取一个Arena，读取完成后释放reader自己的引用。
+/// 如果on_read()中通过hold()保留了消息，Arena在最后一个read_handle释放时才回收，不影响下一次读操作。
 /// \tparam R 读取的数据类型
 /// \tparam READER 具体的执行读取操作的对象，通常为ServerAsyncReaderWriter<W,R>或ClientAsyncReaderWriter<W,R>
 template<typename R, typename READER>
@@ -37,10 +123,13 @@ class reader : public tag_base{
 public:
 
     reader(reader_callback* cb, READER& async_reader)
-            :callback_(*cb), reader_impl_(async_reader), auto_read_(true){
-        arena_ = std::unique_ptr<Arena>(new Arena());
+            :callback_(*cb), reader_impl_(async_reader), auto_read_(true), req_(nullptr), slot_(nullptr){
     };
 
+    virtual ~reader(){
+        drop();
+    }
+
     /// 设置是否自动读取下一个消息。
     /// \param auto_read 当等于true，程序会在收到读取事件后，自动触发下一次读操作；否则，不触发。
     void set_auto(bool auto_read){
@@ -52,17 +141,29 @@ public:
 #if RPC_READER_LOG
         gpr_log(GPR_DEBUG, "start reading");
 #endif
-        arena_->Reset();
-        req_ = Arena::Create<R>(arena_.get());
-        reader_impl_.Read(req_, this);
+        pooled_arena* pooled = arena_pool::local().acquire();
+        Arena* arena = pooled->arena();
+        slot_ = Arena::Create<read_slot>(arena);
+        slot_->refs.store(1, std::memory_order_relaxed);
+        slot_->arena = pooled;
+        req_ = Arena::Create<R>(arena);
+        slot_->msg = req_;
+        reader_impl_.Read(req_, tag());
     };
 
+    /// 保留当前读取到的消息。只能在reader_callback::on_read()中调用。
+    /// \return 消息的句柄，可以在任意线程中使用和释放。
+    read_handle<R> hold(){
+        return read_handle<R>(slot_);
+    }
+
     /// 继承自tag_base。CompletionQueue的回调函数，表示一次读操作完成。
     virtual void process(){
 #if RPC_READER_LOG
         gpr_log(GPR_DEBUG, "end reading %p", this);
 #endif
         callback_.on_read((void*)req_);
+        drop();
         if(auto_read_){
             read();
         }
@@ -75,14 +176,23 @@ public:
     /// \li    the next cq->Next, ServerContext::IsCancelled()==true.
     /// - So we can terminate the client when ok is false .
     virtual void on_error(){
+        drop();
         callback_.on_read_error();
     }
 private:
+    /// 释放reader对当前消息的引用。
+    void drop(){
+        if( slot_ ){
+            req_ = nullptr;
+            slot_->unref();
+            slot_ = nullptr;
+        }
+    }
+
     reader_callback& callback_;
     READER& reader_impl_;
     bool auto_read_;
     R* req_;
-
-    std::unique_ptr<Arena> arena_;
+    read_slot* slot_;
 };
 #endif //QUOTE_SERVER_RPC_READER_H
@@ -6,14 +6,23 @@
 #define QUOTE_SERVER_RPC_WRITER_H
 
 #include "tag_base.h"
+#include "mpsc_queue.h"
+#include "arena_pool.h"
 
 #include <grpc++/server.h>
+#include <grpc++/support/byte_buffer.h>
 #include <grpc/support/log.h>
 #include <google/protobuf/arena.h>
 
-#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <thread>
-#include <list>
 
 using google::protobuf::Arena;
 
@@ -25,11 +34,65 @@ public:
     virtual void on_write(int write_id) = 0;
     /// 写操作失败的回调接口
     virtual void on_write_error() = 0;
+    /// 合并发送队列中的数据，参见writer::set_merge()。没有类型检查，优先使用set_merge()的merge参数。默认不合并。
+    /// 第一个参数为已经取出、即将写出的数据（W*），可以直接修改；第二个参数为队列中的下一个数据（const W*）。
+    /// \return 等于true时，下一个数据已经合并，不再单独写出；否则，在之后单独写出。
+    virtual bool merge_write(void*, const void*){
+        return false;
+    }
+    /// 发送队列曾经满过（write()返回-1），现在降到低水位以下，可以继续写。在完成队列的线程中回调。
+    /// 参见writer::set_low_water()。默认不处理。
+    virtual void on_writable() {}
+};
+
+/// 合并函数的常用实现（参见writer::set_merge()）：使用protobuf的MergeFrom合并，repeated字段会被追加，
+/// 例如多个MultiQuote合并成一个包含所有entities的MultiQuote。
+template<typename W>
+bool merge_message(W& into, const W& next){
+    into.MergeFrom(next);
+    return true;
+}
+
+/// 发送队列中数据的创建、计量和释放方式。W为protobuf消息时，数据复制到Arena中，以Arena的用量计量。
+template<typename W>
+struct write_traits{
+    static W* create(Arena* arena){
+        return Arena::CreateMessage<W>(arena);
+    }
+    static size_t size(const W&, Arena* arena){
+        return arena->SpaceUsed();
+    }
+    static void release(W*){}
 };
 
+/// W为grpc::ByteBuffer时，写入的是已经序列化的数据。复制ByteBuffer只增加slice的引用计数，不复制数据，
+/// 所以同一份序列化结果可以写给多个writer。计量时加上数据的长度，发送完成后立即释放对slice的引用。
+template<>
+struct write_traits<grpc::ByteBuffer>{
+    static grpc::ByteBuffer* create(Arena* arena){
+        return Arena::Create<grpc::ByteBuffer>(arena);
+    }
+    static size_t size(const grpc::ByteBuffer& buffer, Arena* arena){
+        return arena->SpaceUsed() + buffer.Length();
+    }
+    static void release(grpc::ByteBuffer* buffer){
+        buffer->Clear();
+    }
+};
+
+/// 多个发送队列（lane）之间选择下一个写出的数据的方式，参见writer::set_lanes()。
+enum class LanePolicy {
+    STRICT,     // 严格优先：总是先写序号小的lane
+    WEIGHTED    // 按权重轮流（平滑加权轮询），低优先级的lane不会饿死
+};
 
 /// 对gRPC异步写操作的封装。内部有一个发送队列，缓存了待写出的数据。
-/// \tparam W 写出的数据类型。
+/// 发送队列是无锁的多生产者/单消费者队列：write()可以在多个线程中同时调用，不会互相阻塞；
+/// 同一时刻只有一个线程（状态从IDLE切换到WRITING的那个线程，之后是CompletionQueue的线程）从队列中取数据。
+/// 待发送的数据复制到从调用线程的arena_pool取出的Arena中，发送完成后Arena归还到池中复用。
+/// 发送队列积压时，可以将队列中的多个数据合并成一次写操作，参见set_merge()。
+/// 发送队列可以分成多个优先级的lane（参见set_lanes()），心跳、订阅变更等小的控制消息不必排在大量数据之后。
+/// \tparam W 写出的数据类型。可以是grpc::ByteBuffer，见write_traits。
 /// \tparam WRITER 具体的执行写操作的对象，通常为ServerAsyncWriter<W> 或 ServerAsyncReaderWriter<R,W> 或 ClientAsyncReaderWriter<W,R>
 template<typename W, typename WRITER>
 class writer : public tag_base{
@@ -37,77 +100,180 @@ public:
     writer(writer_callback* cb, WRITER& async_writer, size_t buf_size = 1024 * 1024 * 32)
             : callback_(*cb)
             , writer_impl_(async_writer)
-
     {
+        current_ = nullptr;
+        unsent_ = nullptr;
+        finishing_ = false;
+        finish_tag_ = nullptr;
+        finish_call_ = nullptr;
+        lane_count_ = 1;
+        lanes_.reset(new lane[1]);
+        lane_policy_ = LanePolicy::STRICT;
+        merge_depth_ = 0;
+        merge_bytes_ = 0;
+        merge_batch_ = 0;
         auto_write_ = true;
         max_buffer_size_ = buf_size;
+        low_water_ = buf_size / 2;
         cur_buffer_size_ = 0;
+        blocked_ = false;
+        waiters_ = 0;
+        queued_count_ = 0;
         status_ = STOP ;
-        input_id = output_id = 0;
+        input_id = 0;
     };
 
     virtual ~writer(){
-        stop();
+        status_ = STOP;
+        clear();
     }
 
     /// 如果发送队列中有数据，是否自动执行下一个写操作。
-    /// \param auto_write 等于true时，自动发送一个数据；否则，不发送。
+    /// \param auto_write 等于true时，自动发送一个数据；否则，不发送，须在on_write()中调用write_next()写出下一个数据。
     void set_auto(bool auto_write){
         auto_write_ = auto_write;
     }
 
+    /// 合并函数：把第二个参数合并到第一个参数（已经取出、即将写出的数据）中，返回是否合并。参见merge_message()。
+    typedef std::function<bool (W&, const W&)> merge_func_t;
+
+    /// 开启发送队列的合并。开启后，每次取出数据时，如果队列中的数据个数达到depth，或者字节数达到bytes，
+    /// 依次调用merge（没有设置时调用writer_callback::merge_write()），将之后的数据合并到取出的数据中，最多合并batch个，
+    /// 一次写操作写出。合并后的每个数据仍然会各自回调on_write()。队列没有积压时，不合并，不增加延迟。
+    /// 须在start()之前调用。
+    /// \param depth 开始合并的队列中数据个数。
+    /// \param bytes 开始合并的队列中字节数，等于0时不按字节数判断。
+    /// \param batch 一次写操作最多包含的数据个数，小于2时关闭合并。
+    /// \param merge 合并函数，返回false时，该数据在之后单独写出。
+    void set_merge(size_t depth, size_t bytes, size_t batch, merge_func_t merge = merge_func_t()){
+        merge_depth_ = depth;
+        merge_bytes_ = bytes;
+        merge_batch_ = batch;
+        merge_ = merge;
+    }
+
+    /// 把发送队列分成count个lane，lane 0的优先级最高。write(resp)写入最后一个（优先级最低）的lane，
+    /// write_lane()写入指定的lane。每次发起写操作时按policy选择lane。须在start()之前调用。
+    /// \param count lane的个数，至少为1。
+    /// \param policy 选择lane的方式。
+    void set_lanes(size_t count, LanePolicy policy = LanePolicy::STRICT){
+        lane_count_ = std::max<size_t>(count, 1);
+        lanes_.reset(new lane[lane_count_]);
+        lane_policy_ = policy;
+    }
+
+    /// 设置lane的字节数上限和权重。lane的字节数同时计入整个发送队列的字节数。
+    /// 设置了上限的lane只受自己的上限限制，不受整个发送队列的大小限制，所以低优先级的数据积压满发送队列时，
+    /// 控制消息仍然可以写入；此时发送队列的字节数最多超出各lane的上限之和。
+    /// \param index lane的序号。
+    /// \param max_bytes lane的字节数上限，达到后写入该lane的write_lane()返回-1；等于0时只受整个发送队列的大小限制。
+    /// \param weight LanePolicy::WEIGHTED时的权重，至少为1。
+    void set_lane(size_t index, size_t max_bytes, unsigned weight = 1){
+        if( index < lane_count_ ){
+            lanes_[index].max_bytes = max_bytes;
+            lanes_[index].weight = std::max<unsigned>(weight, 1);
+        }
+    }
+
+    /// lane中的字节数，包括正在写出的数据。
+    size_t queued_bytes(size_t index) const{
+        return index < lane_count_ ? lanes_[index].bytes.load() : 0;
+    }
+
+    /// 设置低水位。write()因为发送队列满而失败后，队列中的字节数降到低水位以下时，回调writer_callback::on_writable()。
+    /// \param bytes 低水位的字节数，默认为发送队列大小的一半。
+    void set_low_water(size_t bytes){
+        low_water_ = bytes;
+    }
+
+    /// 发送队列中的字节数，包括正在写出的数据。
+    size_t queued_bytes() const{
+        return cur_buffer_size_.load();
+    }
+
+    /// 发送队列中等待写出的数据个数，不包括正在写出的数据。
+    int queued_count() const{
+        return queued_count_.load();
+    }
+
     /// 启动写操作，等待wirte()被调用
     void start(){
-        lock_t lock(mtx_);
-        if( status_ == STOP ){
-            status_ = IDLE;
-        }
+        CallStatus expected = STOP;
+        status_.compare_exchange_strong(expected, IDLE);
     }
 
     /// 停止发送，并清空队列中没有发送的数据。
+    /// 如果有正在进行的写操作，队列在该操作完成时（process()）清空。
     void stop(){
-        lock_t lock(mtx_);
-        status_ = STOP;
-        while(write_buffer_.size() > 0){
-            W* w = write_buffer_.front();
-            write_buffer_.pop_front();
-            Arena* arena = w->GetArena();
-            if( arena ){
-                delete arena;
-            }
+        if( status_.exchange(STOP) == IDLE ){
+            clear();
         }
-        cur_buffer_size_ = 0;
+        wake_waiters();
     }
 
-    /// 发送数据resp。将resp加入到发送队列，等待处理。
+    /// 发送数据resp。将resp加入到发送队列，等待处理。可以在多个线程中同时调用。
     /// \param resp 待发送的数据。
     /// \return 返回本次操作的ID。当发送完成时，回调writer_callback::on_write(int write_id),
     /// 可以知道那个数据被发送了。
     int write(const W& resp){
+        return write_lane(resp, lane_count_ - 1);
+    }
 
-        lock_t lock(mtx_);
-
-        if( status_ == STOP ){
+    /// 发送数据resp到指定的lane，参见set_lanes()。
+    /// \param resp 待发送的数据。
+    /// \param index lane的序号，超出范围时使用最后一个lane。
+    /// \return 本次操作的ID；发送队列或lane已满、已经停止或者已经调用finish()时返回-1。
+    int write_lane(const W& resp, size_t index){
+        if( status_ == STOP || finishing_ ){
             return -1;
         }
 
-        if( cur_buffer_size_ >= max_buffer_size_ ){
+        index = std::min(index, lane_count_ - 1);
+        if( is_full(index) ){
             return -1;
         }
 
-		Arena* arena = new Arena();
-		W* w= Arena::CreateMessage<W>(arena);
-		*w = resp;
-		write_buffer_.push_back(w);
-        cur_buffer_size_ += arena->SpaceUsed();
+        int id = input_id.fetch_add(1);
+        enqueue(resp, id, index);
+        try_dispatch();
 
-        if( status_ == IDLE){
-            GPR_ASSERT(write_buffer_.size() == 1);
-            status_ = WRITING;
-            writer_impl_.Write(*write_buffer_.front(), this);
-        }
+        return id;
+    }
+
+    /// 发送数据resp。发送队列满时，最多等待timeout_ms毫秒。不能在完成队列的线程中调用，否则队列不会减少。
+    /// \param resp 待发送的数据。
+    /// \param timeout_ms 等待的毫秒数。
+    /// \return 本次操作的ID；超时、已经停止或者已经调用finish()时返回-1。
+    int write(const W& resp, int timeout_ms){
+        return write_lane(resp, lane_count_ - 1, timeout_ms);
+    }
 
-        return input_id++;
+    /// 发送数据resp到指定的lane，队列满时最多等待timeout_ms毫秒。参见write(const W&, int)。
+    int write_lane(const W& resp, size_t index, int timeout_ms){
+        index = std::min(index, lane_count_ - 1);
+        int id = write_lane(resp, index);
+        if( id >= 0 || status_ == STOP || finishing_ || timeout_ms <= 0 ){
+            return id;
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while( true ){
+            {
+                std::unique_lock<std::mutex> lock(wait_mutex_);
+                waiters_.fetch_add(1);
+                bool ready = wait_cond_.wait_until(lock, deadline, [this, index](){
+                    return status_ == STOP || finishing_ || !lane_full(index);
+                });
+                waiters_.fetch_sub(1);
+                if( !ready ){
+                    return -1;
+                }
+            }
+            // 可能被其他生产者抢先写满
+            id = write_lane(resp, index);
+            if( id >= 0 || status_ == STOP || finishing_ ){
+                return id;
+            }
+        }
     }
 
     /// 发送多个数据。[__first,__last)区间的数据会被添加到发送队列，等待处理。
@@ -117,9 +283,7 @@ public:
     /// \return 第一个和最后一个请求的ID。如果当前状态为STOP或__first等于__last时，返回{-1,-1}
     template <class _InputIter>
     std::pair<int, int> write(_InputIter __first, _InputIter __last){
-        lock_t lock(mtx_);
-
-        if( status_ == STOP ){
+        if( status_ == STOP || finishing_ ){
             return {-1, -1};
         }
 
@@ -127,98 +291,392 @@ public:
             return {-1, -1};
         }
 
-        if( cur_buffer_size_ >= max_buffer_size_ ){
+        size_t index = lane_count_ - 1;
+        if( is_full(index) ){
             return {-1, -1};
         }
 
+        int count = static_cast<int>(std::distance(__first, __last));
+        int original = input_id.fetch_add(count);
+        int id = original;
         for( _InputIter it = __first; it != __last; ++it){
-            Arena* arena = new Arena();
-            W* w= Arena::CreateMessage<W>(arena);
-            *w = *it;
-            write_buffer_.push_back(w);
-            cur_buffer_size_ += arena->SpaceUsed();
-        }
-
-        if( status_ == IDLE){
-            GPR_ASSERT(write_buffer_.size() == std::distance(__first, __last));
-            status_ = WRITING;
-            writer_impl_.Write(*write_buffer_.front(), this);
+            enqueue(*it, id++, index);
         }
+        try_dispatch();
 
-        int original = input_id;
-        input_id += std::distance(__first, __last);
-        return {original, input_id - 1};
+        return {original, original + count - 1};
     }
 
     /// 发送队列中的下一个数据。仅当set_auto(false)时使用。
-    /// 注意：此处没有线程同步。
+    /// process()在回调on_write()之前已经取出（并合并）下一个数据，这里写出它；合并的数据各自回调on_write()，
+    /// 只有第一次调用写出。队列为空时什么也不做，之后的write()直接写出。
+    /// 注意：只能在on_write()回调中调用，否则不会再写出，发送队列停滞。
     void write_next(){
-        if( status_ == STOP || status_ == IDLE){
+        node* n = unsent_.exchange(nullptr);
+        if( n == nullptr ){
             return;
         }
-        GPR_ASSERT(write_buffer_.size() > 0);
-        writer_impl_.Write(*write_buffer_.front(), this);
+        writer_impl_.Write(*n->msg, tag());
     }
 
-    /// 结束本次RPC调用。
+    /// 结束本次RPC调用。只能调用一次，之后的write()返回-1。
+    /// 不必等待on_write()：发送队列中的数据全部写出、没有正在进行的写操作时才发出Finish，
+    /// Finish不会与Write同时进行，也不会丢弃已经入队的数据。已经停止（调用已结束）时不再发出Finish。
     /// \param status grpc的状态码。
     /// \param tag 回调的tag。
     void finish(const grpc::Status& status, void* tag){
-        writer_impl_.Finish(status, tag);
+        finish_status_ = status;
+        finish_tag_ = tag;
+        finish_call_ = &writer::issue_finish;
+        finishing_.store(true);
+        // 空闲时由本线程发出Finish；否则由正在写出的线程在队列写空时发出
+        try_dispatch();
     }
 
     /// 继承自tag_base。完成队列处理函数。
     virtual void process(){
 
-        lock_t lock(mtx_);
         if( status_ == STOP ){
+            clear();
             return ;
         }
-        GPR_ASSERT(write_buffer_.size() >= 1);
-        W* w = write_buffer_.front();
-        write_buffer_.pop_front();
-        Arena* arena = w->GetArena();
-        if( arena ){
-            cur_buffer_size_ -= arena->SpaceUsed();
-            delete arena;
+        GPR_ASSERT(current_ != nullptr);
+        node* done = current_;
+        current_ = nullptr;
+        // 手动模式下先取出下一个数据，on_write()中调用的write_next()才有数据可写
+        if( !auto_write_ ){
+            dispatch(false);
         }
+        while( done != nullptr ){
+            node* merged = done->merged;
+            int id = done->id;
+            release(done);
 
-        callback_.on_write(output_id++);
-
+            callback_.on_write(id);
+            done = merged;
+        }
 
-        if(write_buffer_.size()>0){
-            if( auto_write_ ) {
-                writer_impl_.Write(*write_buffer_.front(), this);
-            }
-        } else {
-            status_ = IDLE;
+        if( auto_write_ ){
+            dispatch(false);
         }
+        notify_writable();
     };
 
     /// 继承自tag_base。完成队列处理函数。
     virtual void on_error(){
         callback_.on_write_error();
+        wake_waiters();
     }
 
 
 private:
-    enum CallStatus { IDLE, WRITING, STOP };
-    CallStatus status_;
+    /// 发送队列的节点，和待发送的数据分配在同一个Arena中。
+    struct node : public mpsc_node{
+        pooled_arena* arena;
+        W* msg;
+        int id;
+        size_t size;
+        size_t lane;
+        node* merged;   // 合并到本节点中的下一个节点
+    };
+
+    /// 一个优先级的发送队列。
+    struct lane{
+        lane(): held(nullptr), count(0), bytes(0), max_bytes(0), weight(1), current(0) {}
+        mpsc_queue queue;
+        node* held;                     // 合并时取出、但没能合并的节点，放回本lane的队首，只由持有WRITING状态的线程访问
+        std::atomic<int> count;         // 队列中的数据个数，包括held
+        std::atomic<size_t> bytes;      // 队列中的字节数，包括已经取出、还没有释放的数据
+        size_t max_bytes;
+        unsigned weight;
+        long current;                   // 平滑加权轮询的当前值，只由持有WRITING状态的线程访问
+    };
+
+    void enqueue(const W& resp, int id, size_t index){
+        pooled_arena* pooled = arena_pool::local().acquire();
+        Arena* arena = pooled->arena();
+        node* n = Arena::Create<node>(arena);
+        n->arena = pooled;
+        n->msg = write_traits<W>::create(arena);
+        *n->msg = resp;
+        n->id = id;
+        n->lane = index;
+        n->merged = nullptr;
+        n->size = write_traits<W>::size(*n->msg, arena);
+        cur_buffer_size_ += n->size;
+
+        lane& l = lanes_[index];
+        l.bytes += n->size;
+        l.queue.push(n);
+        l.count.fetch_add(1);
+        queued_count_.fetch_add(1);
+    }
+
+    void release(node* n){
+        cur_buffer_size_ -= n->size;
+        lanes_[n->lane].bytes -= n->size;
+        write_traits<W>::release(n->msg);
+        arena_pool::release(n->arena);
+    }
+
+    /// lane是否已满：设置了上限的lane按自己的上限判断，其他lane按整个发送队列的大小判断，参见set_lane()。
+    bool lane_full(size_t index) const{
+        const lane& l = lanes_[index];
+        if( l.max_bytes > 0 ){
+            return l.bytes >= l.max_bytes;
+        }
+        return cur_buffer_size_ >= max_buffer_size_;
+    }
 
-    typedef std::mutex mutex_t;
-    typedef std::unique_lock<mutex_t> lock_t;
-    mutex_t mtx_;
+    /// 发送队列或者lane是否已满。满时记录blocked_，之后降到低水位以下时回调on_writable()。
+    bool is_full(size_t index){
+        if( !lane_full(index) ){
+            return false;
+        }
+        blocked_.store(true);
+        // 记录blocked_之前队列可能已经清空，process()看不到blocked_，所以再检查一次
+        return lane_full(index);
+    }
+
+    /// 写出完成、释放数据后调用：唤醒等待的write()，降到低水位以下时回调on_writable()。
+    void notify_writable(){
+        wake_waiters();
+        if( cur_buffer_size_ < low_water_ && blocked_.load() && blocked_.exchange(false) ){
+            callback_.on_writable();
+        }
+    }
 
-    std::list<W*> write_buffer_;
+    /// 唤醒在write(resp, timeout_ms)中等待的线程。没有等待者时不加锁。
+    void wake_waiters(){
+        if( waiters_.load() > 0 ){
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            wait_cond_.notify_all();
+        }
+    }
+
+    /// 生产者入队后调用。如果当前没有写操作，由本线程接管发送队列并发起写操作。
+    void try_dispatch(){
+        CallStatus expected = IDLE;
+        if( status_.compare_exchange_strong(expected, WRITING) ){
+            dispatch(true);
+        }
+    }
+
+    /// 取出下一个数据并发起写操作。调用者须持有WRITING状态。
+    /// 队列为空时，如果已经调用finish()则发出Finish并停止；否则切换到IDLE，
+    /// 之后再检查一次，避免遗漏与切换同时入队的数据或者同时调用的finish()。
+    /// \param force 等于true时，忽略auto_write_，总是发起写操作。
+    void dispatch(bool force){
+        while( true ){
+            node* n = next();
+            if( n != nullptr ){
+                merge(n);
+                current_ = n;
+                if( force || auto_write_ ){
+                    writer_impl_.Write(*n->msg, tag());
+                } else {
+                    unsent_.store(n);
+                }
+                return;
+            }
+
+            if( finishing_.load() ){
+                CallStatus expected = WRITING;
+                if( status_.compare_exchange_strong(expected, STOP) ){
+                    finish_call_(*this);
+                } else {
+                    clear();
+                }
+                wake_waiters();
+                return;
+            }
+
+            CallStatus expected = WRITING;
+            if( !status_.compare_exchange_strong(expected, IDLE) ){
+                // stop()在写操作进行中被调用
+                clear();
+                return;
+            }
+            if( queued_count_.load() <= 0 && !finishing_.load() ){
+                return;
+            }
+            expected = IDLE;
+            if( !status_.compare_exchange_strong(expected, WRITING) ){
+                return;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    /// 发出finish()记下的Finish。只在finish()中取地址，客户端的流（Finish的参数不同）不会实例化。
+    static void issue_finish(writer& w){
+        w.writer_impl_.Finish(w.finish_status_, w.finish_tag_);
+    }
+
+    /// 按lane_policy_选择lane，取出下一个节点。调用者须持有WRITING状态。
+    node* next(){
+        node* n = nullptr;
+        if( lane_policy_ == LanePolicy::WEIGHTED && lane_count_ > 1 ){
+            n = pop_weighted();
+            if( n != nullptr ){
+                return n;
+            }
+        }
+        for( size_t i = 0; i < lane_count_; ++i ){
+            n = pop(i);
+            if( n != nullptr ){
+                return n;
+            }
+        }
+        return nullptr;
+    }
+
+    /// 从指定的lane取出一个节点，放回的节点（held）优先。
+    node* pop(size_t index){
+        lane& l = lanes_[index];
+        if( l.count.load() <= 0 ){
+            return nullptr;
+        }
+        node* n = l.held;
+        if( n != nullptr ){
+            l.held = nullptr;
+        } else {
+            n = static_cast<node*>(l.queue.pop());
+        }
+        if( n != nullptr ){
+            l.count.fetch_sub(1);
+            queued_count_.fetch_sub(1);
+        }
+        return n;
+    }
+
+    /// 平滑加权轮询：每个非空的lane的current加上自己的权重，选current最大的，再减去所有非空lane的权重之和。
+    node* pop_weighted(){
+        long total = 0;
+        lane* best = nullptr;
+        size_t best_index = 0;
+        for( size_t i = 0; i < lane_count_; ++i ){
+            lane& l = lanes_[i];
+            if( l.count.load() <= 0 ){
+                continue;
+            }
+            l.current += l.weight;
+            total += l.weight;
+            if( best == nullptr || l.current > best->current ){
+                best = &l;
+                best_index = i;
+            }
+        }
+        if( best == nullptr ){
+            return nullptr;
+        }
+        best->current -= total;
+        return pop(best_index);
+    }
+
+    /// 队列积压时，将之后的节点合并到head中。不能合并的节点放回它的lane的队首，仍然按lane的优先级写出。
+    void merge(node* head){
+        if( merge_batch_ < 2 ){
+            return;
+        }
+        bool backlog = static_cast<size_t>(queued_count_.load()) >= merge_depth_
+                       || (merge_bytes_ > 0 && cur_buffer_size_.load() >= merge_bytes_);
+        if( !backlog ){
+            return;
+        }
+        node* tail = head;
+        for( size_t count = 1; count < merge_batch_; ++count ){
+            // 只合并同一个lane的数据，不改变lane之间的顺序
+            node* n = pop(head->lane);
+            if( n == nullptr ){
+                break;
+            }
+            bool merged = merge_ ? merge_(*head->msg, *n->msg) : callback_.merge_write(head->msg, n->msg);
+            if( !merged ){
+                hold(n);
+                break;
+            }
+            tail->merged = n;
+            tail = n;
+        }
+        if( tail != head ){
+            resize(head);
+        }
+    }
+
+    /// 把取出的节点放回它的lane的队首。
+    void hold(node* n){
+        lane& l = lanes_[n->lane];
+        l.held = n;
+        l.count.fetch_add(1);
+        queued_count_.fetch_add(1);
+    }
+
+    /// 合并后head->msg在head的Arena中变大，重新计量，差额计入发送队列和lane的字节数。
+    void resize(node* head){
+        size_t size = write_traits<W>::size(*head->msg, head->arena->arena());
+        if( size > head->size ){
+            cur_buffer_size_ += size - head->size;
+            lanes_[head->lane].bytes += size - head->size;
+            head->size = size;
+        }
+    }
+
+    /// 清空发送队列。调用者须保证没有其他线程在取数据。
+    void clear(){
+        unsent_.store(nullptr);
+        while( current_ != nullptr ){
+            node* merged = current_->merged;
+            release(current_);
+            current_ = merged;
+        }
+        for( size_t i = 0; i < lane_count_; ++i ){
+            if( lanes_[i].held != nullptr ){
+                lanes_[i].count.fetch_sub(1);
+                queued_count_.fetch_sub(1);
+                release(lanes_[i].held);
+                lanes_[i].held = nullptr;
+            }
+            while( node* n = static_cast<node*>(lanes_[i].queue.pop()) ){
+                lanes_[i].count.fetch_sub(1);
+                queued_count_.fetch_sub(1);
+                release(n);
+            }
+        }
+    }
+
+private:
+    enum CallStatus { IDLE, WRITING, STOP };
+    std::atomic<CallStatus> status_;
+
+    std::unique_ptr<lane[]> lanes_;
+    size_t lane_count_;
+    LanePolicy lane_policy_;
+    node* current_;                 // 正在写出（或等待write_next()写出）的数据
+    std::atomic<node*> unsent_;     // 手动模式下已经取出、等待write_next()写出的数据，即current_
+    std::atomic<bool> finishing_;   // 已经调用finish()，队列写空后发出Finish
+    grpc::Status finish_status_;
+    void* finish_tag_;
+    void (*finish_call_)(writer&);  // finish()设置为issue_finish
+    std::atomic<int> queued_count_; // 队列中的数据个数，不含current_
     size_t max_buffer_size_;
-    size_t cur_buffer_size_;
+    std::atomic<size_t> cur_buffer_size_;
+    size_t low_water_;
+    std::atomic<bool> blocked_;     // write()因为队列满而失败过，还没有回调on_writable()
+
+    std::mutex wait_mutex_;
+    std::condition_variable wait_cond_;
+    std::atomic<int> waiters_;      // 在write(resp, timeout_ms)中等待的线程数
 
     writer_callback& callback_;
     WRITER& writer_impl_;
 
-    int input_id;
-    int output_id;
+    std::atomic<int> input_id;
 
+    size_t merge_depth_;
+    size_t merge_bytes_;
+    size_t merge_batch_;
+    merge_func_t merge_;
     bool auto_write_;
 
 };
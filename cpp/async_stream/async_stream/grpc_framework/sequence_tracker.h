@@ -0,0 +1,136 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_SEQUENCE_TRACKER_H
+#define QUOTE_SERVER_SEQUENCE_TRACKER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+
+/// push()的结果。
+enum class SequenceResult {
+    APPLIED,        // 序号连续，消息（以及因此变得连续的缓存消息）已经按序应用
+    DUPLICATE,      // 序号已经应用过（重连后服务端重放的部分），丢弃
+    GAP,            // 出现新的缺口，消息已缓存，调用者应补取missing()给出的区间
+    BUFFERED,       // 缺口尚未补齐，消息已缓存
+    SKIPPED         // 缓存已满，放弃缺口，缓存的消息已按序应用
+};
+
+/// 带序号的推送流的序号跟踪和重排。
+/// \li 记录已经应用的最大序号last()，重连后从last() + 1开始重新订阅，已经应用过的重复消息被丢弃。
+/// \li 序号跳跃时缓存之后的消息，只补取缺失的区间；补齐后按序号顺序应用缓存的消息，保证同一行情不会被旧数据覆盖。
+/// \li 缺口无法补齐时（服务端没有这段数据或缓存已满），调用skip()放弃缺口，继续应用缓存的消息。
+/// 非线程安全，调用者负责加锁。
+/// \tparam T 缓存的消息类型，通常为read_handle<R>，缓存时不需要复制消息。
+template<typename T>
+class sequence_tracker{
+public:
+    /// 闭区间[first, last]。
+    struct range{
+        uint64_t first;
+        uint64_t last;
+    };
+
+    /// \param max_pending 最多缓存的消息个数。
+    sequence_tracker(size_t max_pending = 4096)
+            : max_pending_(max_pending), started_(false), last_(0) {}
+
+    /// 收到一个消息。
+    /// \param seq 消息的序号。
+    /// \param msg 消息，需要缓存时被移走。
+    /// \param apply 按序应用消息的函数，参数为(uint64_t seq, T& msg)。
+    template<typename APPLY>
+    SequenceResult push(uint64_t seq, T&& msg, APPLY apply){
+        if( !started_ ){
+            // 第一个消息作为起点
+            started_ = true;
+            apply(seq, msg);
+            last_ = seq;
+            return SequenceResult::APPLIED;
+        }
+        if( seq <= last_ || pending_.count(seq) ){
+            return SequenceResult::DUPLICATE;
+        }
+        if( seq == last_ + 1 ){
+            apply(seq, msg);
+            last_ = seq;
+            drain(apply);
+            return SequenceResult::APPLIED;
+        }
+
+        bool new_gap = pending_.empty();
+        pending_.emplace(seq, std::move(msg));
+        if( pending_.size() > max_pending_ ){
+            skip(apply);
+            return SequenceResult::SKIPPED;
+        }
+        return new_gap ? SequenceResult::GAP : SequenceResult::BUFFERED;
+    }
+
+    /// 放弃当前的缺口，应用缓存中下一段连续的消息。
+    /// \return 是否有缺口被放弃。
+    template<typename APPLY>
+    bool skip(APPLY apply){
+        if( pending_.empty() ){
+            return false;
+        }
+        last_ = pending_.begin()->first - 1;
+        drain(apply);
+        return true;
+    }
+
+    /// 当前缺失的第一个区间。
+    /// \return 是否存在缺口。
+    bool missing(range* r) const{
+        if( pending_.empty() ){
+            return false;
+        }
+        r->first = last_ + 1;
+        r->last = pending_.begin()->first - 1;
+        return true;
+    }
+
+    /// 是否收到过消息。没有收到过时，last()没有意义，应当全量订阅。
+    bool started() const{
+        return started_;
+    }
+
+    /// 已经应用的最大序号。
+    uint64_t last() const{
+        return last_;
+    }
+
+    /// 缓存的消息个数。
+    size_t pending() const{
+        return pending_.size();
+    }
+
+    /// 清空状态，之后的第一个消息作为新的起点。用于服务端序号重置（如日切）。
+    void reset(){
+        pending_.clear();
+        started_ = false;
+        last_ = 0;
+    }
+
+private:
+    /// 应用缓存中紧接着last_的连续消息。
+    template<typename APPLY>
+    void drain(APPLY& apply){
+        auto it = pending_.begin();
+        while( it != pending_.end() && it->first == last_ + 1 ){
+            apply(it->first, it->second);
+            last_ = it->first;
+            it = pending_.erase(it);
+        }
+    }
+
+    size_t max_pending_;
+    bool started_;
+    uint64_t last_;
+    std::map<uint64_t, T> pending_;
+};
+
+#endif //QUOTE_SERVER_SEQUENCE_TRACKER_H
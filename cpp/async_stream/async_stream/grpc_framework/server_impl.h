@@ -0,0 +1,239 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_SERVER_IMPL_H
+#define QUOTE_SERVER_SERVER_IMPL_H
+
+#include "tag_base.h"
+#include "tag_registry.h"
+#include "cq_stats.h"
+
+#include <grpc++/grpc++.h>
+#include <grpc++/generic/async_generic_service.h>
+#include <grpc/support/log.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using grpc::Server;
+using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
+using grpc::ServerCredentials;
+using grpc::ServerContext;
+
+/// 不同类型服务的注册方式和调用上下文。
+/// \tparam SERVICE 生成代码中的XXX::AsyncService。
+template<typename SERVICE>
+struct server_traits{
+    typedef ServerContext context_t;
+    static void register_service(ServerBuilder& builder, SERVICE* service){
+        builder.RegisterService(service);
+    }
+};
+
+/// grpc::AsyncGenericService读写的是grpc::ByteBuffer，参见client_generic_bi_stream_rpc。
+template<>
+struct server_traits<grpc::AsyncGenericService>{
+    typedef grpc::GenericServerContext context_t;
+    static void register_service(ServerBuilder& builder, grpc::AsyncGenericService* service){
+        builder.RegisterAsyncGenericService(service);
+    }
+};
+
+/// 服务端的RPC调用，由server_impl::post()投递。参见server_stream_rpc。
+class server_rpc_base : public rpc_base{
+public:
+    virtual ~server_rpc_base() {}
+
+    /// 需要注册的所有tag_base，包括调用自身和它的reader、writer。
+    virtual std::vector<tag_base*> tags() = 0;
+
+    /// 向完成队列投递接受调用的请求。调用前，tags()已经注册。
+    /// \param cq 接受调用和处理该调用的所有事件的完成队列。
+    virtual void request(ServerCompletionQueue* cq) = 0;
+};
+
+/// 对gRPC服务端的抽象基类。采用异步模式来处理请求。
+/// \li 服务端有多个ServerCompletionQueue，每个队列有多个工作线程（参见srv()）。
+/// \li 子类在on_run()中，用post()在每个完成队列上预先投递若干个调用。
+///     调用被接受时，会立即在同一个队列上投递一个新的调用（参见server_stream_rpc），所以接受新的连接时不需要等待。
+/// \tparam SERVICE 异步服务的类型，如XXX::AsyncService或grpc::AsyncGenericService。
+template<typename SERVICE>
+class server_impl{
+public:
+    typedef server_impl<SERVICE> this_type;
+
+    server_impl(): cq_count_(1), threads_per_cq_(1), next_cq_(0), calls_(0){
+    }
+
+    /// 获得监听端口用的ServerCredentials。默认使用grpc::InsecureServerCredentials。
+    virtual std::shared_ptr<ServerCredentials> get_credental(){
+        return grpc::InsecureServerCredentials();
+    }
+
+    /// 创建服务前的回调函数。子类可以在这里设置ServerBuilder的其他选项。
+    virtual void on_build(ServerBuilder& builder) {};
+
+    /// 注册tag_base, 服务端只处理注册过的tag_base，参考srv()函数。可以在任意线程中调用。
+    /// \param tags 需要注册的tag_base的集合。
+    void add_tag(std::vector<tag_base*> tags){
+        for( auto tag : tags ){
+            tags_.add(tag);
+        }
+    }
+
+    /// 注销tag_base, 注销后，不再处理这些tag_base，参考srv()函数。
+    /// \param tags 需要注销的tag_base的集合。
+    void remove_tag(std::vector<tag_base*> tags){
+        for( auto tag : tags ){
+            tags_.remove(tag);
+        }
+    }
+
+    /// 启动服务端
+    /// \param address 监听的地址(ip and port)
+    /// \return 是否启动成功。
+    bool run(std::string address){
+        return run(address, 1, 1);
+    }
+
+    /// 启动服务端，使用多个完成队列和多个工作线程。
+    /// 每个调用在投递时分配到一个完成队列，之后它的所有事件都在该队列上处理。
+    /// \param address 监听的地址(ip and port)
+    /// \param cq_count 完成队列的个数，至少为1。
+    /// \param threads_per_cq 每个完成队列的工作线程数，至少为1。
+    /// \return 是否启动成功。
+    bool run(std::string address, size_t cq_count, size_t threads_per_cq){
+        cq_count_ = std::max<size_t>(cq_count, 1);
+        threads_per_cq_ = std::max<size_t>(threads_per_cq, 1);
+
+        ServerBuilder builder;
+        builder.AddListeningPort(address, get_credental());
+        server_traits<SERVICE>::register_service(builder, &service_);
+        for( size_t i = 0; i < cq_count_; ++i ){
+            cqs_.emplace_back(builder.AddCompletionQueue());
+        }
+        on_build(builder);
+        server_ = builder.BuildAndStart();
+        if( !server_ ){
+            gpr_log(GPR_ERROR, "failed to start server on %s", address.c_str());
+            cqs_.clear();
+            return false;
+        }
+        gpr_log(GPR_INFO, "server listening on %s", address.c_str());
+
+        on_run();
+
+        for( auto& cq : cqs_ ){
+            for( size_t i = 0; i < threads_per_cq_; ++i ){
+                workers_.emplace_back(&this_type::srv, this, cq.get());
+            }
+        }
+        return true;
+    }
+
+    /// 服务端启动的回调函数。子类在这里投递调用，参见post()。
+    virtual void on_run() {};
+
+    /// 退出服务端。关闭服务后，所有调用以ok等于false结束并释放，然后关闭完成队列，等待工作线程退出。
+    /// 调用在释放之前仍可能发起操作（如Finish），所以等所有调用都释放后才关闭完成队列。
+    /// \param grace_ms 等待进行中的调用结束的时间，超时后取消这些调用。
+    void exit(int grace_ms = 1000){
+        if( !server_ ){
+            return;
+        }
+        server_->Shutdown(std::chrono::system_clock::now() + std::chrono::milliseconds(grace_ms));
+        while( calls_.load() > 0 ){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for( auto& cq : cqs_ ){
+            cq->Shutdown();
+        }
+        for( auto& worker : workers_ ){
+            worker.join();
+        }
+        workers_.clear();
+        on_exit();
+        server_.reset();
+        cqs_.clear();
+    }
+
+    /// 服务端退出的回调函数。
+    virtual void on_exit() {};
+
+    /// 投递一个调用：注册它的tag，然后请求接受调用。
+    /// \param rpc 新建的调用，接受失败或者调用结束后，由它自己释放。
+    /// \param cq 完成队列，参见cq()。
+    void post(server_rpc_base* rpc, ServerCompletionQueue* cq){
+        calls_.fetch_add(1);
+        add_tag(rpc->tags());
+        rpc->request(cq);
+    }
+
+    /// 注销调用的tag。调用释放自己之前调用，参见post()。
+    void release(server_rpc_base* rpc){
+        remove_tag(rpc->tags());
+        calls_.fetch_sub(1);
+    }
+
+    /// 在每个完成队列上预先投递count个调用。
+    /// \param count 每个完成队列上的调用个数，即每个队列可以同时等待接受的调用个数。
+    /// \param create 新建调用的函数，返回server_rpc_base*。
+    template<typename CREATE>
+    void post(size_t count, CREATE create){
+        for( auto& cq : cqs_ ){
+            for( size_t i = 0; i < count; ++i ){
+                post(create(), cq.get());
+            }
+        }
+    }
+
+    /// 获得服务。
+    SERVICE* service(){
+        return &service_;
+    }
+
+    /// 多个完成队列之间轮流分配。
+    ServerCompletionQueue* cq(){
+        size_t index = next_cq_.fetch_add(1, std::memory_order_relaxed);
+        return cqs_[index % cqs_.size()].get();
+    }
+
+    /// 获得指定序号的完成队列。
+    /// \param index 完成队列的序号，范围是[0, cq_count())
+    ServerCompletionQueue* cq(size_t index){
+        return cqs_[index].get();
+    }
+
+    /// 完成队列的个数。
+    size_t cq_count() const{
+        return cq_count_;
+    }
+
+protected:
+    /// 工作线程的主循环，处理完成队列cq上的事件，直到cq被关闭。
+    /// \param cq 完成队列
+    void srv(ServerCompletionQueue* cq){
+        dispatch_cq(cq, tags_);
+    }
+
+protected:
+    SERVICE service_;
+    std::unique_ptr<Server> server_;
+
+    std::vector<std::unique_ptr<ServerCompletionQueue>> cqs_;
+    size_t cq_count_;
+    size_t threads_per_cq_;
+    std::atomic<size_t> next_cq_;
+    std::vector<std::thread> workers_;
+    std::atomic<long> calls_;       // 已投递、尚未释放的调用个数
+
+    tag_registry tags_;
+};
+
+#endif //QUOTE_SERVER_SERVER_IMPL_H
@@ -0,0 +1,350 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_SERVER_RPC_H
+#define QUOTE_SERVER_SERVER_RPC_H
+
+#include "server_impl.h"
+#include "tag_base.h"
+#include "rpc_reader.h"
+#include "rpc_writer.h"
+
+#include <grpc++/grpc++.h>
+
+#include <atomic>
+using namespace grpc;
+
+enum class ServerRPCStatus { CREATE, WORKING, FINISH };
+
+/// 服务端调用的引用计数接口。未完成的异步操作各持有一个引用，最后一个引用释放时调用结束。
+class server_call_ref{
+public:
+    virtual void ref() = 0;
+    virtual void unref() = 0;
+};
+
+/// 异步流的代理。reader、writer通过它发起操作，每个操作增加一次调用的引用计数。
+/// \tparam STREAM ServerAsyncWriter<W>或ServerAsyncReaderWriter<W,R>
+template<typename STREAM>
+class counted_stream{
+public:
+    counted_stream(STREAM& stream, server_call_ref* call): stream_(stream), call_(*call) {}
+
+    template<typename R>
+    void Read(R* msg, void* tag){
+        call_.ref();
+        stream_.Read(msg, tag);
+    }
+
+    template<typename W>
+    void Write(const W& msg, void* tag){
+        call_.ref();
+        stream_.Write(msg, tag);
+    }
+
+    void Finish(const grpc::Status& status, void* tag){
+        call_.ref();
+        stream_.Finish(status, tag);
+    }
+
+private:
+    STREAM& stream_;
+    server_call_ref& call_;
+};
+
+/// 处理完一次事件后释放该事件对应的引用。用于包装reader和writer。
+/// \tparam BASE reader<R, counted_stream<...>>或writer<W, counted_stream<...>>
+template<typename BASE>
+class counted_tag : public BASE{
+public:
+    template<typename CB, typename STREAM>
+    counted_tag(server_call_ref* call, CB* cb, STREAM& stream): BASE(cb, stream), call_(*call) {}
+
+    virtual void process() override{
+        server_call_ref& call = call_;
+        BASE::process();
+        call.unref();
+    }
+
+    virtual void on_error() override{
+        server_call_ref& call = call_;
+        BASE::on_error();
+        call.unref();
+    }
+
+private:
+    server_call_ref& call_;
+};
+
+/// 服务端流式RPC的基类，管理调用的生命周期。
+/// \li 投递后等待客户端发起调用，接受后立即通过create()投递一个新的调用，然后回调on_accept()。
+/// \li 调用结束（服务端Finish完成或者客户端取消）时，回调on_done()。
+/// \li on_done()之后，等所有未完成的读写操作都返回，注销全部tag并释放自己。子类不需要delete。
+/// \tparam SERVICE 异步服务的类型。
+template<typename SERVICE>
+class server_stream_rpc
+        : public server_rpc_base
+        , public server_call_ref{
+public:
+    typedef server_impl<SERVICE> server_t;
+
+    server_stream_rpc(server_t* server)
+            : server_(server), cq_(nullptr), refs_(1), done_(this){
+        status = ServerRPCStatus::CREATE;
+    }
+
+    /// 继承自server_rpc_base。
+    virtual std::vector<tag_base*> tags() override{
+        return {this, &done_};
+    }
+
+    /// 继承自server_rpc_base。
+    virtual void request(ServerCompletionQueue* cq) override{
+        cq_ = cq;
+        context.AsyncNotifyWhenDone(done_.tag());
+        request_call(cq);
+    }
+
+    /// 继承自tag_base。处理接受调用和Finish完成的事件。
+    virtual void process() override{
+        if( status == ServerRPCStatus::CREATE ){
+            status = ServerRPCStatus::WORKING;
+            // 调用开始后done_一定会返回
+            ref();
+            server_->post(create(), cq_);
+            on_accept();
+        }
+        unref();
+    }
+
+    /// 继承自tag_base。接受调用失败（服务端关闭）或者Finish失败。
+    virtual void on_error() override{
+        status = ServerRPCStatus::FINISH;
+        unref();
+    }
+
+    /// 继承自server_call_ref。
+    virtual void ref() override{
+        refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// 继承自server_call_ref。
+    virtual void unref() override{
+        if( refs_.fetch_sub(1, std::memory_order_acq_rel) == 1 ){
+            server_->release(this);
+            delete this;
+        }
+    }
+
+protected:
+    /// 请求接受调用，通常为service->RequestXXX(&context, ..., cq, cq, tag())。
+    virtual void request_call(ServerCompletionQueue* cq) = 0;
+
+    /// 新建一个同类的调用，用来在接受本调用后补充投递。
+    virtual server_rpc_base* create() = 0;
+
+    /// 调用被接受。子类在这里开始读写。
+    virtual void on_accept() = 0;
+
+    /// 调用结束。context.IsCancelled()表示是否被客户端取消。
+    virtual void on_done() {};
+
+    typename server_traits<SERVICE>::context_t context;
+    ServerRPCStatus status;
+    server_t* server_;
+    ServerCompletionQueue* cq_;
+
+private:
+    /// AsyncNotifyWhenDone的tag。
+    class done_tag : public tag_base{
+    public:
+        done_tag(server_stream_rpc* call): call_(*call) {}
+
+        virtual void process() override{
+            server_stream_rpc& call = call_;
+            call.on_done();
+            call.unref();
+        }
+
+        virtual void on_error() override{
+            process();
+        }
+
+    private:
+        server_stream_rpc& call_;
+    };
+
+    std::atomic<long> refs_;   // 接受前为1（等待接受），之后每个未完成的操作和done_各持有1个
+    done_tag done_;
+};
+
+/// 对[Server streaming RPC](https://grpc.io/docs/guides/concepts.html#server-streaming-rpc)的服务端异步抽象封装。
+/// 具体实现步骤如下：
+/// \li 子类实现request_call()，调用service->RequestXXX(&context, &request, &responder, cq, cq, tag())。
+/// \li 子类实现create()，返回一个新的同类调用。
+/// \li 在on_accept()中根据request开始写出，需要结束时调用finish()。
+/// \tparam SERVICE 异步服务的类型。
+/// \tparam R 读取的请求的类型。
+/// \tparam W 写出的数据类型。
+template<typename SERVICE, typename R, typename W>
+class server_uni_stream_rpc
+        : public server_stream_rpc<SERVICE>
+        , public writer_callback{
+public:
+    typedef server_stream_rpc<SERVICE> super;
+    typedef ServerAsyncWriter<W> responder_t;
+    typedef counted_stream<responder_t> stream_t;
+    typedef counted_tag<writer<W, stream_t>> writer_t;
+
+    server_uni_stream_rpc(typename super::server_t* server)
+            : super(server)
+            , responder(&this->context)
+            , stream_(responder, this)
+            , writer_(new writer_t(this, this, stream_)){
+    }
+
+    /// 继承自server_rpc_base。
+    virtual std::vector<tag_base*> tags() override{
+        std::vector<tag_base*> all = super::tags();
+        all.push_back(writer_.get());
+        return all;
+    }
+
+    /// 写出数据，参见writer::write()。
+    int write(const W& w){
+        return writer_->write(w);
+    }
+
+    /// 发送队列满时最多等待timeout_ms毫秒，参见writer::write(const W&, int)。
+    int write(const W& w, int timeout_ms){
+        return writer_->write(w, timeout_ms);
+    }
+
+    /// 写出数据到指定优先级的lane，参见writer::set_lanes()。
+    int write_lane(const W& w, size_t lane){
+        return writer_->write_lane(w, lane);
+    }
+
+    /// 结束调用，参见writer::finish()。发送队列中的数据全部写出后才发出Finish，之后的write()返回-1。
+    void finish(const grpc::Status& status){
+        this->status = ServerRPCStatus::FINISH;
+        writer_->finish(status, this->tag());
+    }
+
+    /// 继承自writer_callback。
+    virtual void on_write(int write_id) override {};
+
+    /// 继承自writer_callback。客户端断开，之后会回调on_done()。
+    virtual void on_write_error() override {};
+
+protected:
+    /// 继承自server_stream_rpc。默认启动writer。
+    virtual void on_accept() override{
+        writer_->start();
+    }
+
+    /// 继承自server_stream_rpc。停止writer，丢弃未发送的数据。
+    virtual void on_done() override{
+        writer_->stop();
+    }
+
+    R request;
+    responder_t responder;
+    stream_t stream_;
+    std::unique_ptr<writer_t> writer_;
+};
+
+/// 对[Bidirectional streaming RPC](https://grpc.io/docs/guides/concepts.html#bidirectional-streaming-rpc)的服务端异步抽象封装。
+/// 具体实现步骤如下：
+/// \li 子类实现request_call()，调用service->RequestXXX(&context, &responder, cq, cq, tag())。
+/// \li 子类实现create()，返回一个新的同类调用。
+/// \li 默认在接受后开始读写，子类实现on_read()处理读取到的数据；客户端结束写（读取失败）后，调用finish()。
+/// \tparam SERVICE 异步服务的类型。
+/// \tparam R 读取的数据类型。
+/// \tparam W 写出的数据类型。
+template<typename SERVICE, typename R, typename W>
+class server_bi_stream_rpc
+        : public server_stream_rpc<SERVICE>
+        , public reader_callback
+        , public writer_callback{
+public:
+    typedef server_stream_rpc<SERVICE> super;
+    typedef ServerAsyncReaderWriter<W, R> responder_t;
+    typedef counted_stream<responder_t> stream_t;
+    typedef counted_tag<reader<R, stream_t>> reader_t;
+    typedef counted_tag<writer<W, stream_t>> writer_t;
+
+    server_bi_stream_rpc(typename super::server_t* server)
+            : super(server)
+            , responder(&this->context)
+            , stream_(responder, this)
+            , reader_(new reader_t(this, this, stream_))
+            , writer_(new writer_t(this, this, stream_)){
+    }
+
+    /// 继承自server_rpc_base。
+    virtual std::vector<tag_base*> tags() override{
+        std::vector<tag_base*> all = super::tags();
+        all.push_back(reader_.get());
+        all.push_back(writer_.get());
+        return all;
+    }
+
+    /// 写出数据，参见writer::write()。
+    int write(const W& w){
+        return writer_->write(w);
+    }
+
+    /// 发送队列满时最多等待timeout_ms毫秒，参见writer::write(const W&, int)。
+    int write(const W& w, int timeout_ms){
+        return writer_->write(w, timeout_ms);
+    }
+
+    /// 写出数据到指定优先级的lane，参见writer::set_lanes()。
+    int write_lane(const W& w, size_t lane){
+        return writer_->write_lane(w, lane);
+    }
+
+    /// 结束调用，参见writer::finish()。发送队列中的数据全部写出后才发出Finish，之后的write()返回-1。
+    void finish(const grpc::Status& status){
+        this->status = ServerRPCStatus::FINISH;
+        writer_->finish(status, this->tag());
+    }
+
+    /// 继承自reader_callback。读事件回调。
+    /// \param req_ptr 读取到的数据的地址。
+    virtual void on_read(void* req_ptr) override = 0;
+
+    /// 继承自reader_callback。客户端结束写或者断开。默认以OK结束调用，已经入队的数据写出后才发出Finish。
+    virtual void on_read_error() override{
+        if( this->status == ServerRPCStatus::WORKING ){
+            finish(grpc::Status::OK);
+        }
+    };
+
+    /// 继承自writer_callback。
+    virtual void on_write(int write_id) override {};
+
+    /// 继承自writer_callback。客户端断开，之后会回调on_done()。
+    virtual void on_write_error() override {};
+
+protected:
+    /// 继承自server_stream_rpc。默认启动writer并开始读取。
+    virtual void on_accept() override{
+        writer_->start();
+        reader_->read();
+    }
+
+    /// 继承自server_stream_rpc。停止writer，丢弃未发送的数据。
+    virtual void on_done() override{
+        writer_->stop();
+    }
+
+    responder_t responder;
+    stream_t stream_;
+    std::unique_ptr<reader_t> reader_;
+    std::unique_ptr<writer_t> writer_;
+};
+
+#endif //QUOTE_SERVER_SERVER_RPC_H
@@ -0,0 +1,422 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_SHM_RING_H
+#define QUOTE_SERVER_SHM_RING_H
+
+#if defined(__linux__)
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// 共享内存中的环形缓冲区，同一台机器上一个进程写、多个进程读（参见shm_ring_writer和shm_ring_reader）。
+/// \li 共享内存用shm_open创建（即/dev/shm下的文件，和memfd一样在tmpfs中），读者按名字打开，映射后读写都不再有系统调用。
+/// \li 每个槽位是一个seqlock：写者写数据前后各更新一次槽位的序号，读者直接在共享内存上解析，解析后序号不变才算读到，
+///     否则说明读的过程中被覆盖了（读者落后了一圈），跳到最早的有效数据。写者从不等待读者。
+/// \li 读者在头部的读者表中登记，并更新自己读到的位置，写者可以看到每个读者的延迟。
+/// 布局：shm_ring_header，然后是slot_count个槽位，每个槽位slot_size字节（shm_ring_slot和数据）。
+/// 链接时可能需要-lrt（glibc 2.17之前）。
+struct shm_ring_slot{
+    std::atomic<uint64_t> seq;  // 2 * 消息序号 + 1：正在写；2 * 消息序号 + 2：已写完
+    uint32_t length;
+    uint32_t reserved;
+};
+
+struct shm_ring_reader_entry{
+    std::atomic<int64_t> pid;           // 读者进程，0表示空闲
+    std::atomic<uint64_t> read_seq;     // 下一个要读的消息序号
+    std::atomic<uint64_t> lost;         // 被覆盖而没有读到的消息个数
+    char name[40];
+};
+
+struct shm_ring_header{
+    static const uint64_t magic_value = 0x474e495251485351ULL;     // "QSHQRING"
+    static const uint32_t version_value = 1;
+    static const size_t max_readers = 64;
+
+    std::atomic<uint64_t> magic;        // 最后写入，读者看到它时其他字段都已经初始化
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t slot_count;
+    alignas(64) std::atomic<uint64_t> write_seq;    // 下一个要写的消息序号
+    alignas(64) shm_ring_reader_entry readers[max_readers];
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shm_ring needs address-free 64-bit atomics");
+
+/// 共享内存的映射，shm_ring_writer和shm_ring_reader共用。
+class shm_ring_mapping{
+public:
+    shm_ring_mapping(): header_(nullptr), size_(0) {}
+
+    ~shm_ring_mapping(){
+        unmap();
+    }
+
+    shm_ring_mapping(const shm_ring_mapping&) = delete;
+    shm_ring_mapping& operator=(const shm_ring_mapping&) = delete;
+
+    shm_ring_header* header() const{
+        return header_;
+    }
+
+    shm_ring_slot* slot(uint64_t seq) const{
+        char* base = reinterpret_cast<char*>(header_) + sizeof(shm_ring_header);
+        return reinterpret_cast<shm_ring_slot*>(base + (seq % header_->slot_count) * header_->slot_size);
+    }
+
+    char* data(shm_ring_slot* s) const{
+        return reinterpret_cast<char*>(s) + sizeof(shm_ring_slot);
+    }
+
+    /// 每个槽位可以存放的最大字节数。
+    size_t capacity() const{
+        return header_->slot_size - sizeof(shm_ring_slot);
+    }
+
+    /// 共享内存的总大小。
+    static size_t total_size(uint32_t slot_size, uint64_t slot_count){
+        return sizeof(shm_ring_header) + static_cast<size_t>(slot_size) * slot_count;
+    }
+
+    /// 映射已经打开的共享内存。
+    bool map(int fd, size_t size){
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if( addr == MAP_FAILED ){
+            return false;
+        }
+        header_ = static_cast<shm_ring_header*>(addr);
+        size_ = size;
+        return true;
+    }
+
+    void unmap(){
+        if( header_ ){
+            munmap(header_, size_);
+            header_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+private:
+    shm_ring_header* header_;
+    size_t size_;
+};
+
+/// 共享内存环形缓冲区的写者。只能有一个进程、一个线程写。
+class shm_ring_writer{
+public:
+    /// 读者的状态，参见readers()。
+    struct reader_info{
+        int64_t pid;
+        std::string name;
+        uint64_t read_seq;
+        uint64_t lag;       // 还没有读的消息个数
+        uint64_t lost;
+        bool alive;         // 读者进程是否还在，退出时没有close()的读者的位置会保留到被重用
+    };
+
+    shm_ring_writer(): write_seq_(0), oversize_(0) {}
+
+    /// 创建或者打开共享内存。已经存在且布局相同时沿用（写者重启后，读者可以继续读），否则重新初始化。
+    /// \param name 共享内存的名字，如"/transcode_quote"。
+    /// \param slot_size 每个槽位的字节数，单个消息不能超过slot_size - sizeof(shm_ring_slot)。
+    /// \param slot_count 槽位个数，即读者最多可以落后的消息个数。
+    /// \return 是否成功。
+    bool open(const std::string& name, uint32_t slot_size = 16 * 1024, uint64_t slot_count = 1024){
+        slot_size = (std::max<uint32_t>(slot_size, sizeof(shm_ring_slot) + 64) + 63) / 64 * 64;
+        size_t size = shm_ring_mapping::total_size(slot_size, slot_count);
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+        if( fd < 0 ){
+            return false;
+        }
+        struct stat st;
+        bool reuse = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == size;
+        if( !reuse && ftruncate(fd, size) != 0 ){
+            ::close(fd);
+            return false;
+        }
+        bool mapped = mapping_.map(fd, size);
+        ::close(fd);
+        if( !mapped ){
+            return false;
+        }
+
+        shm_ring_header* h = mapping_.header();
+        reuse = reuse && h->magic.load(std::memory_order_acquire) == shm_ring_header::magic_value
+                && h->version == shm_ring_header::version_value
+                && h->slot_size == slot_size && h->slot_count == slot_count;
+        if( reuse ){
+            write_seq_ = h->write_seq.load(std::memory_order_relaxed);
+            return true;
+        }
+
+        std::memset(static_cast<void*>(h), 0, size);
+        h->version = shm_ring_header::version_value;
+        h->slot_size = slot_size;
+        h->slot_count = slot_count;
+        write_seq_ = 0;
+        h->magic.store(shm_ring_header::magic_value, std::memory_order_release);
+        return true;
+    }
+
+    /// 解除映射。共享内存保留，读者可以读完剩余的消息；需要删除时调用shm_unlink()。
+    void close(){
+        mapping_.unmap();
+    }
+
+    bool is_open() const{
+        return mapping_.header() != nullptr;
+    }
+
+    /// 写入一个protobuf消息，直接序列化到共享内存中。
+    /// \return 消息超过槽位大小时返回false。
+    template<typename MSG>
+    bool publish(const MSG& msg){
+        size_t length = msg.ByteSizeLong();
+        return write(length, [&msg](char* data){
+            msg.SerializeWithCachedSizesToArray(reinterpret_cast<uint8_t*>(data));
+        });
+    }
+
+    /// 写入length字节，由fill填充数据。
+    /// \param fill 参数为char*，须正好写入length字节。
+    /// \return 超过槽位大小时返回false。
+    template<typename FILL>
+    bool write(size_t length, FILL fill){
+        if( !is_open() ){
+            return false;
+        }
+        if( length > mapping_.capacity() ){
+            ++oversize_;
+            return false;
+        }
+        shm_ring_slot* s = mapping_.slot(write_seq_);
+        s->seq.store(2 * write_seq_ + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        fill(mapping_.data(s));
+        s->length = static_cast<uint32_t>(length);
+        s->seq.store(2 * write_seq_ + 2, std::memory_order_release);
+        ++write_seq_;
+        mapping_.header()->write_seq.store(write_seq_, std::memory_order_release);
+        return true;
+    }
+
+    /// 已经写入的消息个数。
+    uint64_t write_seq() const{
+        return write_seq_;
+    }
+
+    /// 因为超过槽位大小而没有写入的消息个数。
+    uint64_t oversize() const{
+        return oversize_;
+    }
+
+    /// 当前登记的读者。可以在写者以外的线程中调用。
+    std::vector<reader_info> readers() const{
+        std::vector<reader_info> result;
+        if( !is_open() ){
+            return result;
+        }
+        shm_ring_header* h = mapping_.header();
+        uint64_t write_seq = h->write_seq.load(std::memory_order_acquire);
+        for( size_t i = 0; i < shm_ring_header::max_readers; ++i ){
+            shm_ring_reader_entry& e = h->readers[i];
+            int64_t pid = e.pid.load(std::memory_order_acquire);
+            if( pid == 0 ){
+                continue;
+            }
+            reader_info info;
+            info.pid = pid;
+            info.name.assign(e.name, strnlen(e.name, sizeof(e.name)));
+            info.read_seq = e.read_seq.load(std::memory_order_relaxed);
+            info.lag = write_seq > info.read_seq ? write_seq - info.read_seq : 0;
+            info.lost = e.lost.load(std::memory_order_relaxed);
+            info.alive = kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH;
+            result.push_back(info);
+        }
+        return result;
+    }
+
+private:
+    shm_ring_mapping mapping_;
+    uint64_t write_seq_;
+    uint64_t oversize_;
+};
+
+/// 共享内存环形缓冲区的读者。每个读者只在一个线程中使用。
+/// 读者从打开时最新的位置开始读，落后超过一圈时丢失被覆盖的消息（参见lost()）。
+class shm_ring_reader{
+public:
+    shm_ring_reader(): entry_(nullptr), next_seq_(0), lost_(0) {}
+
+    ~shm_ring_reader(){
+        close();
+    }
+
+    /// 打开写者创建的共享内存，并在读者表中登记。
+    /// \param name 共享内存的名字，和shm_ring_writer::open()相同。
+    /// \param reader_name 读者的名字，写者在readers()中可以看到，最多39个字符。
+    /// \return 共享内存不存在、还没有初始化或者读者表已满时返回false。
+    bool open(const std::string& name, const std::string& reader_name = ""){
+        close();
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if( fd < 0 ){
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) > sizeof(shm_ring_header)
+                  && mapping_.map(fd, st.st_size);
+        ::close(fd);
+        if( !ok ){
+            return false;
+        }
+        shm_ring_header* h = mapping_.header();
+        if( h->magic.load(std::memory_order_acquire) != shm_ring_header::magic_value
+            || h->version != shm_ring_header::version_value
+            || shm_ring_mapping::total_size(h->slot_size, h->slot_count) != static_cast<size_t>(st.st_size) ){
+            mapping_.unmap();
+            return false;
+        }
+        if( !attach(reader_name) ){
+            mapping_.unmap();
+            return false;
+        }
+        return true;
+    }
+
+    /// 注销并解除映射。
+    void close(){
+        if( entry_ ){
+            entry_->pid.store(0, std::memory_order_release);
+            entry_ = nullptr;
+        }
+        mapping_.unmap();
+    }
+
+    bool is_open() const{
+        return mapping_.header() != nullptr;
+    }
+
+    /// 读取下一个protobuf消息，直接从共享内存解析，不复制。
+    /// \return 没有新消息时返回false。
+    template<typename MSG>
+    bool next(MSG* msg){
+        return next([msg](const char* data, size_t length){
+            return msg->ParseFromArray(data, static_cast<int>(length));
+        });
+    }
+
+    /// 读取下一个消息。
+    /// \param parse 参数为(const char* data, size_t length)，返回是否解析成功。
+    ///        数据可能在解析过程中被写者覆盖，parse须能处理任意内容；覆盖时结果被丢弃，读取更新的消息。
+    /// \return 没有新消息时返回false。
+    template<typename PARSE>
+    bool next(PARSE parse){
+        if( !is_open() ){
+            return false;
+        }
+        shm_ring_header* h = mapping_.header();
+        while( true ){
+            uint64_t write_seq = h->write_seq.load(std::memory_order_acquire);
+            if( next_seq_ >= write_seq ){
+                return false;
+            }
+            if( write_seq - next_seq_ > h->slot_count ){
+                skip_to(write_seq - h->slot_count);
+            }
+
+            shm_ring_slot* s = mapping_.slot(next_seq_);
+            uint64_t expected = 2 * next_seq_ + 2;
+            uint64_t before = s->seq.load(std::memory_order_acquire);
+            if( before != expected ){
+                // 已经被覆盖，重新计算最早的有效位置
+                skip_to(next_seq_ + 1);
+                continue;
+            }
+            size_t length = std::min<size_t>(s->length, mapping_.capacity());
+            bool parsed = parse(static_cast<const char*>(mapping_.data(s)), length);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if( s->seq.load(std::memory_order_relaxed) != before ){
+                skip_to(next_seq_ + 1);
+                continue;
+            }
+            advance(next_seq_ + 1);
+            if( parsed ){
+                return true;
+            }
+        }
+    }
+
+    /// 写者已经写入、本读者还没有读的消息个数。
+    uint64_t lag() const{
+        if( !is_open() ){
+            return 0;
+        }
+        uint64_t write_seq = mapping_.header()->write_seq.load(std::memory_order_acquire);
+        return write_seq > next_seq_ ? write_seq - next_seq_ : 0;
+    }
+
+    /// 被覆盖而没有读到的消息个数。
+    uint64_t lost() const{
+        return lost_;
+    }
+
+private:
+    /// 在读者表中占一个位置，从最新的消息开始读。进程已经退出的读者的位置可以被重用。
+    bool attach(const std::string& reader_name){
+        shm_ring_header* h = mapping_.header();
+        int64_t pid = getpid();
+        for( size_t i = 0; i < shm_ring_header::max_readers; ++i ){
+            shm_ring_reader_entry& e = h->readers[i];
+            int64_t owner = e.pid.load(std::memory_order_acquire);
+            bool stale = owner != 0 && kill(static_cast<pid_t>(owner), 0) != 0 && errno == ESRCH;
+            if( (owner == 0 || stale) && e.pid.compare_exchange_strong(owner, pid) ){
+                entry_ = &e;
+                std::memset(e.name, 0, sizeof(e.name));
+                std::strncpy(e.name, reader_name.c_str(), sizeof(e.name) - 1);
+                e.lost.store(0, std::memory_order_relaxed);
+                lost_ = 0;
+                advance(h->write_seq.load(std::memory_order_acquire));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// 跳过被覆盖的消息。
+    void skip_to(uint64_t seq){
+        uint64_t write_seq = mapping_.header()->write_seq.load(std::memory_order_acquire);
+        uint64_t oldest = write_seq > mapping_.header()->slot_count ? write_seq - mapping_.header()->slot_count : 0;
+        seq = std::max(seq, oldest);
+        lost_ += seq - next_seq_;
+        entry_->lost.store(lost_, std::memory_order_relaxed);
+        advance(seq);
+    }
+
+    void advance(uint64_t seq){
+        next_seq_ = seq;
+        entry_->read_seq.store(seq, std::memory_order_relaxed);
+    }
+
+    shm_ring_mapping mapping_;
+    shm_ring_reader_entry* entry_;
+    uint64_t next_seq_;
+    uint64_t lost_;
+};
+
+#endif // __linux__
+
+#endif //QUOTE_SERVER_SHM_RING_H
@@ -5,10 +5,39 @@
 #ifndef QUOTE_SERVER_TAG_BASE_H
 #define QUOTE_SERVER_TAG_BASE_H
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/// 是否统计完成队列事件的处理时间，参见cq_stats。统计会给每次tag()和每批事件增加开销，默认关闭，需要时定义为1。
+#ifndef CQ_STATS
+#define CQ_STATS 0
+#endif
+
 /// 此框架将gPRC异步操作event's tag封装成一个类，tag_base是这些类的基类。
 /// 关于even's tag，请参考grpc::CompletionQueue::Next。
 class tag_base{
+    friend class tag_registry;
 public:
+    tag_base(): tag_(nullptr), issued_(0) {}
+
+    /// 发起异步操作时交给gRPC的event's tag。由tag_registry在注册时分配，未注册时为nullptr。
+    /// 统计开启时，同时记下发起操作的时间，参见cq_stats。
+    /// 参见tag_registry
+    void* tag() const {
+#if CQ_STATS
+        // 生产者线程和完成队列的线程都可能发起操作（如writer），所以用原子变量
+        issued_.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+#endif
+        return tag_;
+    }
+
+    /// 最近一次调用tag()的时间（steady_clock的纳秒数），未调用过时为0。
+    int64_t issued_ns() const {
+        return issued_.load(std::memory_order_relaxed);
+    }
+
     /// 事件处理函数。当从CompletetionQueue::Next中读取到正常的事件时，会调用此函数。
     /// 参见server_impl::srv或client_impl::srv
     virtual void process() = 0;
@@ -16,6 +45,10 @@ public:
     /// 错误处理函数。当从CompletetionQueue::Next中读取到异常的事件时，会调用此函数。
     /// 参见server_impl::srv或client_impl::srv
     virtual void on_error() = 0;
+
+private:
+    void* tag_;
+    mutable std::atomic<int64_t> issued_;
 };
 
 class rpc_base : public tag_base{
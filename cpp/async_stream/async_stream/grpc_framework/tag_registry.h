@@ -0,0 +1,164 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_TAG_REGISTRY_H
+#define QUOTE_SERVER_TAG_REGISTRY_H
+
+#include "tag_base.h"
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+
+/// tag_base的注册表。每个注册过的tag_base占用slab中的一个槽位，
+/// 交给gRPC的event's tag不再是对象地址，而是“槽位序号 + 世代号”编码成的句柄（见tag_base::tag()）。
+/// \li 查找只需按序号取槽位并比较句柄，是常数时间，不需要加锁。
+/// \li 注销后句柄立即失效，槽位再次分配时世代号加一，之后再收到旧句柄的事件会被直接丢弃。
+/// \li 注册和注销使用无锁的空闲链表，可以在多个线程中同时调用。
+/// 注意：注销和同一个tag的事件处理不能并发，通常在tag自己的process()中注销。
+class tag_registry{
+public:
+    typedef uintptr_t handle_t;
+
+    tag_registry(): free_head_(0), next_unused_(0){
+        for( size_t i = 0; i < max_chunks; ++i ){
+            chunks_[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~tag_registry(){
+        for( size_t i = 0; i < max_chunks; ++i ){
+            delete [] chunks_[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    tag_registry(const tag_registry&) = delete;
+    tag_registry& operator=(const tag_registry&) = delete;
+
+    /// 注册tag，并将分配到的句柄写入tag。
+    /// \param tag 需要注册的tag_base。
+    /// \return 分配到的句柄，即tag->tag()。
+    void* add(tag_base* tag){
+        size_t index = pop_free();
+        slot& s = at(index);
+
+        s.generation = (s.generation + 1) & generation_mask;
+        if( s.generation == 0 ){
+            s.generation = 1;
+        }
+        handle_t handle = (s.generation << index_bits) | index;
+
+        s.tag.store(tag, std::memory_order_relaxed);
+        s.handle.store(handle, std::memory_order_release);
+        tag->tag_ = reinterpret_cast<void*>(handle);
+        return tag->tag_;
+    }
+
+    /// 注销tag。注销后，tag之前的句柄失效。
+    /// \param tag 需要注销的tag_base。未注册的tag会被忽略。
+    void remove(tag_base* tag){
+        handle_t handle = reinterpret_cast<handle_t>(tag->tag_);
+        slot* s = lookup(handle);
+        if( s == nullptr || s->tag.load(std::memory_order_relaxed) != tag ){
+            return;
+        }
+
+        s->handle.store(0, std::memory_order_release);
+        s->tag.store(nullptr, std::memory_order_relaxed);
+        tag->tag_ = nullptr;
+        push_free(handle & index_mask);
+    }
+
+    /// 根据句柄查找tag。
+    /// \param got_tag 从CompletionQueue::Next得到的event's tag。
+    /// \return 对应的tag_base；如果句柄无效或已经注销，返回nullptr。
+    tag_base* find(void* got_tag) const{
+        const slot* s = lookup(reinterpret_cast<handle_t>(got_tag));
+        return s == nullptr ? nullptr : s->tag.load(std::memory_order_relaxed);
+    }
+
+private:
+    // 句柄的低半部分是槽位序号，高半部分是世代号
+    static const unsigned index_bits = sizeof(handle_t) * 4;
+    static const handle_t index_mask = (handle_t(1) << index_bits) - 1;
+    static const handle_t generation_mask = index_mask;
+
+    static const size_t chunk_size = 1024;
+    static const size_t max_slots = index_bits >= 20 ? (size_t(1) << 20) : (size_t(1) << index_bits);
+    static const size_t max_chunks = max_slots / chunk_size;
+
+    struct slot{
+        slot(): handle(0), generation(0), tag(nullptr), next_free(0) {}
+        std::atomic<handle_t> handle; // 当前有效的句柄，0表示空闲
+        handle_t generation;          // 只在add()中修改，由空闲链表保证可见性
+        std::atomic<tag_base*> tag;
+        std::atomic<uint32_t> next_free; // 空闲链表中下一个槽位的序号 + 1，0表示链表结束
+    };
+
+    slot& at(size_t index) const{
+        return chunks_[index / chunk_size].load(std::memory_order_acquire)[index % chunk_size];
+    }
+
+    slot* lookup(handle_t handle) const{
+        size_t index = handle & index_mask;
+        if( handle == 0 || index >= max_slots ){
+            return nullptr;
+        }
+        slot* chunk = chunks_[index / chunk_size].load(std::memory_order_acquire);
+        if( chunk == nullptr ){
+            return nullptr;
+        }
+        slot* s = &chunk[index % chunk_size];
+        if( s->handle.load(std::memory_order_acquire) != handle ){
+            return nullptr;
+        }
+        return s;
+    }
+
+    size_t pop_free(){
+        // free_head_：低32位是槽位序号 + 1，高32位是防ABA的计数
+        uint64_t head = free_head_.load(std::memory_order_acquire);
+        while( (head & 0xffffffffu) != 0 ){
+            size_t index = static_cast<size_t>(head & 0xffffffffu) - 1;
+            uint64_t next = at(index).next_free.load(std::memory_order_relaxed);
+            uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+            if( free_head_.compare_exchange_weak(head, new_head,
+                                                 std::memory_order_acq_rel, std::memory_order_acquire) ){
+                return index;
+            }
+        }
+
+        size_t index = next_unused_.fetch_add(1, std::memory_order_relaxed);
+        if( index >= max_slots ){
+            throw std::length_error("tag_registry is full");
+        }
+        std::atomic<slot*>& chunk = chunks_[index / chunk_size];
+        if( chunk.load(std::memory_order_acquire) == nullptr ){
+            slot* created = new slot[chunk_size];
+            slot* expected = nullptr;
+            if( !chunk.compare_exchange_strong(expected, created, std::memory_order_acq_rel) ){
+                delete [] created;
+            }
+        }
+        return index;
+    }
+
+    void push_free(size_t index){
+        slot& s = at(index);
+        uint64_t head = free_head_.load(std::memory_order_relaxed);
+        uint64_t new_head;
+        do{
+            s.next_free.store(static_cast<uint32_t>(head & 0xffffffffu), std::memory_order_relaxed);
+            new_head = ((head >> 32) + 1) << 32 | (index + 1);
+        } while( !free_head_.compare_exchange_weak(head, new_head,
+                                                   std::memory_order_release, std::memory_order_relaxed) );
+    }
+
+private:
+    mutable std::atomic<slot*> chunks_[max_chunks];
+    std::atomic<uint64_t> free_head_;
+    std::atomic<size_t> next_unused_;
+};
+
+#endif //QUOTE_SERVER_TAG_REGISTRY_H
@@ -0,0 +1,15 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#include "quote_store.h"
+#include "RedisCenter.h"
+
+void redis_quote_store::write(const std::list<MultiQuote*>& batch) {
+    // RedisCenter只有逐条写入的接口，整批在工作线程中顺序提交
+    for( auto quotes : batch ){
+        for( auto i = 0; i < quotes->entities_size(); ++i ){
+            RedisCenter::ins()->SetDayKeyByQuote(quotes->entities(i));
+        }
+    }
+}
@@ -0,0 +1,241 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_QUOTE_STORE_H
+#define QUOTE_SERVER_QUOTE_STORE_H
+
+#include "grpc_framework/msg_queue.h"
+#include "grpc_framework/conflation_index.h"
+#include "data_define.pb.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace ::yuanda;
+
+/// 行情的存储接口。write()只在quote_store_queue的工作线程中调用，不会阻塞完成队列的线程。
+class quote_store{
+public:
+    virtual ~quote_store() {}
+
+    /// 写入一批行情，实现应当把整批作为一次（管道化的）写操作提交。
+    /// \param batch 按到达顺序排列的行情，只在调用期间有效。
+    virtual void write(const std::list<MultiQuote*>& batch) = 0;
+};
+
+/// 写入Redis，参见RedisCenter。
+class redis_quote_store : public quote_store{
+public:
+    virtual void write(const std::list<MultiQuote*>& batch) override;
+};
+
+/// 内存中的存储，测试时代替Redis。保存写入的全部行情。
+class memory_quote_store : public quote_store{
+public:
+    memory_quote_store(): batches_(0) {}
+
+    virtual void write(const std::list<MultiQuote*>& batch) override{
+        lock_t lock(mutex_);
+        ++batches_;
+        for( auto msg : batch ){
+            quotes_.push_back(*msg);
+        }
+    }
+
+    /// write()被调用的次数。
+    size_t batches() const{
+        lock_t lock(mutex_);
+        return batches_;
+    }
+
+    /// 写入的全部行情。
+    std::vector<MultiQuote> quotes() const{
+        lock_t lock(mutex_);
+        return quotes_;
+    }
+
+private:
+    typedef std::mutex mutex_t;
+    typedef std::unique_lock<mutex_t> lock_t;
+
+    mutable mutex_t mutex_;
+    size_t batches_;
+    std::vector<MultiQuote> quotes_;
+};
+
+/// 批量写存储的流水线。完成队列的线程只调用push()（复制到Arena，不做I/O），
+/// 工作线程攒够batch_size个行情或者最早的行情等待了batch_delay_ms后，整批交给quote_store::write()。
+class quote_store_queue : public msg_queue<MultiQuote>{
+public:
+    /// \param store 行情的存储。
+    /// \param batch_size 一批的行情个数。
+    /// \param batch_delay_ms 行情最多等待的毫秒数。
+    /// \param buffer_size 缓存的最大字节数，超过后push()返回-2，参见msg_queue::push()。
+    quote_store_queue(std::shared_ptr<quote_store> store, size_t batch_size = 256, int batch_delay_ms = 20,
+                      size_t buffer_size = 1024*1024*64)
+            : msg_queue<MultiQuote>(buffer_size), store_(store){
+        set_batch(batch_size, batch_delay_ms);
+    }
+
+    virtual ~quote_store_queue(){
+        stop();
+    }
+
+protected:
+    virtual void handle_msg(const std::list<MultiQuote*>& msg_list) override{
+        if( !msg_list.empty() ){
+            store_->write(msg_list);
+        }
+    }
+
+private:
+    std::shared_ptr<quote_store> store_;
+};
+
+/// 合并的统计。
+struct conflation_stats{
+    uint64_t merges;        // 合并的次数
+    uint64_t quotes_in;     // 参与合并的行情个数
+    uint64_t quotes_out;    // 合并后剩下的行情个数
+
+    /// 合并比例，即平均多少个行情合并成一个。
+    double ratio() const{
+        return quotes_out == 0 ? 1.0 : static_cast<double>(quotes_in) / quotes_out;
+    }
+};
+
+/// 按证券合并的行情队列。存储跟不上（积压了backlog个行情）时，之后的行情不再单独入队，而是按证券合并进队尾的行情，
+/// 每个证券只保留最新的行情，所以内存和积压都有上限，且不会丢失任何证券的最新价格。
+/// \li 合并在push()的线程中进行（参见msg_queue::fold_msg()），用开放寻址的conflation_index按证券查找。
+///     索引在同一批中沿用，每次push只查找新行情中的证券，耗时和新行情的大小成正比；原地覆盖，不新建Arena。
+/// \li 合并结果中entities以外的字段（如时间）取自开始合并时的行情。
+/// \li 缓存仍超过buffer_size时（如一批中的证券过多），通过merge_msg()把积压的行情合并成一个MultiQuote。
+class conflating_quote_queue : public quote_store_queue{
+public:
+    /// MultiQuote中单个行情的类型。
+    typedef std::decay<decltype(std::declval<MultiQuote>().entities(0))>::type quote_t;
+    /// 取得行情的证券代码。返回的引用须指向行情自身的字段。
+    typedef std::function<const std::string& (const quote_t&)> key_getter_t;
+
+    /// \param key_of 取得证券代码的函数。
+    /// \param backlog 开始合并的积压个数，0表示等于batch_size：工作线程空闲时整批会被立即取出，积压到一整批说明存储跟不上。
+    /// 其他参数参见quote_store_queue。
+    conflating_quote_queue(std::shared_ptr<quote_store> store, key_getter_t key_of, size_t batch_size = 256,
+                           int batch_delay_ms = 20, size_t buffer_size = 1024*1024*64, size_t backlog = 0)
+            : quote_store_queue(store, batch_size, batch_delay_ms, buffer_size)
+            , key_of_(key_of), merges_(0), quotes_in_(0), quotes_out_(0){
+        set_fold(backlog > 0 ? backlog : std::max<size_t>(batch_size, 1));
+    }
+
+    /// 获得合并的统计。
+    conflation_stats get_conflation_stats() const{
+        conflation_stats stats;
+        stats.merges = merges_.load(std::memory_order_relaxed);
+        stats.quotes_in = quotes_in_.load(std::memory_order_relaxed);
+        stats.quotes_out = quotes_out_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+protected:
+    /// 继承自msg_queue。msg中的行情按证券合并进into，已有的证券原地覆盖。
+    virtual bool fold_msg(MultiQuote* into, const MultiQuote& msg, bool first) override{
+        uint64_t count = msg.entities_size();
+        uint64_t before = into->entities_size();
+        if( first ){
+            // into是新的队尾，重建索引。key指向into中的字段，在into被取走之前一直有效
+            index_.clear();
+            for( int i = 0; i < into->entities_size(); ++i ){
+                bool inserted;
+                uint32_t pos = index_.find_or_insert(key_of_(into->entities(i)), i, &inserted);
+                if( !inserted ){
+                    // 同一个消息中的重复证券，后面的较新
+                    *into->mutable_entities(pos) = into->entities(i);
+                }
+            }
+            count += before;
+            before = 0;
+        }
+        for( int i = 0; i < msg.entities_size(); ++i ){
+            const quote_t& quote = msg.entities(i);
+            bool inserted;
+            uint32_t pos = index_.find_or_insert(key_of_(quote), into->entities_size(), &inserted);
+            if( inserted ){
+                *into->add_entities() = quote;
+                // 索引中的key改为指向into中的副本，msg只在本次调用期间有效
+                index_.rebind(key_of_(into->entities(pos)));
+            } else {
+                *into->mutable_entities(pos) = quote;
+            }
+        }
+        merges_.fetch_add(1, std::memory_order_relaxed);
+        quotes_in_.fetch_add(count, std::memory_order_relaxed);
+        quotes_out_.fetch_add(into->entities_size() - before, std::memory_order_relaxed);
+        return true;
+    }
+
+    /// 继承自msg_queue。src中的全部行情合并成一个MultiQuote，其他字段取自最后一个消息。
+    virtual void merge_msg(const std::list<MultiQuote*>& src, std::list<MultiQuote*>& dest, Arena* arena) override{
+        const MultiQuote* last = nullptr;
+        bool quit = false;
+        for( auto msg : src ){
+            if( msg == nullptr ){
+                quit = true;
+            } else {
+                last = msg;
+            }
+        }
+        if( last == nullptr ){
+            return;
+        }
+
+        MultiQuote* merged = Arena::CreateMessage<MultiQuote>(arena);
+        *merged = *last;
+        merged->clear_entities();
+
+        uint64_t count = 0;
+        index_.clear();
+        for( auto msg : src ){
+            if( msg == nullptr ){
+                continue;
+            }
+            for( int i = 0; i < msg->entities_size(); ++i ){
+                const quote_t& quote = msg->entities(i);
+                bool inserted;
+                uint32_t pos = index_.find_or_insert(key_of_(quote), merged->entities_size(), &inserted);
+                if( inserted ){
+                    *merged->add_entities() = quote;
+                } else {
+                    *merged->mutable_entities(pos) = quote;
+                }
+                ++count;
+            }
+        }
+
+        dest.push_back(merged);
+        if( quit ){
+            dest.push_back(nullptr);
+        }
+        merges_.fetch_add(1, std::memory_order_relaxed);
+        quotes_in_.fetch_add(count, std::memory_order_relaxed);
+        quotes_out_.fetch_add(merged->entities_size(), std::memory_order_relaxed);
+    }
+
+private:
+    key_getter_t key_of_;
+    conflation_index index_;    // 只在fold_msg()和merge_msg()中使用，msg_queue加锁后调用
+
+    std::atomic<uint64_t> merges_;
+    std::atomic<uint64_t> quotes_in_;
+    std::atomic<uint64_t> quotes_out_;
+};
+
+#endif //QUOTE_SERVER_QUOTE_STORE_H
@@ -3,29 +3,40 @@
 //
 
 #include "transcode_call.h"
+#include "transcode_client.h"
 #include "util/logger.hpp"
 
-Transcode_PushQuote::Transcode_PushQuote(transcode_client *client)
-        :client(client)
+const char* push_quote_handler::resume_from_key = "resume-from";
+const char* push_quote_handler::resume_to_key = "resume-to";
+
+push_quote_handler::push_quote_handler(transcode_client *client, bool range)
+        :client_(client), range_(range)
 {
-    stream = client->stub()->AsyncPushQuote(&context, request, client->cq(), this);
-    reader_ = unique_ptr<super::reader_t>(new super::reader_t(this, *(stream.get()) ));
-    client->add_tag({this, reader_.get()});
-    LOG_INFO("Transcode_PushQuote addr: {:p} , reader's addr: {:p}", (void*)this, (void*)reader_.get())
 }
 
-void Transcode_PushQuote::on_read(void *message) {
-    client->on_push_quote_read(message);
+void push_quote_handler::start(uint64_t from, uint64_t to) {
+    Transcode_PushQuote* call = new Transcode_PushQuote(client_, this, EmptyMessage());
+    if( from != 0 ){
+        call->get_context().AddMetadata(resume_from_key, std::to_string(from));
+        if( to != 0 ){
+            call->get_context().AddMetadata(resume_to_key, std::to_string(to));
+        }
+    }
+    LOG_INFO("Transcode_PushQuote addr: {:p}, resume {} - {}", (void*)call, from, to)
+    call->start();
+}
+
+void push_quote_handler::on_start(Transcode_PushQuote& call) {
+    LOG_INFO("Transcode_PushQuote CREATE")
 }
 
-void Transcode_PushQuote::process() {
-    if( status == ClientRPCStatus::CREATE ){
-        LOG_INFO("Transcode_PushQuote CREATE")
-        status = ClientRPCStatus::READ;
-        reader_->read();
-    } else if( status == ClientRPCStatus::FINISH ){
-        LOG_INFO("Transcode_PushQuote FINISH");
-        client->remove_tag({this, reader_.get()});
-        delete this;
+void push_quote_handler::on_read(Transcode_PushQuote& call, const MultiQuote& quotes) {
+    client_->on_push_quote_read(&call, quotes);
+}
+
+void push_quote_handler::on_finish(Transcode_PushQuote& call, const Status& status) {
+    LOG_INFO("Transcode_PushQuote FINISH {} {}", status.error_code(), status.error_message());
+    if( range_ ){
+        client_->on_push_quote_finish(&call, status);
     }
-}
\ No newline at end of file
+}
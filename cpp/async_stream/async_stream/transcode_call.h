@@ -5,25 +5,47 @@
 #ifndef PROVIDER_TRANSCODE_CALL_H
 #define PROVIDER_TRANSCODE_CALL_H
 
-#include "grpc_framework/client_rpc.h"
-#include "transcode_client.h"
+#include "grpc_framework/call_handler.h"
+#include "transcode.async_call.h"
 
 using namespace yuanda;
 using namespace std;
 
 class transcode_client;
+class push_quote_handler;
 
-class Transcode_PushQuote
-        : public client_uni_stream_rpc<EmptyMessage, MultiQuote>{
+/// 订阅推送行情的调用，由async_call_plugin从transcode.proto生成，回调push_quote_handler。
+typedef Transcode_PushQuote_client<push_quote_handler> Transcode_PushQuote;
+
+/// 推送行情调用的回调，转给transcode_client。实时推送和补取区间的调用各用一个。
+/// 续传的起止序号通过请求的metadata传给服务端（EmptyMessage没有字段可用），参见start()：
+/// \li 没有resume-from：从最新行情开始推送。
+/// \li 只有resume-from：先重放序号不小于resume-from的行情，然后继续推送最新行情。
+/// \li resume-from和resume-to：只重放闭区间[resume-from, resume-to]内的行情，然后结束调用，用于补齐缺口。
+class push_quote_handler : public call_handler{
 public:
-    typedef client_uni_stream_rpc<EmptyMessage, MultiQuote> super;
-    Transcode_PushQuote(transcode_client* client);
+    static const char* resume_from_key;
+    static const char* resume_to_key;
+
+    /// \param client 客户端
+    /// \param range 是否用于补取区间的调用。
+    push_quote_handler(transcode_client* client, bool range);
+
+    /// 发起调用。
+    /// \param from 续传的起始序号，0表示不续传。
+    /// \param to 补取区间的结束序号，0表示不限，之后继续推送。须与range一致。
+    void start(uint64_t from = 0, uint64_t to = 0);
+
+    void on_start(Transcode_PushQuote& call);
+
+    void on_read(Transcode_PushQuote& call, const MultiQuote& quotes);
 
-    virtual void on_read(void* message) override;
+    /// 调用结束。补取区间的调用交给transcode_client::on_push_quote_finish()，用于区分“服务端正常结束”和“断线”。
+    void on_finish(Transcode_PushQuote& call, const Status& status);
 
-    virtual void process() override;
 private:
-    transcode_client* client;
+    transcode_client* client_;
+    bool range_;
 };
 
 #endif //PROVIDER_TRANSCODE_CALL_H
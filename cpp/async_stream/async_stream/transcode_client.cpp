@@ -6,28 +6,158 @@
 #include "transcode_client.h"
 #include "transcode_call.h"
 #include "util/logger.hpp"
-#include "RedisCenter.h"
 using namespace grpc;
 using namespace yuanda;
 
-transcode_client::transcode_client() {
-
+transcode_client::transcode_client()
+        : live_handler_(this, false), range_handler_(this, true)
+        , gap_requested_(false), gap_retries_(0), gap_last_(0) {
+    // 断线后不重建完成队列，连接恢复后由on_reconnect()重新订阅
+    set_reconnect(ReconnectMode::IN_PLACE);
+    set_quote_store(std::make_shared<redis_quote_store>());
 }
 
 
 void transcode_client::on_run() {
-    new Transcode_PushQuote(this);
+    live_handler_.start();
 }
 
 void transcode_client::on_exit() {
 
 }
 
-void transcode_client::on_push_quote_read(void *message) {
-    const MultiQuote* quotes = static_cast<MultiQuote*>(message);
-	for (auto i = 0; i < quotes->entities_size(); ++i) {
-		const auto& quote = quotes->entities(i);
-		RedisCenter::ins()->SetDayKeyByQuote(quote);
-	}
-    this->push_signal(quotes);
+void transcode_client::on_reconnect() {
+    lock_t lock(seq_mutex_);
+    // 断线时补取调用也已经结束，续传会从缺口处开始重放，覆盖缺口
+    gap_requested_ = false;
+    gap_retries_ = 0;
+    if( sequence_.started() ){
+        LOG_INFO("transcode_client resume from {}, pending {}", sequence_.last() + 1, sequence_.pending());
+        live_handler_.start(sequence_.last() + 1);
+    } else {
+        live_handler_.start();
+    }
+}
+
+void transcode_client::on_push_quote_read(Transcode_PushQuote* call, const MultiQuote& quotes) {
+    uint64_t seq = sequence_getter_ ? sequence_getter_(quotes) : 0;
+    if( seq == 0 ){
+        apply_quotes(call->hold());
+        return;
+    }
+
+    // 持锁应用，保证实时推送和补取的行情按序号顺序应用
+    lock_t lock(seq_mutex_);
+    auto result = sequence_.push(seq, call->hold(), [this](uint64_t, read_handle<MultiQuote>& msg){
+        apply_quotes(msg);
+    });
+    if( result == SequenceResult::GAP ){
+        gap_retries_ = 0;
+        request_gap();
+    } else if( result == SequenceResult::SKIPPED ){
+        LOG_INFO("transcode_client too many pending quotes, skip gap, last {}", sequence_.last());
+        request_gap();
+    }
+}
+
+void transcode_client::on_push_quote_finish(Transcode_PushQuote* call, const Status& status) {
+    lock_t lock(seq_mutex_);
+    gap_requested_ = false;
+    sequence_tracker<read_handle<MultiQuote>>::range gap;
+    if( !sequence_.missing(&gap) ){
+        gap_retries_ = 0;
+        return;
+    }
+    if( !is_definitive(call, status) ){
+        // 服务端没有回答这段行情是否存在，不能放弃缺口。补取调用补上了一部分时重新计数
+        if( sequence_.last() != gap_last_ ){
+            gap_retries_ = 0;
+        }
+        if( gap_retries_ >= max_gap_retries ){
+            // 断线时由on_reconnect()续传；否则等待下一个缺口，或者缓存已满时放弃
+            LOG_INFO("transcode_client gap {} - {} failed {} times, keep it", gap.first, gap.last, gap_retries_);
+            return;
+        }
+        ++gap_retries_;
+        request_gap();
+        return;
+    }
+    // 服务端已经没有这段行情，放弃缺口
+    LOG_INFO("transcode_client gap {} - {} not filled, skip it", gap.first, gap.last);
+    sequence_.skip([this](uint64_t, read_handle<MultiQuote>& msg){
+        apply_quotes(msg);
+    });
+    gap_retries_ = 0;
+    request_gap();
+}
+
+bool transcode_client::is_definitive(const Transcode_PushQuote* call, const Status& status) {
+    if( !call->started() ){
+        return false;
+    }
+    switch( status.error_code() ){
+        case StatusCode::OK:
+        case StatusCode::NOT_FOUND:
+        case StatusCode::OUT_OF_RANGE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void transcode_client::request_gap() {
+    sequence_tracker<read_handle<MultiQuote>>::range gap;
+    if( gap_requested_ || !sequence_.missing(&gap) ){
+        return;
+    }
+    LOG_INFO("transcode_client request gap {} - {}", gap.first, gap.last);
+    gap_requested_ = true;
+    gap_last_ = sequence_.last();
+    range_handler_.start(gap.first, gap.last);
+}
+
+void transcode_client::apply_quotes(const read_handle<MultiQuote>& quotes) {
+    // 只复制到队列，写存储在quote_store_queue的工作线程中进行
+    if( store_queue_->push(quotes.get()) < 0 ){
+        LOG_INFO("transcode_client quote store is full, drop {} quotes", quotes->entities_size());
+    }
+#if defined(__linux__)
+    if( shm_ring_ && !shm_ring_->publish(*quotes) ){
+        LOG_INFO("transcode_client quotes too large for shm ring, {} bytes", quotes->ByteSizeLong());
+    }
+#endif
+    // 行情由句柄保持有效，最后一个订阅者处理完后释放。
+    // 同一时刻只有一个线程调用这里（推送调用的读是串行的，补取时持有seq_mutex_），满足publish()单生产者的要求
+    read_handle<MultiQuote> handle = quotes;
+    this->push_dispatcher.publish(quote_ptr(handle.get(), [handle](const MultiQuote*) mutable { handle.reset(); }));
+}
+
+transcode_client::dispatcher_t::subscription_t transcode_client::reg_push_callback(
+        push_callback_t callback, DispatchPolicy policy, size_t capacity) {
+    return push_dispatcher.subscribe([callback](const quote_ptr& quotes){ callback(quotes.get()); },
+                                     policy, capacity,
+                                     [this](const quote_ptr& older, const quote_ptr& newer){
+                                         return conflate_quotes(older, newer);
+                                     });
+}
+
+transcode_client::quote_ptr transcode_client::conflate_quotes(const quote_ptr& older, const quote_ptr& newer) {
+    if( !quote_key_ ){
+        return newer;
+    }
+    // 以newer为准，补上older中newer没有的证券
+    std::shared_ptr<MultiQuote> merged = std::make_shared<MultiQuote>(*newer);
+    conflation_index index(merged->entities_size() + older->entities_size());
+    bool inserted;
+    for( auto i = 0; i < merged->entities_size(); ++i ){
+        index.find_or_insert(quote_key_(merged->entities(i)), i, &inserted);
+    }
+    for( auto i = 0; i < older->entities_size(); ++i ){
+        const auto& quote = older->entities(i);
+        index.find_or_insert(quote_key_(quote), merged->entities_size(), &inserted);
+        if( inserted ){
+            *merged->add_entities() = quote;
+        }
+    }
+    return merged;
 }
\ No newline at end of file
@@ -6,6 +6,12 @@
 #define QUOTE_SERVER_TRANSCODE_CLIENT_H
 
 #include "grpc_framework/client_impl.h"
+#include "grpc_framework/fanout_dispatcher.h"
+#include "grpc_framework/rpc_reader.h"
+#include "grpc_framework/sequence_tracker.h"
+#include "grpc_framework/shm_ring.h"
+#include "quote_store.h"
+#include "transcode_call.h"
 #include "util/singleton.h"
 #include "data_define.pb.h"
 #include "transcode.grpc.pb.h"
@@ -14,15 +20,15 @@
 #include <grpc++/channel.h>
 #include <grpc++/client_context.h>
 
-#include <boost/signals2.hpp>
-
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
 using namespace grpc;
 using namespace ::yuanda;
-using namespace boost;
-
-class Transcode_PushQuote;
 
 class transcode_client
 : public client_impl<Transcode>, public singleton<transcode_client>
@@ -33,12 +39,77 @@ public:
     virtual void on_run() override;
     virtual void on_exit() override;
 
+    /// 连接恢复后从最后应用的序号之后续传，而不是重新全量订阅。
+    virtual void on_reconnect() override;
+
+    /// 取得行情序号的函数，返回0表示该行情没有序号。序号字段由data_define.proto定义，这里不依赖具体字段名。
+    /// 没有设置时不跟踪序号，每次（重）连接都全量订阅。须在run()之前设置。
+    typedef std::function<uint64_t (const MultiQuote&)> sequence_getter_t;
+    void set_sequence_getter(sequence_getter_t getter){
+        sequence_getter_ = getter;
+    }
+
+    /// 设置行情的存储，默认写入Redis（redis_quote_store）。须在run()之前设置。
+    /// \param store 行情的存储，在批量写的工作线程中调用。
+    /// \param batch_size 一批的行情个数。
+    /// \param batch_delay_ms 行情最多等待的毫秒数。
+    void set_quote_store(std::shared_ptr<quote_store> store, size_t batch_size = 256, int batch_delay_ms = 20){
+        store_queue_.reset(new quote_store_queue(store, batch_size, batch_delay_ms));
+    }
+
+    /// 设置存储的流水线，如conflating_quote_queue。须在run()之前设置。
+    void set_quote_queue(std::unique_ptr<quote_store_queue> queue){
+        store_queue_ = std::move(queue);
+    }
+
+    /// 设置取得证券代码的函数，CONFLATE的订阅者按证券合并积压的行情。没有设置时只保留最新的MultiQuote。
+    void set_quote_key(conflating_quote_queue::key_getter_t key_of){
+        quote_key_ = key_of;
+    }
+
+#if defined(__linux__)
+    /// 把收到的行情写入共享内存环形缓冲区，同一台机器上的其他进程用shm_ring_reader读取，不必各自订阅。须在run()之前调用。
+    /// \param name 共享内存的名字，如"/transcode_quote"。
+    /// \param slot_size 每个槽位的字节数，超过的MultiQuote不写入。
+    /// \param slot_count 槽位个数。
+    /// \return 是否成功。
+    bool enable_shm_ring(const std::string& name, uint32_t slot_size = 64 * 1024, uint64_t slot_count = 4096){
+        std::unique_ptr<shm_ring_writer> ring(new shm_ring_writer());
+        if( !ring->open(name, slot_size, slot_count) ){
+            return false;
+        }
+        shm_ring_ = std::move(ring);
+        return true;
+    }
+
+    /// 共享内存的读者和它们的延迟。
+    std::vector<shm_ring_writer::reader_info> get_shm_readers() const{
+        return shm_ring_ ? shm_ring_->readers() : std::vector<shm_ring_writer::reader_info>();
+    }
+#endif
 
     // push method callback
-    void on_push_quote_read(void* message);
-    typedef boost::signals2::signal <void (const MultiQuote* )> signal_t;
-    signals2::connection reg_push_callback(const signal_t::slot_type& slot){
-        return push_signal.connect(slot);
+    void on_push_quote_read(Transcode_PushQuote* call, const MultiQuote& quotes);
+    /// 补取区间的调用结束。
+    void on_push_quote_finish(Transcode_PushQuote* call, const Status& status);
+
+    /// 订阅者共享同一个行情，不复制。
+    typedef std::shared_ptr<const MultiQuote> quote_ptr;
+    typedef fanout_dispatcher<quote_ptr> dispatcher_t;
+    typedef std::function<void (const MultiQuote*)> push_callback_t;
+
+    /// 订阅推送行情。回调在订阅者自己的线程中执行，不阻塞完成队列的线程和其他订阅者。
+    /// \param callback 回调函数，行情只在回调期间有效。
+    /// \param policy 订阅者处理不过来时的处理方式，参见DispatchPolicy。
+    /// \param capacity 订阅者的队列容量。
+    /// \return 订阅的标识，用于unreg_push_callback()。
+    dispatcher_t::subscription_t reg_push_callback(push_callback_t callback,
+                                                   DispatchPolicy policy = DispatchPolicy::DROP_OLDEST,
+                                                   size_t capacity = 1024);
+
+    /// 取消订阅。不能在回调中调用。
+    void unreg_push_callback(dispatcher_t::subscription_t id){
+        push_dispatcher.unsubscribe(id);
     }
 
 protected:
@@ -46,7 +117,40 @@ protected:
     typedef std::mutex mutex_t;
     typedef std::unique_lock<mutex_t> lock_t;
 
-    signal_t push_signal;
+    dispatcher_t push_dispatcher;
+
+private:
+    /// 应用一条行情：交给存储的流水线并通知订阅者。
+    void apply_quotes(const read_handle<MultiQuote>& quotes);
+
+    /// CONFLATE的订阅者合并两个行情，newer优先。
+    quote_ptr conflate_quotes(const quote_ptr& older, const quote_ptr& newer);
+
+    /// 发起补取当前缺口的调用。调用前须持有seq_mutex_。
+    void request_gap();
+
+    /// 补取调用的结束状态是否是服务端的确定回答（区间已经发完，或者没有这段行情），只有这时才放弃缺口。
+    /// 调用没有开始、断线、被取消或中断时，服务端并没有回答，缺口应当重新补取。
+    static bool is_definitive(const Transcode_PushQuote* call, const Status& status);
+
+    /// 连续补取失败（没有进展）的次数上限，超过后不再立即重试，等待下一个缺口、重连或者缓存已满。
+    enum { max_gap_retries = 3 };
+
+    push_quote_handler live_handler_;   // 实时推送的调用
+    push_quote_handler range_handler_;  // 补取区间的调用
+
+    sequence_getter_t sequence_getter_;
+    mutex_t seq_mutex_;
+    sequence_tracker<read_handle<MultiQuote>> sequence_;
+    bool gap_requested_;    // 是否有未结束的补取调用
+    int gap_retries_;       // 连续补取失败的次数
+    uint64_t gap_last_;     // 发起补取时已经应用的最大序号，用于判断补取调用是否有进展
+
+    std::unique_ptr<quote_store_queue> store_queue_;
+    conflating_quote_queue::key_getter_t quote_key_;
+#if defined(__linux__)
+    std::unique_ptr<shm_ring_writer> shm_ring_;
+#endif
 };
 
 
@@ -0,0 +1,871 @@
+//
+// Created by tnie on 2026/10/16.
+//
+// grpc_framework的吞吐量/延迟基准测试。
+// 在进程内启动一个回显服务（server_impl + server_bi_stream_rpc），客户端（client_generic_bi_stream_rpc）
+// 通过回环地址连接，多个生产者线程同时调用writer::write()，服务端原样写回。
+// 对消息大小、生产者个数、writer发送队列大小的每种组合分两个阶段运行，结果以JSON数组输出到stdout，进度输出到stderr：
+// \li 吞吐量：生产者不限速地写，只统计seconds秒内收到的回显；之后最多再等seconds秒排空，不计入结果。
+// \li 延迟：新建一个调用，在途（已发出、未收到回显）的消息不超过window个（默认为1，即一问一答），
+//     客户端在读回调中计算往返延迟。
+//     不限速时测到的主要是发送队列的积压，不是延迟，所以两者分开测。
+// 另有不经过gRPC的进程内微基准（--cases选择，默认只运行loopback）：
+// \li mpsc：多个生产者同时write()时writer发送队列的吞吐量，一个线程模拟完成队列；
+//     同样条件下再测改用无锁队列之前的互斥锁+std::list（queue为mutex_list）作为对照，默认1、4、16个生产者。
+// \li manual：set_auto(false)时由on_write()中的write_next()驱动发送，检查发送队列不会停滞（stalled）。
+// \li arena：稳态下每次write()的堆内存分配次数，检查发送队列的Arena是否从arena_pool复用。
+// 以及经过回环连接的coro：协程客户端（coro_call）一问一答的往返延迟，需要按C++20编译。
+//
+// 用法：framework_bench [--cases=loopback,mpsc,manual,arena,coro] [--sizes=64,1024,...] [--producers=1,4] [--buffers=1048576,...]
+//                       [--seconds=2] [--window=1] [--port=50901]
+//
+
+#include "grpc_framework/client_rpc.h"
+#include "grpc_framework/coro_rpc.h"
+#include "grpc_framework/server_rpc.h"
+#include "grpc_framework/cq_stats.h"
+
+#include <google/protobuf/struct.pb.h>
+#include <google/protobuf/wrappers.pb.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using google::protobuf::BytesValue;
+using google::protobuf::ListValue;
+
+// ---------------------------------------------------------------------------
+// 堆内存分配计数
+
+static std::atomic<uint64_t> g_allocations(0);
+
+static void* counted_alloc(size_t size) noexcept{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+// 普通、数组、nothrow、sized的版本成对替换，都用malloc/free，不会混用分配函数。
+// 不内联：否则GCC把内联进来的new表达式和这里的free()配对，误报-Wmismatched-new-delete
+#ifdef __GNUC__
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+BENCH_NOINLINE void* operator new(size_t size){
+    if( void* p = counted_alloc(size) ){
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void* operator new[](size_t size){
+    if( void* p = counted_alloc(size) ){
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+BENCH_NOINLINE void* operator new(size_t size, const std::nothrow_t&) noexcept{
+    return counted_alloc(size);
+}
+
+BENCH_NOINLINE void* operator new[](size_t size, const std::nothrow_t&) noexcept{
+    return counted_alloc(size);
+}
+
+BENCH_NOINLINE void operator delete(void* p) noexcept{
+    std::free(p);
+}
+
+BENCH_NOINLINE void operator delete[](void* p) noexcept{
+    std::free(p);
+}
+
+BENCH_NOINLINE void operator delete(void* p, size_t) noexcept{
+    std::free(p);
+}
+
+BENCH_NOINLINE void operator delete[](void* p, size_t) noexcept{
+    std::free(p);
+}
+
+BENCH_NOINLINE void operator delete(void* p, const std::nothrow_t&) noexcept{
+    std::free(p);
+}
+
+BENCH_NOINLINE void operator delete[](void* p, const std::nothrow_t&) noexcept{
+    std::free(p);
+}
+
+// ---------------------------------------------------------------------------
+// 服务端：回显
+
+static const char* bench_method = "/bench.Echo/Chat";
+
+typedef server_impl<grpc::AsyncGenericService> echo_server;
+
+class echo_rpc
+        : public server_bi_stream_rpc<grpc::AsyncGenericService, grpc::ByteBuffer, grpc::ByteBuffer>{
+public:
+    echo_rpc(server_t* server): server_bi_stream_rpc(server) {}
+
+    virtual void on_read(void* req_ptr) override{
+        while( write(*static_cast<grpc::ByteBuffer*>(req_ptr)) < 0 && status == ServerRPCStatus::WORKING ){
+            std::this_thread::yield();
+        }
+    }
+
+protected:
+    virtual void request_call(ServerCompletionQueue* cq) override{
+        server_->service()->RequestCall(&context, &responder, cq, cq, tag());
+    }
+
+    virtual server_rpc_base* create() override{
+        return new echo_rpc(server_);
+    }
+};
+
+class bench_server : public echo_server{
+public:
+    virtual void on_run() override{
+        post(4, [this]() -> server_rpc_base* { return new echo_rpc(this); });
+    }
+};
+
+// ---------------------------------------------------------------------------
+// 客户端
+
+struct generic_service{
+    typedef grpc::GenericStub Stub;
+    static std::unique_ptr<Stub> NewStub(std::shared_ptr<Channel> channel){
+        return std::unique_ptr<Stub>(new Stub(channel));
+    }
+};
+
+class bench_client : public client_impl<generic_service>{
+public:
+    bench_client(): ready_(false) {}
+
+    virtual void on_run() override{
+        std::lock_guard<std::mutex> lock(mutex_);
+        ready_ = true;
+        cond_.notify_all();
+    }
+
+    void wait_ready(){
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]{ return ready_; });
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool ready_;
+};
+
+/// 一个阶段使用的调用。读回调只在客户端唯一的工作线程上执行，所以延迟直方图只有一个写者。
+class bench_call : public client_generic_bi_stream_rpc{
+public:
+    bench_call(bench_client* client, size_t buffer_size)
+            : client_(client), started_(false), received_(0), bytes_(0){
+        client_->add_tag({this});
+        prepare_call(client_->stub(), bench_method, client_->cq());
+        writer_.reset(new writer_t(this, *stream, buffer_size));
+        client_->add_tag({reader_.get(), writer_.get()});
+        start_call();
+    }
+
+    virtual void process() override{
+        if( status == ClientRPCStatus::CREATE ){
+            status = ClientRPCStatus::WORKING;
+            writer_->start();
+            reader_->read();
+            started_.store(true);
+        } else if( status == ClientRPCStatus::FINISH ){
+            client_->remove_tag({this, reader_.get(), writer_.get()});
+            finished_.store(true);
+        }
+    }
+
+    virtual void on_read(void* req_ptr) override{
+        grpc::ByteBuffer* buffer = static_cast<grpc::ByteBuffer*>(req_ptr);
+        size_t length = buffer->Length();
+        BytesValue msg;
+        if( !parse(buffer, &msg) || msg.value().size() < sizeof(int64_t) ){
+            return;
+        }
+        int64_t sent;
+        std::memcpy(&sent, msg.value().data(), sizeof(sent));
+        latency_.record(static_cast<uint64_t>(cq_stats::now_ns() - sent));
+        bytes_.fetch_add(length, std::memory_order_relaxed);
+        received_.fetch_add(1, std::memory_order_release);
+        if( window_waiters_.load() > 0 ){
+            std::lock_guard<std::mutex> lock(window_mutex_);
+            window_cond_.notify_all();
+        }
+    }
+
+    /// 等到在途的消息少于window个，然后占用一个位置。等待超时或者stop为true时返回false。
+    bool acquire_window(uint64_t window, const std::atomic<bool>& stop){
+        std::unique_lock<std::mutex> lock(window_mutex_);
+        window_waiters_.fetch_add(1);
+        while( issued_ - received() >= window && !stop.load() ){
+            window_cond_.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        window_waiters_.fetch_sub(1);
+        if( stop.load() ){
+            return false;
+        }
+        ++issued_;
+        return true;
+    }
+
+    /// 占用的位置没有写出（write()失败），归还。
+    void release_window(){
+        std::lock_guard<std::mutex> lock(window_mutex_);
+        --issued_;
+    }
+
+    virtual void on_write(int write_id) override {}
+
+    bool started() const { return started_.load(); }
+    bool finished() const { return finished_.load(); }
+    uint64_t received() const { return received_.load(std::memory_order_acquire); }
+    uint64_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+    const log_histogram& latency() const { return latency_; }
+
+    void cancel(){
+        context.TryCancel();
+    }
+
+private:
+    bench_client* client_;
+    std::atomic<bool> started_;
+    std::atomic<bool> finished_{false};
+    std::atomic<uint64_t> received_;
+    std::atomic<uint64_t> bytes_;
+    log_histogram latency_;
+
+    std::mutex window_mutex_;
+    std::condition_variable window_cond_;
+    std::atomic<int> window_waiters_{0};
+    uint64_t issued_ = 0;           // 延迟阶段占用过的位置，由window_mutex_保护
+};
+
+// ---------------------------------------------------------------------------
+
+struct bench_config{
+    size_t size;
+    size_t producers;
+    size_t buffer;
+    size_t window;
+};
+
+struct bench_result{
+    bench_config config;
+    uint64_t sent;
+    uint64_t received;
+    double seconds;
+    double msgs_per_sec;
+    double mb_per_sec;
+    double allocs_per_msg;
+    uint64_t latency_samples;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+};
+
+static bench_call* start_call(bench_client& client, size_t buffer){
+    // 调用在阶段结束后取消，对象不释放：取消后仍可能有事件到达
+    bench_call* call = new bench_call(&client, buffer);
+    while( !call->started() ){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return call;
+}
+
+/// 取消调用，并等它结束（最多1秒），没有排空的数据不再占用连接。
+static void stop_call(bench_call* call){
+    call->cancel();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while( !call->finished() && std::chrono::steady_clock::now() < deadline ){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/// 生产者线程：不断写入带发送时间的消息，直到stop为true。window不为0时，在途的消息不超过window个。
+static void produce(bench_call* call, const bench_config& config, size_t window,
+                    const std::atomic<bool>& stop, std::atomic<uint64_t>& sent){
+    BytesValue msg;
+    std::string payload(std::max(config.size, sizeof(int64_t)), 'x');
+    grpc::ByteBuffer buffer;
+    while( !stop.load(std::memory_order_relaxed) ){
+        if( window > 0 && !call->acquire_window(window, stop) ){
+            break;
+        }
+        int64_t now = cq_stats::now_ns();
+        std::memcpy(&payload[0], &now, sizeof(now));
+        msg.set_value(payload);
+        client_generic_bi_stream_rpc::serialize(msg, &buffer);
+        // 发送队列满时等待，不忙等
+        if( call->write(buffer, 100) >= 0 ){
+            sent.fetch_add(1, std::memory_order_relaxed);
+        } else if( window > 0 ){
+            call->release_window();
+        }
+    }
+}
+
+/// 运行seconds秒，期间有config.producers个生产者。
+static void run_producers(bench_call* call, const bench_config& config, size_t window, double seconds,
+                          std::atomic<uint64_t>& sent){
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> producers;
+    for( size_t i = 0; i < config.producers; ++i ){
+        producers.emplace_back([&](){
+            produce(call, config, window, stop, sent);
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000)));
+    stop.store(true);
+    for( auto& t : producers ){
+        t.join();
+    }
+}
+
+/// 吞吐量阶段：不限速，只统计seconds秒内收到的回显。
+static void run_throughput(bench_client& client, const bench_config& config, double seconds, bench_result& r){
+    bench_call* call = start_call(client, config.buffer);
+    std::atomic<uint64_t> sent(0);
+    uint64_t allocations_before = g_allocations.load();
+    auto begin = std::chrono::steady_clock::now();
+    run_producers(call, config, 0, seconds, sent);
+    auto end = std::chrono::steady_clock::now();
+    uint64_t received = call->received();
+    uint64_t bytes = call->bytes();
+    uint64_t allocations = g_allocations.load() - allocations_before;
+
+    r.sent = sent.load();
+    r.received = received;
+    r.seconds = std::chrono::duration<double>(end - begin).count();
+    r.msgs_per_sec = received / r.seconds;
+    r.mb_per_sec = bytes / r.seconds / (1024.0 * 1024.0);
+    r.allocs_per_msg = received == 0 ? 0 : static_cast<double>(allocations) / received;
+
+    // 排空积压，避免影响下一个阶段；最多等seconds秒，不计入结果
+    auto drain_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000));
+    while( call->received() < r.sent && std::chrono::steady_clock::now() < drain_deadline ){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    stop_call(call);
+}
+
+/// 延迟阶段：在途的消息不超过config.window个，测得的是往返延迟而不是队列积压。
+static void run_latency(bench_client& client, const bench_config& config, double seconds, bench_result& r){
+    bench_call* call = start_call(client, config.buffer);
+    std::atomic<uint64_t> sent(0);
+    run_producers(call, config, std::max<size_t>(config.window, 1), seconds, sent);
+    // 在途的消息不超过window个，很快就能收齐
+    auto drain_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while( call->received() < sent.load() && std::chrono::steady_clock::now() < drain_deadline ){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    stop_call(call);
+
+    histogram_snapshot latency;
+    latency.add(call->latency());
+    r.latency_samples = latency.count();
+    r.p50_us = latency.percentile(0.5) / 1000.0;
+    r.p99_us = latency.percentile(0.99) / 1000.0;
+    r.p999_us = latency.percentile(0.999) / 1000.0;
+}
+
+static bench_result run_one(bench_client& client, const bench_config& config, double seconds){
+    bench_result r;
+    r.config = config;
+    run_throughput(client, config, seconds, r);
+    run_latency(client, config, seconds, r);
+    return r;
+}
+
+// ---------------------------------------------------------------------------
+// 协程客户端（coro_call）：一问一答，测往返延迟。编译器不支持C++20协程时没有这个用例。
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+struct coro_result{
+    std::atomic<bool> done{false};
+    bool started = false;
+    uint64_t round_trips = 0;
+    log_histogram latency;
+};
+
+/// 写一个带发送时间的消息，等回显，直到deadline；之后取消调用，等它结束。
+/// result->done在调用对象析构之后才置位，主线程看到后不会再有事件访问调用。
+static coro_task coro_ping_pong(bench_client* client, size_t size,
+                                std::chrono::steady_clock::time_point deadline, coro_result* result){
+    {
+        coro_call<grpc::GenericClientAsyncReaderWriter, bench_client> call(client);
+        result->started = co_await call.start([client](grpc::ClientContext* ctx, grpc::CompletionQueue* cq){
+            return client->stub()->PrepareCall(ctx, bench_method, cq);
+        });
+        if( result->started ){
+            BytesValue msg;
+            std::string payload(std::max(size, sizeof(int64_t)), 'x');
+            grpc::ByteBuffer request;
+            grpc::ByteBuffer response;
+            while( std::chrono::steady_clock::now() < deadline ){
+                int64_t now = cq_stats::now_ns();
+                std::memcpy(&payload[0], &now, sizeof(now));
+                msg.set_value(payload);
+                client_generic_bi_stream_rpc::serialize(msg, &request);
+                if( !co_await call.write(request) || !co_await call.read(&response) ){
+                    break;
+                }
+                result->latency.record(static_cast<uint64_t>(cq_stats::now_ns() - now));
+                ++result->round_trips;
+            }
+            call.cancel();
+            grpc::Status status;
+            co_await call.finish(&status);
+        }
+    }
+    result->done.store(true);
+}
+
+static void run_coro(bench_client& client, size_t size, double seconds, bool& first){
+    coro_result result;
+    auto begin = std::chrono::steady_clock::now();
+    coro_ping_pong(&client, size, begin + std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000)), &result);
+    while( !result.done.load() ){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    histogram_snapshot latency;
+    latency.add(result.latency);
+    std::fprintf(stderr, "coro size=%zu ... %llu round trips p50=%.1fus\n", size,
+                 static_cast<unsigned long long>(result.round_trips), latency.percentile(0.5) / 1000.0);
+    std::printf("%s  {\"case\": \"coro\", \"size\": %zu, \"started\": %s, \"round_trips\": %llu, \"seconds\": %.3f, "
+                "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}",
+                first ? "" : ",\n", size, result.started ? "true" : "false",
+                static_cast<unsigned long long>(result.round_trips), elapsed,
+                latency.percentile(0.5) / 1000.0, latency.percentile(0.99) / 1000.0, latency.percentile(0.999) / 1000.0);
+    std::fflush(stdout);
+    first = false;
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// 进程内的微基准：writer直接写到模拟的流，不经过gRPC，由一个线程模拟完成队列
+
+/// 模拟的流：Write()立即完成，由模拟完成队列的线程回调writer::process()。
+template<typename W>
+struct null_stream{
+    std::atomic<bool> pending{false};
+    void Write(const W&, void*){
+        pending.store(true, std::memory_order_release);
+    }
+    void Finish(const grpc::Status&, void*){}
+};
+
+class null_callback : public writer_callback{
+public:
+    virtual void on_write(int) override{
+        ++written;
+    }
+    virtual void on_write_error() override {}
+
+    uint64_t written = 0;   // 只在模拟完成队列的线程中修改
+};
+
+/// 模拟完成队列的线程：写操作完成后回调process()。stop为true（生产者都已退出）之后，写完队列中的数据再返回。
+template<typename STREAM, typename WRITER>
+static void complete_writes(STREAM& stream, WRITER& w, const std::atomic<bool>& stop){
+    while( true ){
+        if( stream.pending.exchange(false, std::memory_order_acq_rel) ){
+            w.process();
+        } else if( stop.load() ){
+            return;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+/// producers个线程同时write()，发送队列满时让出CPU后重试；一个线程模拟完成队列。
+/// seconds秒后停止生产，等完成队列的线程写完队列中的数据后返回。
+/// \param elapsed 输出从开始到生产者都退出的秒数。
+/// \return write()成功的次数。
+template<typename STREAM, typename WRITER>
+static uint64_t drive_writer(STREAM& stream, WRITER& w, size_t size, size_t producers, double seconds, double* elapsed){
+    std::atomic<bool> stop(false);
+    std::atomic<bool> consumer_stop(false);
+    std::atomic<uint64_t> writes(0);
+    std::thread consumer([&](){
+        complete_writes(stream, w, consumer_stop);
+    });
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for( size_t i = 0; i < producers; ++i ){
+        threads.emplace_back([&](){
+            BytesValue msg;
+            msg.set_value(std::string(size, 'x'));
+            uint64_t count = 0;
+            while( !stop.load(std::memory_order_relaxed) ){
+                if( w.write(msg) >= 0 ){
+                    ++count;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+            writes.fetch_add(count);
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000)));
+    stop.store(true);
+    for( auto& t : threads ){
+        t.join();
+    }
+    *elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    consumer_stop.store(true);
+    consumer.join();
+    return writes.load();
+}
+
+/// 改用无锁队列之前的writer，作为mpsc的对照：write()和process()共用一个互斥锁，
+/// 发送队列是std::list，每个数据new一个Arena，写完后delete。只保留基准测试用到的部分。
+template<typename W, typename WRITER>
+class list_writer{
+public:
+    list_writer(writer_callback* cb, WRITER& async_writer, size_t buf_size = 1024 * 1024 * 32)
+            : callback_(*cb), writer_impl_(async_writer)
+            , max_buffer_size_(buf_size), cur_buffer_size_(0), writing_(false), input_id(0), output_id(0) {}
+
+    ~list_writer(){
+        for( W* w : write_buffer_ ){
+            delete w->GetArena();
+        }
+    }
+
+    int write(const W& resp){
+        lock_t lock(mtx_);
+        if( cur_buffer_size_ >= max_buffer_size_ ){
+            return -1;
+        }
+        Arena* arena = new Arena();
+        W* w = Arena::CreateMessage<W>(arena);
+        *w = resp;
+        write_buffer_.push_back(w);
+        cur_buffer_size_ += arena->SpaceUsed();
+        if( !writing_ ){
+            writing_ = true;
+            writer_impl_.Write(*write_buffer_.front(), this);
+        }
+        return input_id++;
+    }
+
+    void process(){
+        lock_t lock(mtx_);
+        W* w = write_buffer_.front();
+        write_buffer_.pop_front();
+        Arena* arena = w->GetArena();
+        cur_buffer_size_ -= arena->SpaceUsed();
+        delete arena;
+
+        callback_.on_write(output_id++);
+
+        if( write_buffer_.size() > 0 ){
+            writer_impl_.Write(*write_buffer_.front(), this);
+        } else {
+            writing_ = false;
+        }
+    }
+
+private:
+    typedef std::mutex mutex_t;
+    typedef std::unique_lock<mutex_t> lock_t;
+    mutex_t mtx_;
+
+    writer_callback& callback_;
+    WRITER& writer_impl_;
+    std::list<W*> write_buffer_;
+    size_t max_buffer_size_;
+    size_t cur_buffer_size_;
+    bool writing_;
+    int input_id;
+    int output_id;
+};
+
+/// mpsc：producers个线程同时write()时发送队列的吞吐量。queue为"mpsc"时测writer（无锁队列），
+/// 为"mutex_list"时测list_writer（互斥锁+std::list），两者在同样的条件下对比。
+static void run_mpsc(const char* queue, size_t size, size_t producers, double seconds, bool& first){
+    null_stream<BytesValue> stream;
+    null_callback callback;
+    double elapsed = 0;
+    uint64_t writes = 0;
+    if( std::strcmp(queue, "mutex_list") == 0 ){
+        list_writer<BytesValue, null_stream<BytesValue>> w(&callback, stream);
+        writes = drive_writer(stream, w, size, producers, seconds, &elapsed);
+    } else {
+        writer<BytesValue, null_stream<BytesValue>> w(&callback, stream);
+        w.start();
+        writes = drive_writer(stream, w, size, producers, seconds, &elapsed);
+    }
+
+    std::fprintf(stderr, "mpsc queue=%s size=%zu producers=%zu ... %.0f msgs/s\n", queue, size, producers, writes / elapsed);
+    std::printf("%s  {\"case\": \"mpsc\", \"queue\": \"%s\", \"size\": %zu, \"producers\": %zu, \"seconds\": %.3f, "
+                "\"writes\": %llu, \"written\": %llu, \"msgs_per_sec\": %.1f}",
+                first ? "" : ",\n", queue, size, producers, elapsed,
+                static_cast<unsigned long long>(writes), static_cast<unsigned long long>(callback.written),
+                writes / elapsed);
+    std::fflush(stdout);
+    first = false;
+}
+
+/// 手动模式的回调：每个写操作完成后调用write_next()写出下一个数据。
+class manual_callback : public writer_callback{
+public:
+    typedef writer<BytesValue, null_stream<BytesValue>> writer_t;
+
+    virtual void on_write(int) override{
+        ++written;
+        target->write_next();
+    }
+    virtual void on_write_error() override {}
+
+    writer_t* target = nullptr;
+    uint64_t written = 0;   // 只在模拟完成队列的线程中修改
+};
+
+/// manual：set_auto(false)，由on_write()中的write_next()驱动发送。写完后written应等于writes，否则发送队列停滞了。
+static void run_manual(size_t size, size_t producers, double seconds, bool& first){
+    null_stream<BytesValue> stream;
+    manual_callback callback;
+    manual_callback::writer_t w(&callback, stream);
+    callback.target = &w;
+    w.set_auto(false);
+    w.start();
+
+    double elapsed = 0;
+    uint64_t writes = drive_writer(stream, w, size, producers, seconds, &elapsed);
+    bool stalled = callback.written != writes;
+
+    std::fprintf(stderr, "manual size=%zu producers=%zu ... %.0f msgs/s%s\n", size, producers, writes / elapsed,
+                 stalled ? " STALLED" : "");
+    std::printf("%s  {\"case\": \"manual\", \"size\": %zu, \"producers\": %zu, \"seconds\": %.3f, "
+                "\"writes\": %llu, \"written\": %llu, \"stalled\": %s, \"msgs_per_sec\": %.1f}",
+                first ? "" : ",\n", size, producers, elapsed,
+                static_cast<unsigned long long>(writes), static_cast<unsigned long long>(callback.written),
+                stalled ? "true" : "false", writes / elapsed);
+    std::fflush(stdout);
+    first = false;
+}
+
+/// arena：一个生产者写ListValue（只有数值，消息本身不申请堆内存），热身之后统计每次write()的堆内存分配次数。
+/// 稳态下发送队列的Arena都从arena_pool中复用，应该接近0。
+static void run_arena(size_t size, double seconds, bool& first){
+    null_stream<ListValue> stream;
+    null_callback callback;
+    writer<ListValue, null_stream<ListValue>> w(&callback, stream, 64 * 1024);
+    w.start();
+
+    std::atomic<bool> consumer_stop(false);
+    std::thread consumer([&](){
+        complete_writes(stream, w, consumer_stop);
+    });
+
+    ListValue msg;
+    size_t values = std::max<size_t>(size / 8, 1);
+    for( size_t i = 0; i < values; ++i ){
+        msg.add_values()->set_number_value(static_cast<double>(i));
+    }
+    auto write_until = [&](std::chrono::steady_clock::time_point deadline) -> uint64_t{
+        uint64_t count = 0;
+        while( std::chrono::steady_clock::now() < deadline ){
+            if( w.write(msg) >= 0 ){
+                ++count;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        return count;
+    };
+    // 热身：池中积累足够的Arena，初始内存块增长到能容纳消息
+    write_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(200));
+    uint64_t allocations_before = g_allocations.load();
+    uint64_t writes = write_until(std::chrono::steady_clock::now()
+                                  + std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000)));
+    uint64_t allocations = g_allocations.load() - allocations_before;
+    size_t pool_bytes = arena_pool::local().cached_bytes();
+    consumer_stop.store(true);
+    consumer.join();
+
+    double per_write = writes == 0 ? 0 : static_cast<double>(allocations) / writes;
+    std::fprintf(stderr, "arena size=%zu ... %.3f allocs/write\n", size, per_write);
+    std::printf("%s  {\"case\": \"arena\", \"size\": %zu, \"values\": %zu, \"writes\": %llu, "
+                "\"allocs_per_write\": %.4f, \"block_size\": %zu, \"pool_bytes\": %zu}",
+                first ? "" : ",\n", size, values, static_cast<unsigned long long>(writes),
+                per_write, arena_pool::local().block_size(), pool_bytes);
+    std::fflush(stdout);
+    first = false;
+}
+
+// ---------------------------------------------------------------------------
+
+static std::vector<std::string> parse_names(const char* text){
+    std::vector<std::string> names;
+    std::stringstream ss(text);
+    std::string item;
+    while( std::getline(ss, item, ',') ){
+        if( !item.empty() ){
+            names.push_back(item);
+        }
+    }
+    return names;
+}
+
+static bool has_case(const std::vector<std::string>& cases, const char* name){
+    return std::find(cases.begin(), cases.end(), name) != cases.end();
+}
+
+static std::vector<size_t> parse_list(const char* text){
+    std::vector<size_t> values;
+    std::stringstream ss(text);
+    std::string item;
+    while( std::getline(ss, item, ',') ){
+        if( !item.empty() ){
+            values.push_back(static_cast<size_t>(std::strtoull(item.c_str(), nullptr, 10)));
+        }
+    }
+    return values;
+}
+
+static bool parse_arg(const char* arg, const char* name, const char** value){
+    size_t length = std::strlen(name);
+    if( std::strncmp(arg, name, length) == 0 && arg[length] == '=' ){
+        *value = arg + length + 1;
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char** argv){
+    std::vector<std::string> cases = {"loopback"};
+    std::vector<size_t> sizes = {64, 1024, 16 * 1024, 256 * 1024, 1024 * 1024};
+    std::vector<size_t> producer_counts = {1, 4};
+    bool producers_set = false;
+    std::vector<size_t> buffers = {1024 * 1024, 32 * 1024 * 1024};
+    double seconds = 2;
+    size_t window = 1;
+    std::string port = "50901";
+
+    for( int i = 1; i < argc; ++i ){
+        const char* value;
+        if( parse_arg(argv[i], "--cases", &value) ){
+            cases = parse_names(value);
+        } else if( parse_arg(argv[i], "--sizes", &value) ){
+            sizes = parse_list(value);
+        } else if( parse_arg(argv[i], "--producers", &value) ){
+            producer_counts = parse_list(value);
+            producers_set = true;
+        } else if( parse_arg(argv[i], "--buffers", &value) ){
+            buffers = parse_list(value);
+        } else if( parse_arg(argv[i], "--seconds", &value) ){
+            seconds = std::atof(value);
+        } else if( parse_arg(argv[i], "--window", &value) ){
+            window = static_cast<size_t>(std::strtoull(value, nullptr, 10));
+        } else if( parse_arg(argv[i], "--port", &value) ){
+            port = value;
+        } else {
+            std::fprintf(stderr, "usage: %s [--cases=loopback,mpsc,manual,arena,coro] [--sizes=64,1024] [--producers=1,4] [--buffers=1048576] "
+                                 "[--seconds=2] [--window=1] [--port=50901]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    std::printf("[\n");
+    bool first = true;
+    if( has_case(cases, "mpsc") ){
+        // 没有指定--producers时按1、4、16个生产者对比
+        std::vector<size_t> mpsc_producers = producers_set ? producer_counts : std::vector<size_t>{1, 4, 16};
+        for( size_t size : sizes ){
+            for( size_t producers : mpsc_producers ){
+                run_mpsc("mutex_list", size, producers, seconds, first);
+                run_mpsc("mpsc", size, producers, seconds, first);
+            }
+        }
+    }
+    if( has_case(cases, "manual") ){
+        for( size_t size : sizes ){
+            for( size_t producers : producer_counts ){
+                run_manual(size, producers, seconds, first);
+            }
+        }
+    }
+    if( has_case(cases, "arena") ){
+        for( size_t size : sizes ){
+            run_arena(size, seconds, first);
+        }
+    }
+    if( !has_case(cases, "loopback") && !has_case(cases, "coro") ){
+        std::printf("\n]\n");
+        return 0;
+    }
+
+    std::string address = "127.0.0.1:" + port;
+    bench_server server;
+    if( !server.run(address, 1, 2) ){
+        return 1;
+    }
+    bench_client client;
+    client.run(address, 1, 1);
+    client.wait_ready();
+
+    if( has_case(cases, "coro") ){
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+        for( size_t size : sizes ){
+            run_coro(client, size, seconds, first);
+        }
+#else
+        std::fprintf(stderr, "coro: not compiled as C++20, skipped\n");
+#endif
+    }
+    for( size_t size : has_case(cases, "loopback") ? sizes : std::vector<size_t>() ){
+        for( size_t producers : producer_counts ){
+            for( size_t buffer : buffers ){
+                bench_config config = {size, producers, buffer, window};
+                std::fprintf(stderr, "size=%zu producers=%zu buffer=%zu ...", size, producers, buffer);
+                bench_result r = run_one(client, config, seconds);
+                std::fprintf(stderr, " %.0f msgs/s %.1f MB/s p99=%.1fus\n", r.msgs_per_sec, r.mb_per_sec, r.p99_us);
+
+                std::printf("%s  {\"case\": \"loopback\", \"size\": %zu, \"producers\": %zu, \"buffer\": %zu, \"sent\": %llu, \"received\": %llu, "
+                            "\"seconds\": %.3f, \"msgs_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"allocs_per_msg\": %.2f, "
+                            "\"window\": %zu, \"latency_samples\": %llu, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}",
+                            first ? "" : ",\n", size, producers, buffer,
+                            static_cast<unsigned long long>(r.sent), static_cast<unsigned long long>(r.received),
+                            r.seconds, r.msgs_per_sec, r.mb_per_sec, r.allocs_per_msg,
+                            window, static_cast<unsigned long long>(r.latency_samples), r.p50_us, r.p99_us, r.p999_us);
+                std::fflush(stdout);
+                first = false;
+            }
+        }
+    }
+    std::printf("\n]\n");
+    std::fflush(stdout);
+
+    // client_impl没有可以中断工作线程的退出方式，这里直接结束进程
+    std::_Exit(0);
+}
@@ -0,0 +1,45 @@
+//
+// Created by tnie on 2026/10/17.
+//
+// 编译检查：用只继承call_handler的HANDLER显式实例化每个生成的调用类，
+// 生成的模板（成员函数、stub和service的方法、框架的基类）有错误时这里编译失败。
+// protos/下增加了流式方法时，在这里补上对应的类。
+//
+
+#include "hellostreamingworld.async_call.h"
+#include "keyvaluestore.async_call.h"
+#include "route_guide.async_call.h"
+
+#include "grpc_framework/client_impl.h"
+#include "grpc_framework/server_impl.h"
+
+/// 什么也不做的HANDLER，所有回调使用call_handler的默认实现。
+struct check_handler : call_handler {};
+
+namespace hellostreamingworld {
+template class MultiGreeter_sayHello_client<check_handler>;
+template class MultiGreeter_sayHello_server<check_handler>;
+}  // namespace hellostreamingworld
+
+namespace keyvaluestore {
+template class KeyValueStore_GetValues_client<check_handler>;
+template class KeyValueStore_GetValues_server<check_handler>;
+}  // namespace keyvaluestore
+
+namespace routeguide {
+template class RouteGuide_ListFeatures_client<check_handler>;
+template class RouteGuide_ListFeatures_server<check_handler>;
+template class RouteGuide_RouteChat_client<check_handler>;
+template class RouteGuide_RouteChat_server<check_handler>;
+}  // namespace routeguide
+
+/// 生成的类只能通过client_impl和server_impl使用，这里也按实际的用法各构造一次。
+void async_call_check(client_impl<routeguide::RouteGuide>* client,
+                      server_impl<routeguide::RouteGuide::AsyncService>* server){
+    check_handler handler;
+    routeguide::Rectangle rect;
+    (new routeguide::RouteGuide_ListFeatures_client<check_handler>(client, &handler, rect))->start();
+    (new routeguide::RouteGuide_RouteChat_client<check_handler>(client, &handler))->start();
+    server->post(1, [&]{ return new routeguide::RouteGuide_ListFeatures_server<check_handler>(server, &handler); });
+    server->post(1, [&]{ return new routeguide::RouteGuide_RouteChat_server<check_handler>(server, &handler); });
+}
@@ -0,0 +1,457 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#ifndef QUOTE_SERVER_ASYNC_CALL_GENERATOR_H
+#define QUOTE_SERVER_ASYNC_CALL_GENERATOR_H
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/printer.h>
+
+#include <cctype>
+#include <map>
+#include <string>
+#include <vector>
+
+/// 为proto文件中的流式方法生成grpc_framework的调用类，输出到<name>.async_call.h。
+/// 每个服务端流方法生成<Service>_<Method>_client和<Service>_<Method>_server，双向流方法同样生成这两个类。
+/// 生成的类都是final的类模板，HANDLER（参见call_handler）在编译期确定，生成的类调用HANDLER的回调可以内联。
+/// 框架的reader、writer仍然通过虚函数reader_callback::on_read()、writer_callback::on_write()回调生成的类，
+/// 每读写一个消息仍有一次虚函数调用。
+/// 只依赖descriptor.h和printer.h，插件的入口见async_call_plugin.cpp。
+namespace async_call_generator{
+
+typedef std::map<std::string, std::string> vars_t;
+
+/// 按分隔符拆分。
+inline std::vector<std::string> split(const std::string& s, char delim){
+    std::vector<std::string> parts;
+    size_t begin = 0;
+    while( begin <= s.size() ){
+        size_t end = s.find(delim, begin);
+        if( end == std::string::npos ){
+            end = s.size();
+        }
+        if( end > begin ){
+            parts.push_back(s.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return parts;
+}
+
+/// proto文件名去掉扩展名，如"route_guide.proto"为"route_guide"。
+inline std::string strip_proto(const std::string& name){
+    const std::string ext = ".proto";
+    if( name.size() > ext.size() && name.compare(name.size() - ext.size(), ext.size(), ext) == 0 ){
+        return name.substr(0, name.size() - ext.size());
+    }
+    return name;
+}
+
+/// 生成的文件名。
+inline std::string file_name(const google::protobuf::FileDescriptor* file){
+    return strip_proto(file->name()) + ".async_call.h";
+}
+
+/// package对应的C++命名空间，如"routeguide"为"::routeguide"，没有package时为空。
+inline std::string cpp_namespace(const std::string& package){
+    std::string ns;
+    for( auto& part : split(package, '.') ){
+        ns += "::" + part;
+    }
+    return ns;
+}
+
+/// 服务对应的C++类型，如"routeguide.RouteGuide"为"::routeguide::RouteGuide"。
+inline std::string cpp_type(const google::protobuf::ServiceDescriptor* service){
+    return cpp_namespace(service->file()->package()) + "::" + service->name();
+}
+
+/// 消息对应的C++类型。与protoc的C++代码一致，嵌套的消息用下划线连接外层消息的名字，
+/// 如"pkg.Outer.Inner"为"::pkg::Outer_Inner"。
+inline std::string cpp_type(const google::protobuf::Descriptor* message){
+    std::string name = message->name();
+    for( const google::protobuf::Descriptor* outer = message->containing_type(); outer != nullptr;
+         outer = outer->containing_type() ){
+        name = outer->name() + "_" + name;
+    }
+    return cpp_namespace(message->file()->package()) + "::" + name;
+}
+
+/// 头文件的保护宏。
+inline std::string header_guard(const google::protobuf::FileDescriptor* file){
+    std::string guard = "ASYNC_CALL_";
+    for( char c : file->name() ){
+        guard += std::isalnum(static_cast<unsigned char>(c)) ? static_cast<char>(std::toupper(static_cast<unsigned char>(c))) : '_';
+    }
+    return guard + "_H";
+}
+
+/// 框架支持的流式方法：服务端流和双向流。客户端流和普通方法没有对应的调用类，不生成。
+inline bool is_supported(const google::protobuf::MethodDescriptor* method){
+    return method->server_streaming();
+}
+
+inline void print_client_uni(google::protobuf::io::Printer& p, vars_t& vars){
+    p.Print(vars,
+            "/// $service$.$method$的客户端调用（服务端流），由async_call_plugin生成。\n"
+            "/// \\li 构造后可以通过get_context()设置metadata、deadline等，然后调用start()。\n"
+            "/// \\li 回调HANDLER的on_start()、on_read(call, const $response_name$&)和on_finish()，on_finish()之后自行释放。\n"
+            "template<typename HANDLER>\n"
+            "class $class$_client final\n"
+            "        : public client_uni_stream_rpc<$request$, $response$>{\n"
+            "public:\n"
+            "    typedef client_uni_stream_rpc<$request$, $response$> super;\n"
+            "    typedef client_impl<$service_type$> client_t;\n"
+            "\n"
+            "    /// \\param client 客户端。\n"
+            "    /// \\param handler 回调，须在调用结束前一直有效。\n"
+            "    /// \\param req 请求。\n"
+            "    $class$_client(client_t* client, HANDLER* handler, const $request$& req)\n"
+            "            : client_(client), handler_(*handler), started_(false)\n"
+            "            , finish_status_(grpc::StatusCode::UNKNOWN, \"not finished\"){\n"
+            "        request = req;\n"
+            "    }\n"
+            "\n"
+            "    /// 发起调用。\n"
+            "    void start(){\n"
+            "        client_->add_tag({this});\n"
+            "        stream = client_->stub()->PrepareAsync$method$(&context, request, client_->cq());\n"
+            "        reader_.reset(new typename super::reader_t(this, *stream));\n"
+            "        client_->add_tag({reader_.get()});\n"
+            "        stream->StartCall(tag());\n"
+            "    }\n"
+            "\n"
+            "    grpc::ClientContext& get_context(){\n"
+            "        return context;\n"
+            "    }\n"
+            "\n"
+            "    /// 调用是否已经建立。没有建立时，on_finish()收到的状态是连接或发起调用的错误，不是服务端的回答。\n"
+            "    bool started() const{\n"
+            "        return started_;\n"
+            "    }\n"
+            "\n"
+            "    /// 保留当前读取到的数据，只能在on_read()中调用。\n"
+            "    read_handle<$response$> hold(){\n"
+            "        return reader_->hold();\n"
+            "    }\n"
+            "\n"
+            "    virtual void process() override{\n"
+            "        if( status == ClientRPCStatus::CREATE ){\n"
+            "            status = ClientRPCStatus::READ;\n"
+            "            started_ = true;\n"
+            "            handler_.on_start(*this);\n"
+            "            reader_->read();\n"
+            "        } else if( status == ClientRPCStatus::FINISH ){\n"
+            "            handler_.on_finish(*this, finish_status_);\n"
+            "            client_->remove_tag({this, reader_.get()});\n"
+            "            delete this;\n"
+            "        }\n"
+            "    }\n"
+            "\n"
+            "    virtual void on_read(void* message) override{\n"
+            "        handler_.on_read(*this, *static_cast<const $response$*>(message));\n"
+            "    }\n"
+            "\n"
+            "    /// 读取结束后取得调用的最终状态。\n"
+            "    virtual void on_read_error() override{\n"
+            "        status = ClientRPCStatus::FINISH;\n"
+            "        stream->Finish(&finish_status_, tag());\n"
+            "    }\n"
+            "\n"
+            "    /// 发起调用失败（如连接不上），同样取得调用的最终状态，on_finish()收到真实的错误。\n"
+            "    virtual void on_error() override{\n"
+            "        if( status == ClientRPCStatus::FINISH ){\n"
+            "            super::on_error();\n"
+            "            return;\n"
+            "        }\n"
+            "        status = ClientRPCStatus::FINISH;\n"
+            "        stream->Finish(&finish_status_, tag());\n"
+            "    }\n"
+            "\n"
+            "private:\n"
+            "    client_t* client_;\n"
+            "    HANDLER& handler_;\n"
+            "    bool started_;\n"
+            "    grpc::Status finish_status_;\n"
+            "};\n"
+            "\n");
+}
+
+inline void print_client_bi(google::protobuf::io::Printer& p, vars_t& vars){
+    p.Print(vars,
+            "/// $service$.$method$的客户端调用（双向流），由async_call_plugin生成。\n"
+            "/// \\li 构造后可以通过get_context()设置metadata、deadline等，然后调用start()。on_start()之后才能write()。\n"
+            "/// \\li 回调HANDLER的on_prepare()（可以通过get_writer()设置发送队列）、on_start()、on_read(call, const $response_name$&)、\n"
+            "/// on_write()和on_finish()，on_finish()之后自行释放。\n"
+            "template<typename HANDLER>\n"
+            "class $class$_client final\n"
+            "        : public client_bi_stream_rpc<$request$, $response$>{\n"
+            "public:\n"
+            "    typedef client_bi_stream_rpc<$request$, $response$> super;\n"
+            "    typedef client_impl<$service_type$> client_t;\n"
+            "\n"
+            "    /// \\param client 客户端。\n"
+            "    /// \\param handler 回调，须在调用结束前一直有效。\n"
+            "    $class$_client(client_t* client, HANDLER* handler)\n"
+            "            : client_(client), handler_(*handler), started_(false)\n"
+            "            , finish_status_(grpc::StatusCode::UNKNOWN, \"not finished\") {}\n"
+            "\n"
+            "    /// 发起调用。\n"
+            "    void start(){\n"
+            "        stream = client_->stub()->PrepareAsync$method$(&context, client_->cq());\n"
+            "        reader_.reset(new typename super::reader_t(this, *stream));\n"
+            "        writer_.reset(new typename super::writer_t(this, *stream));\n"
+            "        handler_.on_prepare(*this);\n"
+            "        client_->add_tag({this, reader_.get(), writer_.get()});\n"
+            "        stream->StartCall(tag());\n"
+            "    }\n"
+            "\n"
+            "    grpc::ClientContext& get_context(){\n"
+            "        return context;\n"
+            "    }\n"
+            "\n"
+            "    /// 调用是否已经建立。没有建立时，on_finish()收到的状态是连接或发起调用的错误，不是服务端的回答。\n"
+            "    bool started() const{\n"
+            "        return started_;\n"
+            "    }\n"
+            "\n"
+            "    /// 发送队列，只能在on_prepare()中设置（set_merge()、set_lanes()等）。\n"
+            "    typename super::writer_t& get_writer(){\n"
+            "        return *writer_;\n"
+            "    }\n"
+            "\n"
+            "    /// 保留当前读取到的数据，只能在on_read()中调用。\n"
+            "    read_handle<$response$> hold(){\n"
+            "        return reader_->hold();\n"
+            "    }\n"
+            "\n"
+            "    virtual void process() override{\n"
+            "        if( status == ClientRPCStatus::CREATE ){\n"
+            "            status = ClientRPCStatus::WORKING;\n"
+            "            started_ = true;\n"
+            "            writer_->start();\n"
+            "            handler_.on_start(*this);\n"
+            "            reader_->read();\n"
+            "        } else if( status == ClientRPCStatus::FINISH ){\n"
+            "            handler_.on_finish(*this, finish_status_);\n"
+            "            client_->remove_tag({this, reader_.get(), writer_.get()});\n"
+            "            delete this;\n"
+            "        }\n"
+            "    }\n"
+            "\n"
+            "    virtual void on_read(void* message) override{\n"
+            "        handler_.on_read(*this, *static_cast<const $response$*>(message));\n"
+            "    }\n"
+            "\n"
+            "    /// 服务端结束或者断开，停止发送并取得调用的最终状态。\n"
+            "    virtual void on_read_error() override{\n"
+            "        status = ClientRPCStatus::FINISH;\n"
+            "        writer_->stop();\n"
+            "        stream->Finish(&finish_status_, tag());\n"
+            "    }\n"
+            "\n"
+            "    /// 发起调用失败（如连接不上），同样停止发送并取得调用的最终状态，on_finish()收到真实的错误。\n"
+            "    virtual void on_error() override{\n"
+            "        if( status == ClientRPCStatus::FINISH ){\n"
+            "            super::on_error();\n"
+            "            return;\n"
+            "        }\n"
+            "        status = ClientRPCStatus::FINISH;\n"
+            "        writer_->stop();\n"
+            "        stream->Finish(&finish_status_, tag());\n"
+            "    }\n"
+            "\n"
+            "    virtual void on_write(int write_id) override{\n"
+            "        handler_.on_write(*this, write_id);\n"
+            "    }\n"
+            "\n"
+            "    /// 写失败时取消调用，等读取失败后在on_read_error()中结束。\n"
+            "    virtual void on_write_error() override{\n"
+            "        context.TryCancel();\n"
+            "    }\n"
+            "\n"
+            "private:\n"
+            "    client_t* client_;\n"
+            "    HANDLER& handler_;\n"
+            "    bool started_;\n"
+            "    grpc::Status finish_status_;\n"
+            "};\n"
+            "\n");
+}
+
+inline void print_server_uni(google::protobuf::io::Printer& p, vars_t& vars){
+    p.Print(vars,
+            "/// $service$.$method$的服务端调用（服务端流），由async_call_plugin生成。\n"
+            "/// \\li 用server_impl::post()投递，如server.post(n, [&]{ return new $class$_server<H>(&server, &handler); })。\n"
+            "/// \\li 接受后回调HANDLER的on_start()，在其中根据get_request()写出，最后调用finish()；结束时回调on_done()。\n"
+            "template<typename HANDLER>\n"
+            "class $class$_server final\n"
+            "        : public server_uni_stream_rpc<$service_type$::AsyncService, $request$, $response$>{\n"
+            "public:\n"
+            "    typedef server_uni_stream_rpc<$service_type$::AsyncService, $request$, $response$> super;\n"
+            "\n"
+            "    /// \\param server 服务端。\n"
+            "    /// \\param handler 回调，所有调用共用，须在服务端退出前一直有效。\n"
+            "    $class$_server(typename super::server_t* server, HANDLER* handler)\n"
+            "            : super(server), handler_(*handler) {}\n"
+            "\n"
+            "    const $request$& get_request() const{\n"
+            "        return this->request;\n"
+            "    }\n"
+            "\n"
+            "    grpc::ServerContext& get_context(){\n"
+            "        return this->context;\n"
+            "    }\n"
+            "\n"
+            "    virtual void on_write(int write_id) override{\n"
+            "        handler_.on_write(*this, write_id);\n"
+            "    }\n"
+            "\n"
+            "protected:\n"
+            "    virtual void request_call(grpc::ServerCompletionQueue* cq) override{\n"
+            "        this->server_->service()->Request$method$(&this->context, &this->request, &this->responder, cq, cq, this->tag());\n"
+            "    }\n"
+            "\n"
+            "    virtual server_rpc_base* create() override{\n"
+            "        return new $class$_server(this->server_, &handler_);\n"
+            "    }\n"
+            "\n"
+            "    virtual void on_accept() override{\n"
+            "        super::on_accept();\n"
+            "        handler_.on_start(*this);\n"
+            "    }\n"
+            "\n"
+            "    virtual void on_done() override{\n"
+            "        super::on_done();\n"
+            "        handler_.on_done(*this);\n"
+            "    }\n"
+            "\n"
+            "private:\n"
+            "    HANDLER& handler_;\n"
+            "};\n"
+            "\n");
+}
+
+inline void print_server_bi(google::protobuf::io::Printer& p, vars_t& vars){
+    p.Print(vars,
+            "/// $service$.$method$的服务端调用（双向流），由async_call_plugin生成。\n"
+            "/// \\li 用server_impl::post()投递，如server.post(n, [&]{ return new $class$_server<H>(&server, &handler); })。\n"
+            "/// \\li 回调HANDLER的on_start()、on_read(call, const $request_name$&)、on_write()和on_done()。客户端结束写后以OK结束调用。\n"
+            "template<typename HANDLER>\n"
+            "class $class$_server final\n"
+            "        : public server_bi_stream_rpc<$service_type$::AsyncService, $request$, $response$>{\n"
+            "public:\n"
+            "    typedef server_bi_stream_rpc<$service_type$::AsyncService, $request$, $response$> super;\n"
+            "\n"
+            "    /// \\param server 服务端。\n"
+            "    /// \\param handler 回调，所有调用共用，须在服务端退出前一直有效。\n"
+            "    $class$_server(typename super::server_t* server, HANDLER* handler)\n"
+            "            : super(server), handler_(*handler) {}\n"
+            "\n"
+            "    grpc::ServerContext& get_context(){\n"
+            "        return this->context;\n"
+            "    }\n"
+            "\n"
+            "    /// 保留当前读取到的数据，只能在on_read()中调用。\n"
+            "    read_handle<$request$> hold(){\n"
+            "        return this->reader_->hold();\n"
+            "    }\n"
+            "\n"
+            "    virtual void on_read(void* req_ptr) override{\n"
+            "        handler_.on_read(*this, *static_cast<const $request$*>(req_ptr));\n"
+            "    }\n"
+            "\n"
+            "    virtual void on_write(int write_id) override{\n"
+            "        handler_.on_write(*this, write_id);\n"
+            "    }\n"
+            "\n"
+            "protected:\n"
+            "    virtual void request_call(grpc::ServerCompletionQueue* cq) override{\n"
+            "        this->server_->service()->Request$method$(&this->context, &this->responder, cq, cq, this->tag());\n"
+            "    }\n"
+            "\n"
+            "    virtual server_rpc_base* create() override{\n"
+            "        return new $class$_server(this->server_, &handler_);\n"
+            "    }\n"
+            "\n"
+            "    virtual void on_accept() override{\n"
+            "        super::on_accept();\n"
+            "        handler_.on_start(*this);\n"
+            "    }\n"
+            "\n"
+            "    virtual void on_done() override{\n"
+            "        super::on_done();\n"
+            "        handler_.on_done(*this);\n"
+            "    }\n"
+            "\n"
+            "private:\n"
+            "    HANDLER& handler_;\n"
+            "};\n"
+            "\n");
+}
+
+/// 生成整个文件。
+inline void generate(const google::protobuf::FileDescriptor* file, google::protobuf::io::Printer& p){
+    vars_t vars;
+    vars["source"] = file->name();
+    vars["guard"] = header_guard(file);
+    vars["grpc_header"] = strip_proto(file->name()) + ".grpc.pb.h";
+    p.Print(vars,
+            "// Generated by async_call_plugin. DO NOT EDIT!\n"
+            "// source: $source$\n"
+            "\n"
+            "#ifndef $guard$\n"
+            "#define $guard$\n"
+            "\n"
+            "#include \"$grpc_header$\"\n"
+            "#include \"grpc_framework/call_handler.h\"\n"
+            "#include \"grpc_framework/client_rpc.h\"\n"
+            "#include \"grpc_framework/server_rpc.h\"\n"
+            "\n");
+
+    std::vector<std::string> ns = split(file->package(), '.');
+    for( auto& part : ns ){
+        p.Print("namespace $part$ {\n", "part", part);
+    }
+    if( !ns.empty() ){
+        p.Print("\n");
+    }
+
+    for( int i = 0; i < file->service_count(); ++i ){
+        const google::protobuf::ServiceDescriptor* service = file->service(i);
+        for( int j = 0; j < service->method_count(); ++j ){
+            const google::protobuf::MethodDescriptor* method = service->method(j);
+            if( !is_supported(method) ){
+                continue;
+            }
+            vars["service"] = service->name();
+            vars["service_type"] = cpp_type(service);
+            vars["method"] = method->name();
+            vars["class"] = service->name() + "_" + method->name();
+            vars["request"] = cpp_type(method->input_type());
+            vars["request_name"] = method->input_type()->name();
+            vars["response"] = cpp_type(method->output_type());
+            vars["response_name"] = method->output_type()->name();
+            if( method->client_streaming() ){
+                print_client_bi(p, vars);
+                print_server_bi(p, vars);
+            } else {
+                print_client_uni(p, vars);
+                print_server_uni(p, vars);
+            }
+        }
+    }
+
+    for( auto it = ns.rbegin(); it != ns.rend(); ++it ){
+        p.Print("}  // namespace $part$\n", "part", *it);
+    }
+    p.Print(vars,
+            "\n"
+            "#endif //$guard$\n");
+}
+
+} // namespace async_call_generator
+
+#endif //QUOTE_SERVER_ASYNC_CALL_GENERATOR_H
@@ -0,0 +1,35 @@
+//
+// Created by tnie on 2026/10/16.
+//
+
+#include "async_call_generator.h"
+
+#include <google/protobuf/compiler/code_generator.h>
+#include <google/protobuf/compiler/plugin.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include <memory>
+
+using google::protobuf::FileDescriptor;
+using google::protobuf::compiler::CodeGenerator;
+using google::protobuf::compiler::GeneratorContext;
+using google::protobuf::io::Printer;
+using google::protobuf::io::ZeroCopyOutputStream;
+
+/// protoc插件，为每个proto文件生成<name>.async_call.h，参见async_call_generator::generate()。
+/// protoc --plugin=protoc-gen-async_call=async_call_plugin --async_call_out=<dir> <name>.proto
+class async_call_code_generator : public CodeGenerator{
+public:
+    virtual bool Generate(const FileDescriptor* file, const std::string& parameter,
+                          GeneratorContext* context, std::string* error) const override{
+        std::unique_ptr<ZeroCopyOutputStream> output(context->Open(async_call_generator::file_name(file)));
+        Printer printer(output.get(), '$');
+        async_call_generator::generate(file, printer);
+        return true;
+    }
+};
+
+int main(int argc, char* argv[]){
+    async_call_code_generator generator;
+    return google::protobuf::compiler::PluginMain(argc, argv, &generator);
+}
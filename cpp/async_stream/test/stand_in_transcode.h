@@ -0,0 +1,91 @@
+//
+// Created by tnie on 2026/10/17.
+//
+// 回环测试共用的部分：行情的序号、请求的metadata、等待存储写入。
+//
+
+#ifndef QUOTE_SERVER_STAND_IN_TRANSCODE_H
+#define QUOTE_SERVER_STAND_IN_TRANSCODE_H
+
+#include "quote_store.h"
+#include "transcode.grpc.pb.h"
+
+#include <grpc++/server_context.h>
+#include <google/protobuf/unknown_field_set.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// 序号放在MultiQuote的未知字段中，不依赖data_define.proto的具体字段。
+static const int seq_field = 1000;
+
+inline void set_seq(MultiQuote* quotes, uint64_t seq){
+    quotes->GetReflection()->MutableUnknownFields(quotes)->AddVarint(seq_field, seq);
+}
+
+inline uint64_t get_seq(const MultiQuote& quotes){
+    const google::protobuf::UnknownFieldSet& fields = quotes.GetReflection()->GetUnknownFields(quotes);
+    for( int i = 0; i < fields.field_count(); ++i ){
+        if( fields.field(i).number() == seq_field
+            && fields.field(i).type() == google::protobuf::UnknownField::TYPE_VARINT ){
+            return fields.field(i).varint();
+        }
+    }
+    return 0;
+}
+
+/// 写出一个序号为seq的行情。
+inline void write_seq(grpc::ServerWriter<MultiQuote>* writer, uint64_t seq){
+    MultiQuote quotes;
+    set_seq(&quotes, seq);
+    writer->Write(quotes);
+}
+
+/// 请求的metadata中key对应的序号，没有时返回0。
+inline uint64_t get_metadata(grpc::ServerContext* context, const char* key){
+    auto it = context->client_metadata().find(key);
+    if( it == context->client_metadata().end() ){
+        return 0;
+    }
+    return std::strtoull(std::string(it->second.data(), it->second.size()).c_str(), nullptr, 10);
+}
+
+/// 等待存储中至少有count个行情，最多等待timeout。
+/// \return 是否等到。
+inline bool wait_quotes(const memory_quote_store& store, size_t count, std::chrono::milliseconds timeout){
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while( store.quotes().size() < count ){
+        if( std::chrono::steady_clock::now() >= deadline ){
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+/// 存储中是否按顺序恰好是序号1到count，每个一次。
+inline bool quotes_in_order(const memory_quote_store& store, size_t count){
+    std::vector<MultiQuote> quotes = store.quotes();
+    if( quotes.size() != count ){
+        return false;
+    }
+    for( size_t i = 0; i < quotes.size(); ++i ){
+        if( get_seq(quotes[i]) != i + 1 ){
+            return false;
+        }
+    }
+    return true;
+}
+
+inline int fail(const char* what){
+    std::fprintf(stderr, "FAILED: %s\n", what);
+    // client_impl没有可以中断进行中调用的退出方式，这里直接结束进程
+    std::_Exit(1);
+}
+
+#endif //QUOTE_SERVER_STAND_IN_TRANSCODE_H
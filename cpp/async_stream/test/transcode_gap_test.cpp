@@ -0,0 +1,116 @@
+//
+// Created by tnie on 2026/10/17.
+//
+// transcode_client补取缺口的回环测试。
+// 进程内启动一个代替Transcode的服务端，推送序号1-3之后跳到10、11，客户端应补取[4, 9]。
+// 第一次补取只发出4-6，等客户端写入4-6后中断流（TryCancel），客户端不能放弃缺口，应当从7重新补取；
+// 第二次补取发完7-9后正常结束。最后存储中应按顺序写入1-11，每个序号一次。
+// 成功时返回0。
+//
+
+#include "stand_in_transcode.h"
+#include "transcode_client.h"
+#include "transcode_call.h"
+
+#include <grpc++/server.h>
+#include <grpc++/server_builder.h>
+
+#include <algorithm>
+#include <mutex>
+#include <utility>
+
+/// 代替Transcode的服务端。
+class stand_in_transcode : public Transcode::Service{
+public:
+    explicit stand_in_transcode(const memory_quote_store& store): store_(store) {}
+
+    virtual Status PushQuote(grpc::ServerContext* context, const EmptyMessage* request,
+                             grpc::ServerWriter<MultiQuote>* writer) override{
+        uint64_t from = get_metadata(context, push_quote_handler::resume_from_key);
+        uint64_t to = get_metadata(context, push_quote_handler::resume_to_key);
+        if( to == 0 ){
+            // 实时推送：1-3，跳过4-9，然后10、11，之后保持调用直到客户端退出
+            for( uint64_t seq : {1, 2, 3, 10, 11} ){
+                write_seq(writer, seq);
+            }
+            while( !context->IsCancelled() ){
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            return Status::OK;
+        }
+
+        int attempt;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ranges_.push_back(std::make_pair(from, to));
+            attempt = static_cast<int>(ranges_.size());
+        }
+        if( attempt == 1 ){
+            // 第一次补取：只发出区间的前3个，客户端写入之后再中断流。
+            // Write()返回时客户端不一定已经读到，立即中断时客户端可能只收到一部分，重新补取的起点不确定
+            uint64_t last = std::min(from + 2, to);
+            for( uint64_t seq = from; seq <= last; ++seq ){
+                write_seq(writer, seq);
+            }
+            wait_quotes(store_, static_cast<size_t>(last), std::chrono::seconds(5));
+            context->TryCancel();
+            return Status::CANCELLED;
+        }
+        for( uint64_t seq = from; seq <= to; ++seq ){
+            write_seq(writer, seq);
+        }
+        return Status::OK;
+    }
+
+    /// 收到的补取请求。
+    std::vector<std::pair<uint64_t, uint64_t>> ranges(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        return ranges_;
+    }
+
+private:
+    const memory_quote_store& store_;
+    std::mutex mutex_;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges_;
+};
+
+int main(int argc, char** argv){
+    std::string address = "127.0.0.1:" + std::string(argc > 1 ? argv[1] : "50911");
+
+    std::shared_ptr<memory_quote_store> store = std::make_shared<memory_quote_store>();
+    stand_in_transcode service(*store);
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+    builder.RegisterService(&service);
+    std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+    if( !server ){
+        return fail("cannot start the stand-in server");
+    }
+
+    transcode_client client;
+    client.set_sequence_getter(get_seq);
+    client.set_quote_store(store, 1, 1);
+    client.run(address);
+
+    const size_t expected = 11;
+    wait_quotes(*store, expected, std::chrono::seconds(10));
+    // 多等一会儿，确认没有重复写入
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges = service.ranges();
+    std::fprintf(stderr, "applied %zu quotes, %zu range calls\n", store->quotes().size(), ranges.size());
+    for( auto& range : ranges ){
+        std::fprintf(stderr, "  range %llu - %llu\n",
+                     static_cast<unsigned long long>(range.first), static_cast<unsigned long long>(range.second));
+    }
+
+    if( !quotes_in_order(*store, expected) ){
+        return fail("quotes lost, duplicated or applied out of order");
+    }
+    if( ranges.size() != 2 || ranges[0] != std::make_pair<uint64_t, uint64_t>(4, 9)
+        || ranges[1] != std::make_pair<uint64_t, uint64_t>(7, 9) ){
+        return fail("gap not re-requested from where the killed range call stopped");
+    }
+    std::fprintf(stderr, "PASSED\n");
+    std::_Exit(0);
+}
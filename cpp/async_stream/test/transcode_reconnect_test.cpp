@@ -0,0 +1,122 @@
+//
+// Created by tnie on 2026/10/17.
+//
+// transcode_client断线续传的回环测试。
+// 进程内启动一个代替Transcode的服务端，实时推送序号1-3；客户端写入后关闭服务端，断开连接和实时推送的调用，
+// 再在同一端口启动新的服务端。ReconnectMode::IN_PLACE重连后，客户端应在实时推送的请求中带上resume-from=4
+// （不带resume-to），新的服务端从4续传到6。最后存储中应按顺序写入1-6，每个序号一次。
+// 成功时返回0。
+//
+
+#include "stand_in_transcode.h"
+#include "transcode_client.h"
+#include "transcode_call.h"
+
+#include <grpc++/server.h>
+#include <grpc++/server_builder.h>
+
+#include <algorithm>
+#include <mutex>
+#include <utility>
+
+/// 代替Transcode的服务端。没有resume-from时从1开始推送，否则从resume-from续传，推送到last后保持调用。
+class stand_in_transcode : public Transcode::Service{
+public:
+    explicit stand_in_transcode(uint64_t last): last_(last) {}
+
+    virtual Status PushQuote(grpc::ServerContext* context, const EmptyMessage* request,
+                             grpc::ServerWriter<MultiQuote>* writer) override{
+        uint64_t from = get_metadata(context, push_quote_handler::resume_from_key);
+        uint64_t to = get_metadata(context, push_quote_handler::resume_to_key);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            calls_.push_back(std::make_pair(from, to));
+        }
+        for( uint64_t seq = std::max<uint64_t>(from, 1); seq <= last_; ++seq ){
+            write_seq(writer, seq);
+        }
+        while( !context->IsCancelled() ){
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return Status::OK;
+    }
+
+    /// 收到的调用的resume-from和resume-to，没有时为0。
+    std::vector<std::pair<uint64_t, uint64_t>> calls(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        return calls_;
+    }
+
+private:
+    uint64_t last_;
+    std::mutex mutex_;
+    std::vector<std::pair<uint64_t, uint64_t>> calls_;
+};
+
+static std::unique_ptr<grpc::Server> start_server(const std::string& address, stand_in_transcode* service){
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+    builder.RegisterService(service);
+    return builder.BuildAndStart();
+}
+
+static void print_calls(const char* name, const std::vector<std::pair<uint64_t, uint64_t>>& calls){
+    for( auto& call : calls ){
+        std::fprintf(stderr, "  %s resume %llu - %llu\n", name,
+                     static_cast<unsigned long long>(call.first), static_cast<unsigned long long>(call.second));
+    }
+}
+
+int main(int argc, char** argv){
+    std::string address = "127.0.0.1:" + std::string(argc > 1 ? argv[1] : "50912");
+
+    stand_in_transcode first(3);
+    std::unique_ptr<grpc::Server> server = start_server(address, &first);
+    if( !server ){
+        return fail("cannot start the stand-in server");
+    }
+
+    std::shared_ptr<memory_quote_store> store = std::make_shared<memory_quote_store>();
+    transcode_client client;
+    client.set_sequence_getter(get_seq);
+    client.set_quote_store(store, 1, 1);
+    client.run(address);
+
+    if( !wait_quotes(*store, 3, std::chrono::seconds(10)) ){
+        return fail("live quotes not received");
+    }
+
+    // 关闭服务端：取消进行中的实时推送，连接断开
+    server->Shutdown(std::chrono::system_clock::now() + std::chrono::milliseconds(100));
+    server.reset();
+
+    stand_in_transcode second(6);
+    server = start_server(address, &second);
+    if( !server ){
+        return fail("cannot restart the stand-in server");
+    }
+
+    const size_t expected = 6;
+    wait_quotes(*store, expected, std::chrono::seconds(10));
+    // 多等一会儿，确认没有重复写入
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    std::vector<std::pair<uint64_t, uint64_t>> before = first.calls();
+    std::vector<std::pair<uint64_t, uint64_t>> after = second.calls();
+    std::fprintf(stderr, "applied %zu quotes, %zu calls before and %zu after the restart\n",
+                 store->quotes().size(), before.size(), after.size());
+    print_calls("before", before);
+    print_calls("after", after);
+
+    if( before.size() != 1 || before[0] != std::make_pair<uint64_t, uint64_t>(0, 0) ){
+        return fail("first live call should not resume");
+    }
+    if( after.empty() || after[0] != std::make_pair<uint64_t, uint64_t>(4, 0) ){
+        return fail("reconnected live call should resume from 4 without resume-to");
+    }
+    if( !quotes_in_order(*store, expected) ){
+        return fail("quotes lost, duplicated or applied out of order");
+    }
+    std::fprintf(stderr, "PASSED\n");
+    std::_Exit(0);
+}
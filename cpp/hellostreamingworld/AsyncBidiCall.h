@@ -1,44 +1,132 @@
 ﻿#pragma once
-#include <boost\uuid\uuid.hpp>
-#include <boost\uuid\uuid_io.hpp>
-#include <boost\uuid\random_generator.hpp>
-#include <fmt\chrono.h>
+#include <fmt/chrono.h>
+#include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <chrono>
 #include <condition_variable>
-#include <queue>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <thread>
-#include <spdlog\spdlog.h>
+#include <typeinfo>
+#include <unordered_set>
+#include <vector>
+#include <spdlog/spdlog.h>
 #include <exception>
 #include "hellostreamingworld.pb.h"
 #include "hellostreamingworld.grpc.pb.h"
 
-#pragma comment(lib, "bcrypt.lib")
+// 日志级别未开启时跳过格式化，避免每条消息都调用 DebugString()
+inline bool should_log(spdlog::level::level_enum level)
+{
+    return spdlog::default_logger_raw()->should_log(level);
+}
+
+// completion queue 中 tag 的公共接口，cq 线程取出 tag 后调用其 HandleResponse()
+class AsyncTag
+{
+public:
+    virtual ~AsyncTag() = default;
+    //除了在 completion queue 中回调，禁止在其他场景调用
+    virtual void HandleResponse(bool eventStatus) = 0;
+};
+
+// 分片的调用登记表。按地址选择分片，登记、注销只锁所在的分片，不同线程建立、结束调用时互不等待。
+// 查找和关闭时持有所在分片的锁，调用在此期间不会析构（析构时须先注销）
+template<typename T>
+class CallRegistry
+{
+public:
+    CallRegistry() = default;
+    CallRegistry(const CallRegistry&) = delete;
+    CallRegistry& operator=(const CallRegistry&) = delete;
+
+    bool insert(T* call)
+    {
+        auto & shard = shard_of(call);
+        std::lock_guard<std::mutex> lg(shard.mt);
+        return shard.calls.insert(call).second;
+    }
+    void erase(T* call)
+    {
+        auto & shard = shard_of(call);
+        std::lock_guard<std::mutex> lg(shard.mt);
+        shard.calls.erase(call);
+    }
+    // call 仍然登记时，持有分片的锁调用 func(call)。返回是否找到
+    template<typename Func>
+    bool visit(T* call, Func func)
+    {
+        auto & shard = shard_of(call);
+        std::lock_guard<std::mutex> lg(shard.mt);
+        if (shard.calls.find(call) == shard.calls.end())
+            return false;
+        func(call);
+        return true;
+    }
+    // 逐个分片加锁，对登记的所有调用执行 func(call)
+    template<typename Func>
+    void for_each(Func func)
+    {
+        for (auto & shard : shards_)
+        {
+            std::lock_guard<std::mutex> lg(shard.mt);
+            for (auto & var : shard.calls)
+            {
+                func(var);
+            }
+        }
+    }
+    bool empty()
+    {
+        for (auto & shard : shards_)
+        {
+            std::lock_guard<std::mutex> lg(shard.mt);
+            if (!shard.calls.empty())
+                return false;
+        }
+        return true;
+    }
+private:
+    static const size_t kShards = 16;
+    // 独占缓存行，避免相邻分片的锁互相干扰
+    struct alignas(64) Shard
+    {
+        std::mutex mt;
+        std::unordered_set<T*> calls;
+    };
+    Shard& shard_of(T* call)
+    {
+        // 堆上的对象至少 16 字节对齐，低位没有区分度
+        auto addr = reinterpret_cast<uintptr_t>(call);
+        return shards_[((addr >> 4) ^ (addr >> 12)) % kShards];
+    }
+    Shard shards_[kShards];
+};
 
 //AsyncClientCall Interface
-class AsyncClientCall
+class AsyncClientCall : public AsyncTag
 {
 public:
     AsyncClientCall()
     {
         // 所有长连接都需要在退出时主动关闭的
-        std::lock_guard<std::mutex> lg(mt_);
-        auto success = handle_.insert(this);
-        assert("handle_ 插入新的元素失败" && success.second);
+        auto success = registry_.insert(this);
+        assert("registry_ 插入新的元素失败" && success);
     }
     virtual ~AsyncClientCall()
     {
-        std::lock_guard<std::mutex> lg(mt_);
-        handle_.erase(this);
+        registry_.erase(this);
     }
     // 可以通过 uuid 主动 close 任务
     const uintptr_t get_uuid() const {
         return reinterpret_cast<uintptr_t>(this);
     }
-    // 正常流程 && 异常
-    //除了在 completion queue 中回调，禁止在其他场景调用
-    virtual void HandleResponse(bool eventStatus) = 0;
     // 关闭
     virtual void close()
     {
@@ -51,11 +139,7 @@ public:
         try
         {
             auto call = reinterpret_cast<AsyncClientCall*>(uuid);
-            std::lock_guard<std::mutex> lg(mt_);
-            if (handle_.find(call) != handle_.end())
-            {
-                call->close();
-            }
+            registry_.visit(call, [](AsyncClientCall* var) { var->close(); });
         }
         catch (const std::exception&)
         {
@@ -66,11 +150,7 @@ public:
     {
         try
         {
-            std::lock_guard<std::mutex> lg(mt_);
-            for (auto & var : handle_)
-            {
-                var->close();
-            }
+            registry_.for_each([](AsyncClientCall* var) { var->close(); });
         }
         catch (const std::exception&)
         {
@@ -80,8 +160,7 @@ public:
 
     static bool empty()
     {
-        std::lock_guard<std::mutex> lg(mt_);
-        return handle_.empty();
+        return registry_.empty();
     }
 protected:
     enum class CallStatus { CREATE, PROCESS, FINISH };
@@ -115,8 +194,7 @@ private:
     grpc::ClientContext context_;
     // used by rpc->Finish()
     grpc::Status status_;
-    static std::set<AsyncClientCall*> handle_;
-    static std::mutex mt_;
+    static CallRegistry<AsyncClientCall> registry_;
 };
 
 using namespace hellostreamingworld;
@@ -125,8 +203,8 @@ using namespace hellostreamingworld;
 //私有化构造函数等
 class AsyncBidiCall final : public AsyncClientCall, std::enable_shared_from_this<AsyncBidiCall>
 {
-    typedef typename HelloReply ReturnT;
-    typedef typename HelloRequest RequestT;
+    typedef HelloReply ReturnT;
+    typedef HelloRequest RequestT;
     using rpc_t = ::grpc::ClientAsyncReaderWriter< RequestT, ReturnT>;
     using self_t = AsyncBidiCall;
 
@@ -134,71 +212,193 @@ class AsyncBidiCall final : public AsyncClientCall, std::enable_shared_from_this
     //=channel is connected && rpc has been assigned && there is no outstanding write opr
     enum class WriteState { IDLE, WRITING, STOP };
     WriteState wrt_state_ = WriteState::STOP;
-    // 私有类。只用于 rpc->write()，不用于 read()/finish() 等异步方法。要求线程安全
+    // 私有类。只用于 rpc->write()，不用于 read()/finish() 等异步方法。
     // 为什么要使用 AsyncWriteCall 类型？区分 cq 回调对应的是 rpc->write() 还是 rpc->read()，尤其是 eventStatus(false) 的时候
-    class AsyncWriteCall final : public AsyncClientCall
+    // 只是 cq 的 tag，不是独立的调用：不持有 ClientContext，不登记到 AsyncClientCall 的全局容器。
+    // 写完成后回收到 owner 的空闲链表中复用，稳定后每条消息不再分配内存
+    class AsyncWriteCall final : public AsyncTag
     {
-        std::atomic_bool has_response_ = false;
-        const std::string uuid_;
-        const RequestT request_;
+        uint64_t id_ = 0;
+        RequestT request_;
         AsyncBidiCall * owner_ = nullptr;
     public:
-        AsyncWriteCall(AsyncBidiCall* owner, std::string uuid, RequestT request) :
-            uuid_(std::move(uuid)), request_(std::move(request)), owner_(owner)
+        AsyncWriteCall* next_ = nullptr;    // 待写队列或空闲链表中的下一个，由 owner 的 mt_ 保护
+        explicit AsyncWriteCall(AsyncBidiCall* owner) : owner_(owner)
         {
             assert(nullptr != owner_);
         }
+        uint64_t id() const { return id_; }
+        void set_id(uint64_t id) { id_ = id; }
+        RequestT& request() { return request_; }
         const RequestT& request() const { return request_; }
         //除了在 completion queue 中回调，禁止在其他场景调用
         void HandleResponse(bool eventStatus) override
         {
+            // write_next() 会回收 this，之后不能再访问成员
             if (eventStatus)
             {
-                spdlog::info("write {} successfully. {}", uuid_, request_.DebugString());
+                if (should_log(spdlog::level::debug))
+                    spdlog::debug("write {} successfully. {}", id_, request_.DebugString());
                 owner_->write_next();
             }
             else
             {
-                spdlog::warn("write {} failed. {}", uuid_, request_.DebugString());
+                if (should_log(spdlog::level::warn))
+                    spdlog::warn("write {} failed. {}", id_, request_.DebugString());
                 owner_->stop_write();
             }
-            has_response_ = true;
-        }
-        ~AsyncWriteCall()
-        {
-            if (!has_response_)
-                spdlog::warn("~write {} not executed. {}", uuid_, request_.DebugString());
-            else
-                spdlog::debug("~write {} executed. {}", uuid_, request_.DebugString());
         }
     };
-    std::mutex mt_; // 针对 wrt_call_buffer_, wrt_call_ 和 wrt_state_
-    std::unique_ptr<AsyncWriteCall> wrt_call_;
-    std::queue<std::unique_ptr<AsyncWriteCall>> wrt_call_buffer_;
+    std::mutex mt_; // 针对 wrt_call_, wrt_head_/wrt_tail_, wrt_free_ 和 wrt_state_
+    AsyncWriteCall* wrt_call_ = nullptr;    // outstanding write
+    AsyncWriteCall* wrt_head_ = nullptr;    // 待写队列，先进先出
+    AsyncWriteCall* wrt_tail_ = nullptr;
+    AsyncWriteCall* wrt_free_ = nullptr;    // 空闲链表
+    std::vector<std::unique_ptr<AsyncWriteCall>> wrt_pool_;   // 持有分配过的所有 AsyncWriteCall
 
     ReturnT reply_; // 只在 cq 线程中使用则无需加锁
+public:
+    // 回复的接收者。replies 中的回复已经从 reply_ 中移出（Swap，不复制），可以直接移走
+    using reply_sink_t = std::function<void(std::vector<ReturnT>& replies)>;
+private:
+    reply_sink_t reply_sink_;
+    std::vector<ReturnT> reply_batch_;      // 在 cq 线程中直接回调时使用
+    // 交给工作线程时使用，reply_mt_ 针对 reply_pending_ 和 reply_stop_
+    std::mutex reply_mt_;
+    std::condition_variable reply_cv_;
+    std::vector<ReturnT> reply_pending_;
+    size_t reply_max_batch_ = 1;
+    bool reply_stop_ = false;
+    std::thread reply_worker_;
     std::unique_ptr< rpc_t> rpc_;
-    std::weak_ptr<MultiGreeter::Stub> stub_wptr_;
+    // 持有 stub 直到调用释放。来自 ChannelPool::acquire() 时，据此统计连接上的在途调用
+    std::shared_ptr<MultiGreeter::Stub> stub_;
     std::shared_ptr<AsyncBidiCall> myself_;
 
-    AsyncBidiCall(std::shared_ptr<MultiGreeter::Stub> stub = nullptr) : stub_wptr_{ stub }
+    AsyncBidiCall(std::shared_ptr<MultiGreeter::Stub> stub = nullptr) : stub_{ std::move(stub) }
     {
         //myself_ = shared_from_this();     // 尚未构造完毕
     }
+    void deliver_reply()    // 限于 HandleResponse() 中使用
+    {
+        if (!reply_worker_.joinable())
+        {
+            reply_batch_.resize(1);
+            reply_batch_.front().Swap(&reply_);
+            reply_sink_(reply_batch_);
+            reply_batch_.clear();
+            return;
+        }
+        std::lock_guard<std::mutex> lg(reply_mt_);
+        reply_pending_.emplace_back();
+        reply_pending_.back().Swap(&reply_);
+        reply_cv_.notify_one();
+    }
+    // 工作线程：取走积压的回复，每批最多 reply_max_batch_ 条。结束时先处理完积压的回复
+    void reply_worker()
+    {
+        std::vector<ReturnT> batch;
+        std::unique_lock<std::mutex> lk(reply_mt_);
+        while (true)
+        {
+            reply_cv_.wait(lk, [this] { return reply_stop_ || !reply_pending_.empty(); });
+            if (reply_pending_.empty())
+                break;
+            if (reply_pending_.size() <= reply_max_batch_)
+            {
+                batch.swap(reply_pending_);     // reply_pending_ 换回 batch 已分配的空间
+            }
+            else
+            {
+                auto end = reply_pending_.begin() + reply_max_batch_;
+                batch.assign(std::make_move_iterator(reply_pending_.begin()), std::make_move_iterator(end));
+                reply_pending_.erase(reply_pending_.begin(), end);
+            }
+            lk.unlock();
+            reply_sink_(batch);
+            batch.clear();
+            lk.lock();
+        }
+    }
+    void stop_reply_worker()
+    {
+        if (!reply_worker_.joinable())
+            return;
+        do {
+            std::lock_guard<std::mutex> lg(reply_mt_);
+            reply_stop_ = true;
+        } while (false);
+        reply_cv_.notify_one();
+        reply_worker_.join();
+    }
+    // 单调递增的写操作 id，替代每次生成并格式化 uuid
+    static uint64_t next_write_id()
+    {
+        static std::atomic<uint64_t> id{ 0 };
+        return id.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+    AsyncWriteCall* acquire_write_call()    // 需持有 mt_
+    {
+        if (nullptr == wrt_free_)
+        {
+            wrt_pool_.emplace_back(new AsyncWriteCall(this));
+            return wrt_pool_.back().get();
+        }
+        auto call = wrt_free_;
+        wrt_free_ = call->next_;
+        call->next_ = nullptr;
+        return call;
+    }
+    void release_write_call(AsyncWriteCall* call)   // 需持有 mt_
+    {
+        call->next_ = wrt_free_;
+        wrt_free_ = call;
+    }
+    uint64_t start_write(AsyncWriteCall* call)  // 需持有 mt_
+    {
+        auto id = next_write_id();
+        call->set_id(id);
+        //writable, /wait owner's CREATE event
+        if (WriteState::IDLE == wrt_state_)
+        {
+            wrt_call_ = call;
+            wrt_state_ = WriteState::WRITING;
+            //if rpc_ is nullptr, check (wrt_state_ = WriteState::IDLE)
+            assert(rpc_);
+            rpc_->Write(call->request(), static_cast<AsyncTag*>(call));
+        }
+        else
+        {
+            if (nullptr == wrt_tail_)
+                wrt_head_ = call;
+            else
+                wrt_tail_->next_ = call;
+            wrt_tail_ = call;
+        }
+        return id;
+    }
     void write_next()   // 限于 HandleResponse() 中使用
     {
         std::lock_guard<std::mutex> lg(mt_);
-        if (wrt_call_buffer_.empty())
+        if (nullptr != wrt_call_)
+        {
+            release_write_call(wrt_call_);
+            wrt_call_ = nullptr;
+        }
+        if (nullptr == wrt_head_)
         {
             wrt_state_ = WriteState::IDLE;   // make writable
         }
         else
         {
-            wrt_call_.swap(wrt_call_buffer_.front());
-            wrt_call_buffer_.pop();
+            wrt_call_ = wrt_head_;
+            wrt_head_ = wrt_call_->next_;
+            if (nullptr == wrt_head_)
+                wrt_tail_ = nullptr;
+            wrt_call_->next_ = nullptr;
             wrt_state_ = WriteState::WRITING;
             assert(rpc_);
-            rpc_->Write(wrt_call_->request(), wrt_call_.get());
+            rpc_->Write(wrt_call_->request(), static_cast<AsyncTag*>(wrt_call_));
         }
     }
     void stop_write()
@@ -225,40 +425,54 @@ class AsyncBidiCall final : public AsyncClientCall, std::enable_shared_from_this
         }
     }
 public:
-    static std::shared_ptr<AsyncBidiCall> NewPtr()
+    static std::shared_ptr<AsyncBidiCall> NewPtr(std::shared_ptr<MultiGreeter::Stub> stub = nullptr)
     {
-        auto ptr = std::shared_ptr<AsyncBidiCall>(new AsyncBidiCall);
+        auto ptr = std::shared_ptr<AsyncBidiCall>(new AsyncBidiCall(std::move(stub)));
         ptr->myself_ = ptr;
         return ptr;
     }
+    ~AsyncBidiCall()
+    {
+        stop_reply_worker();
+        for (auto call = wrt_head_; call != nullptr; call = call->next_)
+        {
+            if (should_log(spdlog::level::warn))
+                spdlog::warn("~write {} not executed. {}", call->id(), call->request().DebugString());
+        }
+    }
     decltype(rpc_) & rpcRef()
     {
         return rpc_;
     }
-    // why is async-write so complex? https://github.com/grpc/grpc/issues/4007#issuecomment-152568219
-    //不保证发送成功。如果用户传入 uuid 则返回 uuid，若 uuid 为空，则内部生成 uuid 后返回
-    std::string write(RequestT v2, std::string uuid = "")
+    // 设置回复的接收者，须在 StartCall() 之前调用。未设置时只记录日志
+    // in_worker 为 false 时在 cq 线程中逐条回调，replies 只有一条；
+    // 为 true 时交给单独的工作线程，cq 线程移交回复后立即发起下一次 Read()，积压的回复合并成一批回调，每批最多 max_batch 条
+    void set_reply_sink(reply_sink_t sink, bool in_worker = false, size_t max_batch = 64)
     {
-        if (uuid.empty()) {
-            auto tmp = boost::uuids::random_generator();
-            uuid = boost::uuids::to_string(tmp());
-        }
-        const std::string uuidCopy = uuid;
-        std::lock_guard<std::mutex> lg(mt_);
-        //writable, /wait owner's CREATE event
-        if (WriteState::IDLE == wrt_state_)
+        assert(CallStatus::CREATE == state_ && !reply_worker_.joinable());
+        reply_sink_ = std::move(sink);
+        if (in_worker && reply_sink_)
         {
-            wrt_call_.reset(new AsyncWriteCall(this, uuid, v2));
-            wrt_state_ = WriteState::WRITING;
-            //if rpc_ is nullptr, check (wrt_state_ = WriteState::IDLE)
-            assert(rpc_);
-            rpc_->Write(wrt_call_->request(), wrt_call_.get());
+            reply_max_batch_ = std::max<size_t>(max_batch, 1);
+            reply_worker_ = std::thread(&AsyncBidiCall::reply_worker, this);
         }
-        else
-        {
-            wrt_call_buffer_.emplace(new AsyncWriteCall(this, uuid, v2));
-        }
-        return uuidCopy;
+    }
+    // why is async-write so complex? https://github.com/grpc/grpc/issues/4007#issuecomment-152568219
+    //不保证发送成功。返回本次写操作的 id（单调递增），日志中以此对应写操作的结果
+    //复制到复用的 AsyncWriteCall 中，沿用其已分配的内存
+    uint64_t write(const RequestT& v2)
+    {
+        std::lock_guard<std::mutex> lg(mt_);
+        auto call = acquire_write_call();
+        call->request().CopyFrom(v2);
+        return start_write(call);
+    }
+    uint64_t write(RequestT&& v2)
+    {
+        std::lock_guard<std::mutex> lg(mt_);
+        auto call = acquire_write_call();
+        call->request().Swap(&v2);
+        return start_write(call);
     }
 
     //除了在 completion queue 中回调，禁止在其他场景调用
@@ -292,7 +506,10 @@ public:
             if (eventStatus)
             {
                 // you're only allowed to have one outstanding at a time
-                spdlog::info("reply is:\n***************\n{}*************", reply_.DebugString());
+                if (reply_sink_)
+                    this->deliver_reply();
+                else if (should_log(spdlog::level::info))
+                    spdlog::info("reply is:\n***************\n{}*************", reply_.DebugString());
                 rpc_->Read(&reply_, this);
             }
             else
@@ -304,6 +521,7 @@ public:
         case CallStatus::FINISH:
             //释放时（比如当 read / write 失败）如果有 outstanding write / read op 就会崩溃
             log_when_finish();
+            stop_reply_worker();
             myself_.reset();
             break;
         default:
@@ -316,31 +534,48 @@ public:
 //每次 rpc 调用都会先建立连接 GetState(true) 的，但用户怎么知道要重新请求呢？
 //用户一直重试吗（或者某层的 write() 持续重试）？还是等底层事件通知呢？
 //如果等事件的话，那还是要底层做重连的呀
+// 把 now + timeout 向上取整到整分钟，作为 ChannelStateMonitor 的监视超时。
+// 这只是对齐截止时间，不是共享的定时轮：每个监视仍各自向完成队列注册超时，只是截止时间相同，
+// 监视大量 channel 时超时集中在少数几个时刻一起返回，而不是分散地各自唤醒
+inline std::chrono::system_clock::time_point align_deadline(std::chrono::seconds timeout)
+{
+    using namespace std::chrono;
+    const long long tick = 60;
+    auto due = duration_cast<seconds>((system_clock::now() + timeout).time_since_epoch()).count();
+    return system_clock::time_point(seconds((due + tick - 1) / tick * tick));
+}
+
+// 事件驱动：NotifyOnStateChange() 只在状态变化时返回，超时很长（默认 30 分钟），空闲时几乎没有唤醒，超时也不记 info 日志。
+// 监视本身取消不了（grpc::Alarm 也不行，见 README），所以只持有 channel 的弱引用：channel 析构时监视立即返回，监视器随之释放。
+// close() 之后不再回调、不再监视，但仍要等这次监视返回（状态变化或 channel 析构），所以退出前应先释放 channel。
 class ChannelStateMonitor final: public AsyncClientCall
 {
-    std::shared_ptr<grpc::Channel> _channel;
+    std::weak_ptr<grpc::Channel> channel_;
     grpc::CompletionQueue* cq_;
-    grpc_connectivity_state state_ = GRPC_CHANNEL_READY;
-    std::atomic<bool> run_;
+    grpc_connectivity_state state_ = GRPC_CHANNEL_IDLE;
+    std::atomic<bool> run_{ true };
     // to be a channel state observer when try_to_connect_ is false.
     const bool try_to_connect_;
+    const std::chrono::seconds timeout_;
     std::shared_ptr<ChannelStateMonitor> myself_;
-    // 改用五秒甚至五分钟后，如何取消此定时器呢？取消不了，只能 short timeout + loop
-    constexpr static std::chrono::seconds second1s_ = std::chrono::seconds(2);
     using monitor_func_t = std::function<void(grpc_connectivity_state old_state, grpc_connectivity_state new_state)>;
-    ChannelStateMonitor(std::shared_ptr<grpc::Channel> ch, grpc::CompletionQueue* cq, monitor_func_t m = nullptr) :
-        _channel(ch), cq_(cq), on_channel_state_change_(m), try_to_connect_(m != nullptr)
+    ChannelStateMonitor(std::shared_ptr<grpc::Channel> ch, grpc::CompletionQueue* cq, monitor_func_t m, std::chrono::seconds timeout) :
+        channel_(ch), cq_(cq), try_to_connect_(m != nullptr), timeout_(timeout), on_channel_state_change_(m)
     {
-        // 底层重连尝试的间隔是 1-2-4-8-16- 增加的，考虑是否使用
-        auto current_state = _channel->GetState(try_to_connect_);
-        auto deadline = std::chrono::system_clock::now() + second1s_;
-        _channel->NotifyOnStateChange(current_state, deadline, cq_, this);
+    }
+    void watch(grpc::Channel& channel)
+    {
+        channel.NotifyOnStateChange(state_, align_deadline(timeout_), cq_, static_cast<AsyncTag*>(this));
     }
 public:
-    static std::shared_ptr<ChannelStateMonitor> NewPtr(std::shared_ptr<grpc::Channel> ch, grpc::CompletionQueue* cq)
+    static std::shared_ptr<ChannelStateMonitor> NewPtr(std::shared_ptr<grpc::Channel> ch, grpc::CompletionQueue* cq,
+        monitor_func_t m = nullptr, std::chrono::seconds timeout = std::chrono::minutes(30))
     {
-        auto ptr = std::shared_ptr<ChannelStateMonitor>(new ChannelStateMonitor{ ch, cq });
+        auto ptr = std::shared_ptr<ChannelStateMonitor>(new ChannelStateMonitor{ ch, cq, m, timeout });
         ptr->myself_ = ptr;
+        // 底层重连尝试的间隔是 1-2-4-8-16- 增加的，考虑是否使用
+        ptr->state_ = ch->GetState(ptr->try_to_connect_);
+        ptr->watch(*ch);
         return ptr;
     }
     void close() override
@@ -349,7 +584,8 @@ public:
     }
     void HandleResponse(bool eventStatus) override
     {
-        if (false == run_)
+        auto channel = channel_.lock();
+        if (false == run_ || nullptr == channel)
         {
             myself_.reset();
             return;
@@ -357,19 +593,25 @@ public:
         if (eventStatus)
         {
             // channel's state changed.
-            auto current_state = _channel->GetState(try_to_connect_);
-            spdlog::info("channel_state_change: {}->{}. {}", state_, current_state, comment(current_state));
+            auto current_state = channel->GetState(try_to_connect_);
+            if (should_log(spdlog::level::info))
+                spdlog::info("channel_state_change: {}->{}. {}", state_, current_state, comment(current_state));
             if (on_channel_state_change_)
                 on_channel_state_change_(state_, current_state);
             state_ = current_state;
+            if (GRPC_CHANNEL_SHUTDOWN == state_)
+            {
+                myself_.reset();
+                return;
+            }
         }
         else
         {
             // timeout
-            spdlog::info("NotifyOnStateChange() timeout after {}.", second1s_);
+            if (should_log(spdlog::level::debug))
+                spdlog::debug("NotifyOnStateChange() timeout after {}.", timeout_);
         }
-        auto deadline = std::chrono::system_clock::now() + second1s_;
-        _channel->NotifyOnStateChange(state_, deadline, cq_, this);
+        watch(*channel);
     }
 private:
     static std::string comment(grpc_connectivity_state state)
@@ -390,24 +632,112 @@ private:
     monitor_func_t on_channel_state_change_ ;   // 暂时未使用
 };
 
-// 使 ch 自动重连。返回其之前是否启用了自动重连。要求 ChannelStateMonitor 支持自动重连才行
-static bool enable_auto_reconnect(std::shared_ptr<grpc::Channel> ch, grpc::CompletionQueue* cq)
+// 到同一 target 的多条连接。单条 HTTP/2 连接受 max-concurrent-streams 和单个 TCP 窗口的限制，
+// 流多了之后吞吐上不去，所以建立 K 条连接，新调用分给在途调用最少的那条。
+// 每条连接的 channel args 各不相同，避免共享 subchannel（否则 K 个 channel 底下还是同一条 TCP 连接）；
+// 每条连接各有一个 ChannelStateMonitor 独立重连。线程安全。
+// 退出前先 close()，释放 channel 之后 ChannelStateMonitor 才能退出，见 ChannelStateMonitor
+class ChannelPool final
 {
-    // TODO 是否会影响 channel 析构
-    static std::map<std::shared_ptr<grpc::Channel>, std::weak_ptr<ChannelStateMonitor>> channel2monitor;
-    auto ctor = channel2monitor.find(ch);
-    if (ctor != channel2monitor.cend())
+    struct Member
     {
-        if (auto ptr = ctor->second.lock())
+        std::shared_ptr<grpc::Channel> channel;
+        std::shared_ptr<MultiGreeter::Stub> stub;
+        std::weak_ptr<ChannelStateMonitor> monitor;
+        std::atomic<int> outstanding{ 0 };
+        std::atomic<int> state{ GRPC_CHANNEL_IDLE };
+    };
+    mutable std::mutex mt_;
+    std::vector<std::shared_ptr<Member>> members_;
+    std::atomic<size_t> cursor_{ 0 };
+    static bool usable(const Member& m)
+    {
+        auto state = m.state.load(std::memory_order_relaxed);
+        return GRPC_CHANNEL_TRANSIENT_FAILURE != state && GRPC_CHANNEL_SHUTDOWN != state;
+    }
+public:
+    ChannelPool(const std::string& target, std::shared_ptr<grpc::ChannelCredentials> creds, grpc::CompletionQueue* cq,
+        size_t size = 4, const grpc::ChannelArguments& args = grpc::ChannelArguments())
+    {
+        assert(size > 0);
+        members_.reserve(size);
+        for (size_t i = 0; i < size; ++i)
         {
-            return true;
+            auto member = std::make_shared<Member>();
+            auto member_args = args;
+            member_args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+            member_args.SetInt("grpc.channel_pool.index", static_cast<int>(i));     // 参与 subchannel 的比较
+            member->channel = grpc::CreateCustomChannel(target, creds, member_args);
+            member->stub = MultiGreeter::NewStub(member->channel);
+            // 回调只持有弱引用，Member 持有 channel，否则 channel 永远不会析构
+            std::weak_ptr<Member> wptr = member;
+            member->monitor = ChannelStateMonitor::NewPtr(member->channel, cq,
+                [wptr](grpc_connectivity_state, grpc_connectivity_state new_state) {
+                if (auto m = wptr.lock())
+                    m->state = new_state;
+            });
+            members_.push_back(std::move(member));
         }
-        else
+    }
+    ~ChannelPool()
+    {
+        close();
+    }
+    ChannelPool(const ChannelPool&) = delete;
+    ChannelPool& operator=(const ChannelPool&) = delete;
+    // 选出在途调用最少的连接（优先不在 TRANSIENT_FAILURE 的），返回其 stub。
+    // 返回的 stub 全部释放后才算调用结束，所以交给 AsyncBidiCall::NewPtr() 由调用持有。close() 之后返回 nullptr
+    std::shared_ptr<MultiGreeter::Stub> acquire()
+    {
+        std::lock_guard<std::mutex> lg(mt_);
+        if (members_.empty())
+            return nullptr;
+        // 从轮转的位置开始比较，在途调用一样多时不总是选第一条
+        const auto size = members_.size();
+        const auto start = cursor_.fetch_add(1, std::memory_order_relaxed);
+        Member* best = nullptr;
+        size_t best_index = 0;
+        for (size_t i = 0; i < size; ++i)
         {
-            channel2monitor.erase(ctor);
+            auto index = (start + i) % size;
+            auto& m = *members_[index];
+            if (nullptr == best || (usable(m) && !usable(*best)) ||
+                (usable(m) == usable(*best) && m.outstanding < best->outstanding))
+            {
+                best = &m;
+                best_index = index;
+            }
         }
+        auto member = members_[best_index];
+        member->outstanding.fetch_add(1, std::memory_order_relaxed);
+        // 别名构造：指向 stub，释放时计数减一。同时持有 Member，close() 之后在途的调用仍可用
+        return std::shared_ptr<MultiGreeter::Stub>(member->stub.get(), [member](MultiGreeter::Stub*) {
+            member->outstanding.fetch_sub(1, std::memory_order_relaxed);
+        });
     }
-    channel2monitor[ch] = ChannelStateMonitor::NewPtr(ch, cq);
-    return false;
-}
-
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lg(mt_);
+        return members_.size();
+    }
+    // 第 index 条连接上的在途调用
+    int outstanding(size_t index) const
+    {
+        std::lock_guard<std::mutex> lg(mt_);
+        return index < members_.size() ? members_[index]->outstanding.load() : 0;
+    }
+    // 停止监视并释放连接。在途调用持有的连接等调用结束后释放
+    void close()
+    {
+        std::vector<std::shared_ptr<Member>> members;
+        do {
+            std::lock_guard<std::mutex> lg(mt_);
+            members.swap(members_);
+        } while (false);
+        for (auto& m : members)
+        {
+            if (auto monitor = m->monitor.lock())
+                monitor->close();
+        }
+    }
+};
@@ -38,7 +38,7 @@
 #include <thread>
 
 #include <grpc++/grpc++.h>
-#include "../AsyncBidiCall.h"
+#include "AsyncBidiCall.h"
 #include "hellostreamingworld.grpc.pb.h"
 
 using grpc::Channel;
@@ -50,16 +50,15 @@ using hellostreamingworld::HelloRequest;
 using hellostreamingworld::HelloReply;
 using hellostreamingworld::MultiGreeter;
 
-std::set<AsyncClientCall*> AsyncClientCall::handle_;
-std::mutex AsyncClientCall::mt_;
+CallRegistry<AsyncClientCall> AsyncClientCall::registry_;
 
 // NOTE: This is a complex example for an asynchronous, bidirectional streaming
 // client. For a simpler example, start with the
 // greeter_client/greeter_async_client first.
 class AsyncBidiGreeterClient {
  public:
-  explicit AsyncBidiGreeterClient(std::shared_ptr<Channel> channel)
-      : stub_(MultiGreeter::NewStub(channel)) {
+  explicit AsyncBidiGreeterClient(const std::string& target)
+      : pool_(target, grpc::InsecureChannelCredentials(), &cq_) {
     grpc_thread_.reset(
         new std::thread(std::bind(&AsyncBidiGreeterClient::GrpcThread, this)));
 
@@ -79,11 +78,12 @@ class AsyncBidiGreeterClient {
           ptr->write(req);  // ܲ
       }
       else {
-          auto call_ = AsyncBidiCall::NewPtr();
-          assert(stub_ != nullptr);
-          call_->rpcRef() = stub_->PrepareAsyncSayHello(&call_->context(), &cq_);
+          auto stub = pool_.acquire();
+          assert(stub != nullptr);
+          auto call_ = AsyncBidiCall::NewPtr(stub);
+          call_->rpcRef() = stub->PrepareAsyncSayHello(&call_->context(), &cq_);
           // ʽӣÿε rpc Զ
-          call_->rpcRef()->StartCall(reinterpret_cast<void*>(call_.get()));
+          call_->rpcRef()->StartCall(static_cast<AsyncTag*>(call_.get()));
           call_->write(req);  // ܷʧ
           singleton_ = call_;
       }
@@ -92,6 +92,7 @@ class AsyncBidiGreeterClient {
 
   ~AsyncBidiGreeterClient() {
       AsyncClientCall::closeAll();
+      pool_.close();
       // ȴ첽ģرղʽɣ Shutdown() ֮ cq_ µ eventɱ
       while (!AsyncClientCall::empty())
       {
@@ -118,7 +119,7 @@ class AsyncBidiGreeterClient {
           spdlog::error("Client stream closed. Quitting");
         break;
       }
-      AsyncClientCall* ptr = reinterpret_cast<AsyncClientCall*>(got_tag);
+      AsyncTag* ptr = static_cast<AsyncTag*>(got_tag);
       ptr->HandleResponse(ok);
 
     }
@@ -129,17 +130,16 @@ class AsyncBidiGreeterClient {
   // gRPC runtime.
   CompletionQueue cq_;
 
-  // Out of the passed in Channel comes the stub, stored here, our view of the
-  // server's exposed services.
-  std::shared_ptr<MultiGreeter::Stub> stub_;
+  // Connections to the server. Each call takes the stub of the connection
+  // with the fewest outstanding calls.
+  ChannelPool pool_;
 
   // Thread that notifies the gRPC completion queue tags.
   std::unique_ptr<std::thread> grpc_thread_;
 };
 
 int main(int argc, char** argv) {
-  AsyncBidiGreeterClient greeter(grpc::CreateChannel(
-      "localhost:50051", grpc::InsecureChannelCredentials()));
+  AsyncBidiGreeterClient greeter("localhost:50051");
 
   std::string text;
   while (true) {
@@ -0,0 +1,269 @@
+﻿// AsyncBidiCall::write() 的微基准。
+// 进程内启动一个只读取请求的 MultiGreeter 服务端，在同一个双向流上分批连续写消息，
+// 统计生产者线程中每次 write() 的耗时，与改动之前的写路径（LegacyBidiCall）对比：
+// 旧的写路径每条消息生成 boost uuid，new 一个带 ClientContext、登记到全局容器的 AsyncWriteCall，
+// 写完成时无论日志级别都格式化 DebugString()。
+// 每批写完后等服务端收齐再写下一批，第一批用于热身（AsyncWriteCall 的池子在这里分配），不计入结果。
+// 日志级别为 warn，输出到 null sink，与线上配置一致。
+//
+// 用法：write_bench [batch] [rounds]
+#include <boost/uuid/uuid.hpp>
+#include <boost/uuid/uuid_io.hpp>
+#include <boost/uuid/random_generator.hpp>
+#include <spdlog/sinks/null_sink.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <queue>
+#include <string>
+#include <thread>
+
+#include <grpc++/grpc++.h>
+#include "AsyncBidiCall.h"
+#include "hellostreamingworld.grpc.pb.h"
+
+#ifdef _MSC_VER
+#pragma comment(lib, "bcrypt.lib")
+#endif
+
+CallRegistry<AsyncClientCall> AsyncClientCall::registry_;
+
+// 改动之前 AsyncBidiCall 的写路径，只保留基准用到的部分
+class LegacyBidiCall final : public AsyncClientCall
+{
+    typedef HelloReply ReturnT;
+    typedef HelloRequest RequestT;
+    using rpc_t = ::grpc::ClientAsyncReaderWriter< RequestT, ReturnT>;
+
+    enum class WriteState { IDLE, WRITING, STOP };
+    WriteState wrt_state_ = WriteState::STOP;
+    class AsyncWriteCall final : public AsyncClientCall
+    {
+        const std::string uuid_;
+        const RequestT request_;
+        LegacyBidiCall * owner_ = nullptr;
+    public:
+        AsyncWriteCall(LegacyBidiCall* owner, std::string uuid, RequestT request) :
+            uuid_(std::move(uuid)), request_(std::move(request)), owner_(owner)
+        {
+        }
+        const RequestT& request() const { return request_; }
+        void HandleResponse(bool eventStatus) override
+        {
+            // write_next() 会释放 this，之后不能再访问成员
+            if (eventStatus)
+            {
+                spdlog::info("write {} successfully. {}", uuid_, request_.DebugString());
+                owner_->write_next();
+            }
+            else
+            {
+                spdlog::warn("write {} failed. {}", uuid_, request_.DebugString());
+                owner_->stop_write();
+            }
+        }
+    };
+    std::mutex mt_;
+    std::unique_ptr<AsyncWriteCall> wrt_call_;
+    std::queue<std::unique_ptr<AsyncWriteCall>> wrt_call_buffer_;
+
+    ReturnT reply_;
+    std::unique_ptr< rpc_t> rpc_;
+    std::shared_ptr<LegacyBidiCall> myself_;
+
+    LegacyBidiCall() = default;
+    void write_next()
+    {
+        std::lock_guard<std::mutex> lg(mt_);
+        if (wrt_call_buffer_.empty())
+        {
+            wrt_state_ = WriteState::IDLE;
+        }
+        else
+        {
+            wrt_call_.swap(wrt_call_buffer_.front());
+            wrt_call_buffer_.pop();
+            wrt_state_ = WriteState::WRITING;
+            rpc_->Write(wrt_call_->request(), static_cast<AsyncTag*>(wrt_call_.get()));
+        }
+    }
+    void stop_write()
+    {
+        std::lock_guard<std::mutex> lg(mt_);
+        wrt_state_ = WriteState::STOP;
+    }
+public:
+    static std::shared_ptr<LegacyBidiCall> NewPtr(std::shared_ptr<MultiGreeter::Stub> = nullptr)
+    {
+        auto ptr = std::shared_ptr<LegacyBidiCall>(new LegacyBidiCall());
+        ptr->myself_ = ptr;
+        return ptr;
+    }
+    decltype(rpc_) & rpcRef()
+    {
+        return rpc_;
+    }
+    std::string write(RequestT v2, std::string uuid = "")
+    {
+        if (uuid.empty()) {
+            auto tmp = boost::uuids::random_generator();
+            uuid = boost::uuids::to_string(tmp());
+        }
+        const std::string uuidCopy = uuid;
+        std::lock_guard<std::mutex> lg(mt_);
+        if (WriteState::IDLE == wrt_state_)
+        {
+            wrt_call_.reset(new AsyncWriteCall(this, uuid, v2));
+            wrt_state_ = WriteState::WRITING;
+            rpc_->Write(wrt_call_->request(), static_cast<AsyncTag*>(wrt_call_.get()));
+        }
+        else
+        {
+            wrt_call_buffer_.emplace(new AsyncWriteCall(this, uuid, v2));
+        }
+        return uuidCopy;
+    }
+    void HandleResponse(bool eventStatus) override
+    {
+        switch (state_)
+        {
+        case CallStatus::CREATE:
+            if (eventStatus)
+            {
+                this->write_next();
+                state_ = CallStatus::PROCESS;
+                rpc_->Read(&reply_, this);
+            }
+            else
+            {
+                state_ = CallStatus::FINISH;
+                rpc_->Finish(&status(), this);
+            }
+            break;
+        case CallStatus::PROCESS:
+            // 服务端不回复，读取失败说明调用已经取消
+            state_ = CallStatus::FINISH;
+            rpc_->Finish(&status(), this);
+            break;
+        case CallStatus::FINISH:
+            myself_.reset();
+            break;
+        }
+    }
+};
+
+// 只读取请求、不回复的服务端，记录收到的消息数
+class CountingGreeter final : public MultiGreeter::Service
+{
+    std::atomic<uint64_t> received_{ 0 };
+public:
+    grpc::Status SayHello(grpc::ServerContext* context,
+        grpc::ServerReaderWriter<HelloReply, HelloRequest>* stream) override
+    {
+        HelloRequest request;
+        while (stream->Read(&request))
+        {
+            received_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return grpc::Status::OK;
+    }
+    uint64_t received() const
+    {
+        return received_.load(std::memory_order_relaxed);
+    }
+    void wait_for(uint64_t count) const
+    {
+        while (received() < count)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+};
+
+// 在一个新的双向流上分批写 batch * rounds 条消息，返回第一批之后每次 write() 的平均纳秒数
+template<typename Call>
+double run(MultiGreeter::Stub& stub, grpc::CompletionQueue& cq, const CountingGreeter& service,
+    size_t batch, size_t rounds, double* msgs_per_sec)
+{
+    using clock = std::chrono::steady_clock;
+    auto call = Call::NewPtr();
+    call->rpcRef() = stub.PrepareAsyncSayHello(&call->context(), &cq);
+    call->rpcRef()->StartCall(static_cast<AsyncTag*>(call.get()));
+
+    HelloRequest request;
+    request.set_name("order-123456");
+    request.set_num_greetings(3);
+
+    const uint64_t base = service.received();
+    clock::duration spent{ 0 };
+    clock::time_point begin;
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        auto start = clock::now();
+        if (1 == round)
+            begin = start;
+        for (size_t i = 0; i < batch; ++i)
+        {
+            call->write(request);
+        }
+        if (round > 0)
+            spent += clock::now() - start;
+        service.wait_for(base + (round + 1) * batch);
+    }
+    const double writes = static_cast<double>(batch * (rounds - 1));
+    *msgs_per_sec = writes / std::chrono::duration<double>(clock::now() - begin).count();
+
+    call->close();
+    call.reset();
+    return std::chrono::duration<double, std::nano>(spent).count() / writes;
+}
+
+int main(int argc, char** argv)
+{
+    const size_t batch = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000;
+    const size_t rounds = std::max<size_t>(argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 200, 2);
+
+    spdlog::set_default_logger(std::make_shared<spdlog::logger>("bench", std::make_shared<spdlog::sinks::null_sink_mt>()));
+    spdlog::set_level(spdlog::level::warn);
+
+    CountingGreeter service;
+    int port = 0;
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &port);
+    builder.RegisterService(&service);
+    auto server = builder.BuildAndStart();
+    if (!server || 0 == port)
+    {
+        std::fprintf(stderr, "cannot start the server\n");
+        return 1;
+    }
+
+    grpc::CompletionQueue cq;
+    std::thread cq_thread([&cq] {
+        void* tag = nullptr;
+        bool ok = false;
+        while (cq.Next(&tag, &ok))
+        {
+            static_cast<AsyncTag*>(tag)->HandleResponse(ok);
+        }
+    });
+    auto channel = grpc::CreateChannel("127.0.0.1:" + std::to_string(port), grpc::InsecureChannelCredentials());
+    auto stub = MultiGreeter::NewStub(channel);
+
+    double legacy_rate = 0, pooled_rate = 0;
+    double legacy_ns = run<LegacyBidiCall>(*stub, cq, service, batch, rounds, &legacy_rate);
+    double pooled_ns = run<AsyncBidiCall>(*stub, cq, service, batch, rounds, &pooled_rate);
+    std::printf("legacy  %8.1f ns/write  %10.0f msgs/s\n", legacy_ns, legacy_rate);
+    std::printf("pooled  %8.1f ns/write  %10.0f msgs/s\n", pooled_ns, pooled_rate);
+
+    // 等调用都结束后才能关闭完成队列
+    while (!AsyncClientCall::empty())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    server->Shutdown();
+    cq.Shutdown();
+    cq_thread.join();
+    return 0;
+}